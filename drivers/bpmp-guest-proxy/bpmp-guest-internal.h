@@ -0,0 +1,37 @@
+/**
+ *
+ * NVIDIA BPMP Guest Proxy Kernel Module, internal definitions shared
+ * by the guest proxy source files
+ *
+*/
+#ifndef __BPMP_GUEST_INTERNAL__H__
+#define __BPMP_GUEST_INTERNAL__H__
+
+#include <linux/kernel.h>
+#include <soc/tegra/bpmp.h>
+#include "../bpmp-host-proxy/bpmp-host-proxy.h"
+
+
+#define DEVICE_NAME "bpmp-guest" // Device name.
+
+#define BPMP_GUEST_VERBOSE    0
+
+#if BPMP_GUEST_VERBOSE
+#define deb_info(...)     printk(KERN_INFO DEVICE_NAME ": "__VA_ARGS__)
+#else
+#define deb_info(...)
+#endif
+
+#define deb_error(...)    printk(KERN_ALERT DEVICE_NAME ": "__VA_ARGS__)
+
+// bpmp-guest-virtio.c
+#if IS_ENABLED(CONFIG_TEGRA_BPMP_GUEST_VIRTIO)
+bool bpmp_guest_virtio_transfer(struct tegra_bpmp_message *msg, int *ret);
+#else
+static inline bool bpmp_guest_virtio_transfer(struct tegra_bpmp_message *msg, int *ret)
+{
+	return false;
+}
+#endif
+
+#endif
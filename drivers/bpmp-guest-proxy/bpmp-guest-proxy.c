@@ -14,10 +14,18 @@
 #include <linux/mm.h>
 #include <linux/memory_hotplug.h>
 #include <linux/io.h>
+#include <linux/of.h>
+#include <linux/bitops.h>
+#include <linux/bitmap.h>
+#include <linux/irqflags.h>
+#include <linux/ktime.h>
+#include <linux/iopoll.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
 #include <soc/tegra/bpmp.h>
+#include "bpmp-guest-internal.h"
 
 
-#define DEVICE_NAME "bpmp-guest" // Device name.
 #define CLASS_NAME "char"	  
 
 MODULE_LICENSE("GPL");						 
@@ -36,18 +44,102 @@ MODULE_VERSION("0.1");
 #define MESSAGE_SIZE   0x0200
 
 
-#define BPMP_GUEST_VERBOSE    0
 
-#if BPMP_GUEST_VERBOSE
-#define deb_info(...)     printk(KERN_INFO DEVICE_NAME ": "__VA_ARGS__)
-#else
-#define deb_info(...)
-#endif
+static volatile void __iomem  *mem_iova = NULL;
 
-#define deb_error(...)    printk(KERN_ALERT DEVICE_NAME ": "__VA_ARGS__)
+/**
+ * Transport of the VMM, read from its registers. Version 1 is the fixed
+ * layout, used when the VMM has no registers.
+ */
+struct bpmp_guest_transport {
+	u32 version;
+	u32 features;		///< Offered by the VMM and used by the guest
+	u32 max_payload;
+	u32 num_slots;
+	u32 slot_base;
+	u32 slot_size;
+	u32 window_size;
+	u32 atomic_slot;	///< Reserved to tegra_bpmp_transfer_atomic, or NO_SLOT
+};
 
+#define NO_SLOT        U32_MAX
 
-static volatile void __iomem  *mem_iova = NULL;
+static struct bpmp_guest_transport xport = {
+	.version = 1,
+	.window_size = MEM_SIZE,
+	.atomic_slot = NO_SLOT,
+};
+
+// Slots used by the guest, the VMM can offer more
+#define MAX_SLOTS      64
+
+// Slots with a message in flight
+static DECLARE_BITMAP(slot_busy, MAX_SLOTS);
+
+// Header fields written by the guest, and the ones the VMM answers, from rx_size on
+#define HDR_IN_SIZE     offsetof(struct bpmp_virt_msg_hdr, err)
+#define HDR_OUT_OFFSET  offsetof(struct bpmp_virt_msg_hdr, rx_size)
+
+// Wait for a slot or an answer of an atomic transfer, like tegra_bpmp_transfer_atomic
+#define ATOMIC_TIMEOUT_US  1000000
+
+// Wait for a slot or an answer of the callers that can sleep
+#define SLOT_POLL_US       20
+#define SLOT_TIMEOUT_US    60000000
+
+// The atomic slot is still submitted after a timeout
+static bool atomic_slot_stale;
+
+/**
+ * Message posted without waiting for its answer
+ */
+struct bpmp_guest_posted_op {
+	u32 mrq;
+	u32 cmd;		///< First word of the request, the command of MRQ_CLK
+};
+
+#define MAX_POSTED_OPS  16
+
+static struct bpmp_guest_posted_op posted_ops[MAX_POSTED_OPS];
+static u32 num_posted_ops;
+
+/**
+ * Posted message in a slot, to report its errors
+ */
+struct bpmp_guest_posted {
+	u32 mrq;
+	u32 tx_size;
+	u32 steps;		///< Of a compound message, 0 otherwise
+};
+
+// Slots with a posted message, also busy until reaped
+static DECLARE_BITMAP(slot_posted, MAX_SLOTS);
+static struct bpmp_guest_posted posted[MAX_SLOTS];
+
+/**
+ * With BPMP_VIRT_F_COMPOUND, the adjacent posted messages are gathered in
+ * a compound message, sent by the batch work or before any other message
+ */
+struct bpmp_guest_batch {
+	spinlock_t lock;
+	u32 steps;
+	u32 tx_size;
+	u32 rx_size;
+	u8 tx[MESSAGE_SIZE];
+};
+
+static struct bpmp_guest_batch batch = {
+	.lock = __SPIN_LOCK_UNLOCKED(batch.lock),
+};
+
+static void bpmp_guest_batch_work(struct work_struct *work);
+static DECLARE_WORK(batch_work, bpmp_guest_batch_work);
+
+// Clock and power domain state published by the host, if any
+static struct bpmp_host_state_page *state_page = NULL;
+
+// Reads of the state page racing with the host before using the transfer
+#define STATE_READ_RETRIES  16
 
 extern int tegra_bpmp_transfer(struct tegra_bpmp *, struct tegra_bpmp_message *);
 extern struct tegra_bpmp *tegra_bpmp_host_device;
@@ -179,6 +271,737 @@ void static hexDump (
 	#define hexDump(...)
 #endif
 
+/*
+ * Maps the state page published by the host, if the device tree gives
+ * its address
+ */
+static void bpmp_guest_state_map(void)
+{
+	struct device_node *np;
+	u64 state_pa;
+	int err;
+
+	np = of_find_compatible_node(NULL, NULL, "nvidia,tegra186-bpmp");
+	if (!np)
+		return;
+
+	err = of_property_read_u64(np, "virtual-state-pa", &state_pa);
+	of_node_put(np);
+	if (err)
+		return;
+
+	state_page = memremap(state_pa, sizeof(*state_page), MEMREMAP_WB);
+	if (!state_page) {
+		deb_error("memremap of the state page failed\n");
+		return;
+	}
+
+	if (READ_ONCE(state_page->magic) != BPMP_HOST_STATE_MAGIC ||
+	    READ_ONCE(state_page->max_id) != BPMP_HOST_STATE_MAX_ID) {
+		deb_error("invalid state page at 0x%llX\n", state_pa);
+		memunmap(state_page);
+		state_page = NULL;
+		return;
+	}
+
+	deb_info("state page at 0x%llX\n", state_pa);
+}
+
+/*
+ * Copies an entry of the state page, retrying while the host updates it.
+ * Returns false if it did not get a consistent copy.
+ */
+static bool bpmp_guest_state_read(const void *entry, void *copy, size_t size)
+{
+	u32 seq;
+	int i;
+
+	for (i = 0; i < STATE_READ_RETRIES; i++) {
+		seq = READ_ONCE(state_page->seq);
+		if (seq & 1) {
+			cpu_relax();
+			continue;
+		}
+		smp_rmb();
+		memcpy(copy, entry, size);
+		smp_rmb();
+		if (READ_ONCE(state_page->seq) == seq)
+			return true;
+	}
+
+	return false;
+}
+
+static bool bpmp_guest_state_answer_clk(struct tegra_bpmp_message *msg)
+{
+	const struct mrq_clk_request *clock_req = msg->tx.data;
+	struct mrq_clk_response *clock_resp = msg->rx.data;
+	struct bpmp_host_state_clk clk;
+	// bits[31..24] are the command, bits[23..0] are the clock id
+	u32 clk_cmd = clock_req->cmd_and_id >> 24;
+	u32 clk_id = clock_req->cmd_and_id & 0x00FFFFFF;
+
+	if (clk_id >= BPMP_HOST_STATE_MAX_ID ||
+	    !bpmp_guest_state_read(&state_page->clks[clk_id], &clk, sizeof(clk)))
+		return false;
+
+	switch (clk_cmd) {
+	case CMD_CLK_GET_RATE:
+		if (!(clk.flags & BPMP_HOST_STATE_RATE_VALID) ||
+		    msg->rx.size < sizeof(clock_resp->clk_get_rate))
+			return false;
+		clock_resp->clk_get_rate.rate = clk.rate;
+		return true;
+	case CMD_CLK_GET_PARENT:
+		if (!(clk.flags & BPMP_HOST_STATE_PARENT_VALID) ||
+		    msg->rx.size < sizeof(clock_resp->clk_get_parent))
+			return false;
+		clock_resp->clk_get_parent.parent_id = clk.parent;
+		return true;
+	case CMD_CLK_IS_ENABLED:
+		if (!(clk.flags & BPMP_HOST_STATE_ENABLED_VALID) ||
+		    msg->rx.size < sizeof(clock_resp->clk_is_enabled))
+			return false;
+		clock_resp->clk_is_enabled.state = !!(clk.flags & BPMP_HOST_STATE_ENABLED);
+		return true;
+	default:
+		return false;
+	}
+}
+
+static bool bpmp_guest_state_answer_pg(struct tegra_bpmp_message *msg)
+{
+	const struct mrq_pg_request *pg_req = msg->tx.data;
+	struct mrq_pg_response *pg_resp = msg->rx.data;
+	struct bpmp_host_state_pd pd;
+
+	if (msg->tx.size < offsetofend(struct mrq_pg_request, id) ||
+	    pg_req->cmd != CMD_PG_GET_STATE || pg_req->id >= BPMP_HOST_STATE_MAX_ID ||
+	    msg->rx.size < sizeof(pg_resp->get_state))
+		return false;
+
+	if (!bpmp_guest_state_read(&state_page->pds[pg_req->id], &pd, sizeof(pd)) ||
+	    !(pd.flags & BPMP_HOST_STATE_PD_VALID))
+		return false;
+
+	pg_resp->get_state.state = pd.state;
+	return true;
+}
+
+/*
+ * Answers a clock or power domain state query from the state page.
+ * Returns true, with the rx data filled in, if it was answered.
+ */
+static bool bpmp_guest_state_answer(struct tegra_bpmp_message *msg)
+{
+	bool answered;
+
+	if (!state_page || !msg->tx.data || !msg->rx.data)
+		return false;
+
+	switch (msg->mrq) {
+	case MRQ_CLK:
+		answered = msg->tx.size >= sizeof(u32) && bpmp_guest_state_answer_clk(msg);
+		break;
+	case MRQ_PG:
+		answered = bpmp_guest_state_answer_pg(msg);
+		break;
+	default:
+		answered = false;
+		break;
+	}
+
+	if (answered)
+		msg->rx.ret = 0;
+
+	return answered;
+}
+
+/*
+ * Reads the transport registers of the VMM and switches to its protocol
+ * version if the guest knows it. Keeps the fixed layout otherwise.
+ */
+static void bpmp_guest_transport_probe(void)
+{
+	struct bpmp_guest_transport regs = {};
+	void __iomem *window;
+
+	if (readl(mem_iova + BPMP_VIRT_REG_MAGIC) != BPMP_VIRT_REG_MAGIC_VALUE)
+		return;
+
+	regs.version = readl(mem_iova + BPMP_VIRT_REG_VERSION);
+	regs.features = readl(mem_iova + BPMP_VIRT_REG_FEATURES);
+	regs.max_payload = readl(mem_iova + BPMP_VIRT_REG_MAX_PAYLOAD);
+	regs.num_slots = readl(mem_iova + BPMP_VIRT_REG_NUM_SLOTS);
+	regs.slot_base = readl(mem_iova + BPMP_VIRT_REG_SLOT_BASE);
+	regs.slot_size = readl(mem_iova + BPMP_VIRT_REG_SLOT_SIZE);
+	regs.window_size = readl(mem_iova + BPMP_VIRT_REG_WINDOW_SIZE);
+
+	if (regs.version < BPMP_VIRT_TRANSPORT_VERSION || !regs.num_slots ||
+	    !regs.max_payload || regs.max_payload > MESSAGE_SIZE ||
+	    regs.slot_size < BPMP_VIRT_MSG_SIZE(regs.max_payload, regs.max_payload) ||
+	    regs.window_size < MEM_SIZE ||
+	    (u64)regs.slot_base + (u64)regs.num_slots * regs.slot_size > regs.window_size) {
+		deb_error("invalid transport registers, version %u\n", regs.version);
+		return;
+	}
+
+	// The slots can be past the registers
+	if (regs.window_size > MEM_SIZE) {
+		window = ioremap(bpmp_vpa, regs.window_size);
+		if (!window) {
+			deb_error("ioremap of %u bytes failed\n", regs.window_size);
+			return;
+		}
+		iounmap((void __iomem *)mem_iova);
+		mem_iova = window;
+	}
+
+	// With the slot states the slots can be served by an in-kernel backend
+	regs.features &= BPMP_VIRT_F_SLOT_STATE | BPMP_VIRT_F_COMPOUND;
+	if ((regs.features & BPMP_VIRT_F_SLOT_STATE) &&
+	    regs.slot_size < sizeof(struct bpmp_virt_slot_hdr) +
+	    BPMP_VIRT_MSG_SIZE(regs.max_payload, regs.max_payload))
+		regs.features &= ~BPMP_VIRT_F_SLOT_STATE;
+	writel(regs.features, mem_iova + BPMP_VIRT_REG_DRV_FEATURES);
+
+	regs.version = BPMP_VIRT_TRANSPORT_VERSION;
+	regs.num_slots = min_t(u32, regs.num_slots, MAX_SLOTS);
+
+	// The last slot is kept for the atomic transfers, if there are others
+	regs.atomic_slot = NO_SLOT;
+	if (regs.num_slots > 1) {
+		regs.num_slots--;
+		regs.atomic_slot = regs.num_slots;
+	}
+	xport = regs;
+
+	deb_info("transport version %u, %u slots of %u bytes, atomic slot %d\n",
+		xport.version, xport.num_slots, xport.slot_size, (int)xport.atomic_slot);
+}
+
+static volatile void __iomem *bpmp_guest_slot_state(u32 index)
+{
+	return mem_iova + xport.slot_base + index * xport.slot_size;
+}
+
+static volatile void __iomem *bpmp_guest_slot_msg(u32 index)
+{
+	volatile void __iomem *slot = bpmp_guest_slot_state(index);
+
+	if (xport.features & BPMP_VIRT_F_SLOT_STATE)
+		slot += sizeof(struct bpmp_virt_slot_hdr);
+
+	return slot;
+}
+
+/*
+ * Waits for a submitted slot to be done, spinning for an atomic transfer
+ * and sleeping between the polls otherwise
+ */
+static int bpmp_guest_slot_wait(u32 index, bool atomic)
+{
+	void __iomem *state = (void __iomem *)bpmp_guest_slot_state(index);
+	u32 val;
+
+	// readl() orders the reads of the answer after the state
+	if (atomic)
+		return readl_poll_timeout_atomic(state, val, val == BPMP_VIRT_SLOT_DONE,
+			1, ATOMIC_TIMEOUT_US);
+
+	return readl_poll_timeout(state, val, val == BPMP_VIRT_SLOT_DONE,
+		SLOT_POLL_US, SLOT_TIMEOUT_US);
+}
+
+/*
+ * Logs the failure of a posted message, or of the steps of a posted
+ * compound message
+ */
+static void bpmp_guest_posted_report(u32 index, volatile void __iomem *slot,
+	s32 err, s32 ret)
+{
+	volatile void __iomem *step;
+	u32 i;
+
+	if (!posted[index].steps) {
+		deb_error("posted mrq %u failed, err %d ret %d\n", posted[index].mrq, err, ret);
+		return;
+	}
+
+	step = slot + BPMP_VIRT_MSG_SIZE(posted[index].tx_size, 0);
+	for (i = 0; i < posted[index].steps; i++, step += BPMP_VIRT_STEP_SIZE(0)) {
+		err = readl(step + offsetof(struct bpmp_virt_step, err));
+		ret = readl(step + offsetof(struct bpmp_virt_step, ret));
+		if (err || ret)
+			deb_error("posted mrq %u failed, err %d ret %d\n",
+				readl(step + offsetof(struct bpmp_virt_step, mrq)), err, ret);
+	}
+}
+
+/*
+ * Completes the posted messages the VMM is done with, reporting their
+ * errors, and frees their slots. With wait, also waits for the others,
+ * like a transfer waits for its answer. Once a wait times out, the
+ * messages still pending are left for a later reap.
+ */
+static void bpmp_guest_posted_reap(bool wait)
+{
+	volatile void __iomem *slot;
+	s32 err, ret;
+	u32 index;
+
+	for_each_set_bit(index, slot_posted, xport.num_slots) {
+		if (wait && bpmp_guest_slot_wait(index, irqs_disabled())) {
+			deb_error("posted mrq %u timed out\n", posted[index].mrq);
+			wait = false;
+		}
+
+		if (readl(bpmp_guest_slot_state(index)) != BPMP_VIRT_SLOT_DONE)
+			continue;
+
+		// Another caller can be reaping it
+		if (!test_and_clear_bit(index, slot_posted))
+			continue;
+
+		slot = bpmp_guest_slot_msg(index);
+		err = readl(slot + offsetof(struct bpmp_virt_msg_hdr, err));
+		ret = readl(slot + offsetof(struct bpmp_virt_msg_hdr, ret));
+		if (err || ret)
+			bpmp_guest_posted_report(index, slot, err, ret);
+
+		writel(BPMP_VIRT_SLOT_FREE, bpmp_guest_slot_state(index));
+		clear_bit_unlock(index, slot_busy);
+	}
+}
+
+static bool bpmp_guest_slot_try_get(u32 *index)
+{
+	u32 i = find_first_zero_bit(slot_busy, xport.num_slots);
+
+	if (i < xport.num_slots && !test_and_set_bit_lock(i, slot_busy)) {
+		*index = i;
+		return true;
+	}
+
+	// Frees the slots of the completed posted messages for the next try
+	bpmp_guest_posted_reap(false);
+	return false;
+}
+
+/*
+ * Takes a free slot. The callers that can sleep poll for one, sleeping in
+ * between, the others spin for up to ATOMIC_TIMEOUT_US, since the slot
+ * can be held by the context they interrupted.
+ */
+static int bpmp_guest_slot_get(u32 *index)
+{
+	bool got;
+
+	if (irqs_disabled())
+		return read_poll_timeout_atomic(bpmp_guest_slot_try_get, got, got,
+			1, ATOMIC_TIMEOUT_US, false, index);
+
+	return read_poll_timeout(bpmp_guest_slot_try_get, got, got,
+		SLOT_POLL_US, SLOT_TIMEOUT_US, false, index);
+}
+
+static void bpmp_guest_slot_put(u32 index)
+{
+	clear_bit_unlock(index, slot_busy);
+}
+
+/*
+ * Builds the header of a message, returns false if it does not fit
+ */
+static bool bpmp_guest_slot_hdr(const struct tegra_bpmp_message *msg,
+	struct bpmp_virt_msg_hdr *hdr)
+{
+	if (msg->tx.size > xport.max_payload)
+		return false;
+
+	*hdr = (struct bpmp_virt_msg_hdr) {
+		.magic = BPMP_VIRT_MSG_MAGIC,
+		.version = BPMP_VIRT_MSG_VERSION,
+		.hdr_size = sizeof(*hdr),
+		.mrq = msg->mrq,
+		.tx_size = msg->tx.data ? msg->tx.size : 0,
+		// The BPMP does not answer more than the max payload
+		.rx_size = msg->rx.data ? min_t(size_t, msg->rx.size, xport.max_payload) : 0,
+	};
+
+	return true;
+}
+
+/*
+ * Writes a message to a slot owned by the caller and rings its doorbell.
+ * Only the header fields up to the sizes and the used tx bytes are written.
+ */
+static void bpmp_guest_slot_submit(u32 index, const struct bpmp_virt_msg_hdr *hdr,
+	const void *tx)
+{
+	volatile void __iomem *slot = bpmp_guest_slot_msg(index);
+
+	memcpy_toio(slot, hdr, HDR_IN_SIZE);
+	if (hdr->tx_size)
+		memcpy_toio(slot + sizeof(*hdr), tx, hdr->tx_size);
+
+	// With the slot states the doorbell only notifies the backend,
+	// otherwise the VMM executes the message before the write returns
+	if (xport.features & BPMP_VIRT_F_SLOT_STATE)
+		writel(BPMP_VIRT_SLOT_SUBMITTED, bpmp_guest_slot_state(index));
+	writel(index, mem_iova + BPMP_VIRT_REG_DOORBELL);
+}
+
+/*
+ * Executes a message in a slot owned by the caller. Only the sizes, return
+ * codes and used rx bytes are read back. With the slot states, the wait
+ * for the answer gives up with -ETIMEDOUT, leaving the slot submitted.
+ */
+static int bpmp_guest_slot_exec(u32 index, struct tegra_bpmp_message *msg, bool atomic)
+{
+	volatile void __iomem *state = bpmp_guest_slot_state(index);
+	volatile void __iomem *slot = bpmp_guest_slot_msg(index);
+	struct bpmp_virt_msg_hdr hdr;
+	u32 tx_size, rx_size;
+	int ret;
+
+	if (!bpmp_guest_slot_hdr(msg, &hdr))
+		return -EINVAL;
+
+	tx_size = hdr.tx_size;
+	rx_size = hdr.rx_size;
+
+	bpmp_guest_slot_submit(index, &hdr, msg->tx.data);
+
+	if (xport.features & BPMP_VIRT_F_SLOT_STATE) {
+		ret = bpmp_guest_slot_wait(index, atomic);
+		if (ret)
+			return ret;
+	}
+
+	memcpy_fromio((void *)&hdr + HDR_OUT_OFFSET, slot + HDR_OUT_OFFSET,
+		sizeof(hdr) - HDR_OUT_OFFSET);
+	rx_size = min(hdr.rx_size, rx_size);
+	if (!hdr.err && rx_size)
+		memcpy_fromio(msg->rx.data, slot + BPMP_VIRT_MSG_SIZE(tx_size, 0), rx_size);
+
+	if (xport.features & BPMP_VIRT_F_SLOT_STATE)
+		writel(BPMP_VIRT_SLOT_FREE, state);
+
+	if (hdr.err)
+		return hdr.err;
+
+	msg->rx.size = rx_size;
+	msg->rx.ret = hdr.ret;
+
+	return 0;
+}
+
+/*
+ * Transfers a message through a free slot. Each slot is executed by its
+ * own doorbell write, so the vCPUs can have one message in flight each.
+ * The interrupts are left as the caller has them.
+ */
+static int bpmp_guest_transfer_slot(struct tegra_bpmp_message *msg)
+{
+	u32 index;
+	int ret;
+
+	ret = bpmp_guest_slot_get(&index);
+	if (ret)
+		return ret;
+
+	ret = bpmp_guest_slot_exec(index, msg, irqs_disabled());
+	if (ret == -ETIMEDOUT) {
+		// Still submitted, the slot is freed like a posted one once done
+		deb_error("transfer of mrq %u timed out\n", msg->mrq);
+		posted[index] = (struct bpmp_guest_posted) {
+			.mrq = msg->mrq,
+			.tx_size = msg->tx.size,
+		};
+		smp_mb__before_atomic();
+		set_bit(index, slot_posted);
+		return ret;
+	}
+
+	bpmp_guest_slot_put(index);
+
+	return ret;
+}
+
+/*
+ * Transfers a message of tegra_bpmp_transfer_atomic through the reserved
+ * slot. Its callers are serialized by the atomic_tx_lock of the BPMP, so
+ * they never wait for a slot, and the interrupts stay disabled for about
+ * one doorbell write and the read of the answer.
+ */
+static int bpmp_guest_transfer_atomic(struct tegra_bpmp_message *msg)
+{
+	volatile void __iomem *state = bpmp_guest_slot_state(xport.atomic_slot);
+	int ret;
+
+	// A message that timed out owns the slot until the backend is done with it
+	if (atomic_slot_stale) {
+		if (readl(state) != BPMP_VIRT_SLOT_DONE)
+			return -EBUSY;
+		atomic_slot_stale = false;
+	}
+
+	ret = bpmp_guest_slot_exec(xport.atomic_slot, msg, true);
+	if (ret == -ETIMEDOUT) {
+		deb_error("atomic transfer of mrq %u timed out\n", msg->mrq);
+		atomic_slot_stale = true;
+	}
+
+	return ret;
+}
+
+/*
+ * Returns true for the messages configured to be posted
+ */
+static bool bpmp_guest_is_posted(const struct tegra_bpmp_message *msg)
+{
+	u32 cmd;
+	u32 i;
+
+	if (!num_posted_ops || !msg->tx.data || msg->tx.size < sizeof(cmd))
+		return false;
+
+	memcpy(&cmd, msg->tx.data, sizeof(cmd));
+	// bits[31..24] of the MRQ_CLK cmd_and_id are the command
+	if (msg->mrq == MRQ_CLK)
+		cmd >>= 24;
+
+	for (i = 0; i < num_posted_ops; i++)
+		if (posted_ops[i].mrq == msg->mrq && posted_ops[i].cmd == cmd)
+			return true;
+
+	return false;
+}
+
+/*
+ * Writes a posted message to a slot owned by the caller and submits it.
+ * The slot stays busy until it is reaped.
+ */
+static void bpmp_guest_posted_write(u32 index, const struct bpmp_virt_msg_hdr *hdr,
+	const void *tx, u32 steps)
+{
+	posted[index].mrq = hdr->mrq;
+	posted[index].tx_size = hdr->tx_size;
+	posted[index].steps = steps;
+	// writel() of the doorbell orders the posted fields before the bit
+	bpmp_guest_slot_submit(index, hdr, tx);
+	set_bit(index, slot_posted);
+}
+
+static int bpmp_guest_posted_submit(const struct bpmp_virt_msg_hdr *hdr,
+	const void *tx, u32 steps)
+{
+	u32 index;
+	int ret;
+
+	ret = bpmp_guest_slot_get(&index);
+	if (ret)
+		return ret;
+
+	bpmp_guest_posted_write(index, hdr, tx, steps);
+
+	return 0;
+}
+
+/*
+ * Posts the gathered messages as a compound message. The slot is taken
+ * without the batch lock, sleeping if the caller can, and the batch is
+ * only written to it under the lock. If no slot is free, the batch is
+ * kept for the next try and the error returned.
+ */
+static int bpmp_guest_batch_send(void)
+{
+	struct bpmp_virt_msg_hdr hdr = {
+		.magic = BPMP_VIRT_MSG_MAGIC,
+		.version = BPMP_VIRT_MSG_VERSION,
+		.hdr_size = sizeof(hdr),
+		.flags = BPMP_VIRT_MSG_F_COMPOUND,
+	};
+	unsigned long flags;
+	u32 index;
+	int ret;
+
+	if (!READ_ONCE(batch.steps))
+		return 0;
+
+	ret = bpmp_guest_slot_get(&index);
+	if (ret)
+		return ret;
+
+	spin_lock_irqsave(&batch.lock, flags);
+
+	// Another caller can have sent it meanwhile
+	if (!batch.steps) {
+		spin_unlock_irqrestore(&batch.lock, flags);
+		bpmp_guest_slot_put(index);
+		return 0;
+	}
+
+	hdr.tx_size = batch.tx_size;
+	hdr.rx_size = batch.rx_size;
+	bpmp_guest_posted_write(index, &hdr, batch.tx, batch.steps);
+
+	batch.steps = 0;
+	batch.tx_size = 0;
+	batch.rx_size = 0;
+
+	spin_unlock_irqrestore(&batch.lock, flags);
+
+	return 0;
+}
+
+static void bpmp_guest_batch_work(struct work_struct *work)
+{
+	int ret;
+
+	// The messages were already answered, they are sent once a slot is free
+	ret = bpmp_guest_batch_send();
+	if (ret) {
+		deb_error("posted messages not sent yet: %d\n", ret);
+		schedule_work(&batch_work);
+	}
+}
+
+/*
+ * Checks if a message can be a step of the batch
+ */
+static bool bpmp_guest_batch_fits(const struct tegra_bpmp_message *msg)
+{
+	u32 max_size = min_t(u32, xport.max_payload, BPMP_VIRT_COMPOUND_MAX_SIZE);
+
+	// The host rejects the steps larger than a plain message to the BPMP
+	return msg->tx.size <= BPMP_HOST_MAX_PAYLOAD &&
+		BPMP_VIRT_STEP_SIZE(msg->tx.size) <= max_size;
+}
+
+/*
+ * Adds a posted message to the batch, sending the batch first if it is
+ * full. The first one schedules the batch work, so that the messages
+ * posted meanwhile, like the clocks of a bulk enable, go in the same
+ * compound message.
+ */
+static int bpmp_guest_batch_add(const struct tegra_bpmp_message *msg)
+{
+	struct bpmp_virt_step step = {
+		.mrq = msg->mrq,
+		.tx_size = msg->tx.size,
+	};
+	u32 max_size = min_t(u32, xport.max_payload, BPMP_VIRT_COMPOUND_MAX_SIZE);
+	unsigned long flags;
+	int ret;
+
+	for (;;) {
+		spin_lock_irqsave(&batch.lock, flags);
+
+		if (batch.steps < BPMP_VIRT_COMPOUND_MAX_STEPS &&
+		    batch.tx_size + BPMP_VIRT_STEP_SIZE(step.tx_size) <= max_size &&
+		    batch.rx_size + BPMP_VIRT_STEP_SIZE(0) <= max_size)
+			break;
+
+		spin_unlock_irqrestore(&batch.lock, flags);
+
+		ret = bpmp_guest_batch_send();
+		if (ret)
+			return ret;
+	}
+
+	memcpy(batch.tx + batch.tx_size, &step, sizeof(step));
+	memcpy(batch.tx + batch.tx_size + sizeof(step), msg->tx.data, step.tx_size);
+	memset(batch.tx + batch.tx_size + sizeof(step) + step.tx_size, 0,
+		BPMP_VIRT_STEP_SIZE(step.tx_size) - sizeof(step) - step.tx_size);
+	batch.tx_size += BPMP_VIRT_STEP_SIZE(step.tx_size);
+	batch.rx_size += BPMP_VIRT_STEP_SIZE(0);
+
+	if (!batch.steps++)
+		schedule_work(&batch_work);
+
+	spin_unlock_irqrestore(&batch.lock, flags);
+
+	return 0;
+}
+
+/*
+ * Queues a message without waiting for its answer. The caller gets a
+ * success with an empty answer, the errors are reported when the slot is
+ * reaped.
+ */
+static int bpmp_guest_transfer_posted(struct tegra_bpmp_message *msg)
+{
+	struct bpmp_virt_msg_hdr hdr;
+	int ret;
+
+	if (!bpmp_guest_slot_hdr(msg, &hdr))
+		return -EINVAL;
+	hdr.rx_size = 0;
+
+	if ((xport.features & BPMP_VIRT_F_COMPOUND) && bpmp_guest_batch_fits(msg)) {
+		ret = bpmp_guest_batch_add(msg);
+	} else {
+		// A message posted on its own goes after the batch
+		ret = bpmp_guest_batch_send();
+		if (!ret)
+			ret = bpmp_guest_posted_submit(&hdr, msg->tx.data, 0);
+	}
+	if (ret)
+		return ret;
+
+	msg->rx.size = 0;
+	msg->rx.ret = 0;
+
+	return 0;
+}
+
+/*
+ * Sends the batch and waits for the posted messages, so that the next
+ * message sees their effect
+ */
+static void bpmp_guest_posted_flush(void)
+{
+	int ret;
+
+	ret = bpmp_guest_batch_send();
+	if (ret)
+		deb_error("posted messages not sent yet: %d\n", ret);
+
+	if (!bitmap_empty(slot_posted, MAX_SLOTS))
+		bpmp_guest_posted_reap(true);
+}
+
+/*
+ * Reads the posted messages from the "virtual-posted-ops" property of the
+ * bpmp node, a list of <mrq cmd> pairs. Posting needs the slot states, so
+ * that the doorbell does not wait for the answer.
+ */
+static void bpmp_guest_posted_probe(void)
+{
+	struct device_node *np;
+	int count;
+
+	if (!(xport.features & BPMP_VIRT_F_SLOT_STATE))
+		return;
+
+	np = of_find_compatible_node(NULL, NULL, "nvidia,tegra186-bpmp");
+	if (!np)
+		return;
+
+	count = of_property_count_u32_elems(np, "virtual-posted-ops");
+	if (count > 0) {
+		count = min_t(int, count / 2, MAX_POSTED_OPS);
+		if (!of_property_read_u32_array(np, "virtual-posted-ops",
+						(u32 *)posted_ops, count * 2))
+			num_posted_ops = count;
+	}
+	of_node_put(np);
+
+	deb_info("%u posted ops\n", num_posted_ops);
+}
+
 /**
  * Initializes module at installation
  */
@@ -234,6 +1057,12 @@ int tegra_bpmp_guest_init(void)
 
 	deb_info("bpmp_vpa: 0x%llX, mem_iova: %p\n", bpmp_vpa, mem_iova);
 
+	bpmp_guest_transport_probe();
+
+	bpmp_guest_posted_probe();
+
+	bpmp_guest_state_map();
+
 	tegra_bpmp_transfer_redirect = my_tegra_bpmp_transfer; // Hook func
 
 	return 0;
@@ -254,6 +1083,10 @@ void tegra_bpmp_guest_cleanup(void)
 	iounmap((void __iomem*)bpmp_vpa);
 
     tegra_bpmp_transfer_redirect = NULL;   // unhook function
+
+	if (state_page)
+		memunmap(state_page);
+	state_page = NULL;
 	device_destroy(bpmp_guest_proxy_class, MKDEV(major_number, 0)); // remove the device
 	class_unregister(bpmp_guest_proxy_class);						  // unregister the device class
 	class_destroy(bpmp_guest_proxy_class);						  // remove the device class
@@ -300,9 +1133,32 @@ int my_tegra_bpmp_transfer(struct tegra_bpmp *bpmp, struct tegra_bpmp_message *m
 	unsigned char io_buffer[MEM_SIZE];
 	size_t org_tx_size = 0;
 	size_t org_rx_size = 0;
+	int ret;
 
 	deb_info("%s\n", __func__);
 
+	// Posted ops, outside of the atomic transfers, do not wait for the answer
+	if (!irqs_disabled() && bpmp_guest_is_posted(msg))
+		return bpmp_guest_transfer_posted(msg);
+
+	// The other messages can depend on the posted ones
+	bpmp_guest_posted_flush();
+
+	// State queries are answered locally when the host published the state
+	if (bpmp_guest_state_answer(msg))
+		return 0;
+
+	// tegra_bpmp_transfer_atomic callers, with the interrupts disabled, do not share slots
+	if (irqs_disabled() && xport.atomic_slot != NO_SLOT)
+		return bpmp_guest_transfer_atomic(msg);
+
+	// The virtio transport, once its device is probed, replaces the window
+	if (bpmp_guest_virtio_transfer(msg, &ret))
+		return ret;
+
+	if (xport.version >= BPMP_VIRT_TRANSPORT_VERSION)
+		return bpmp_guest_transfer_slot(msg);
+
 	memset(io_buffer, 0, sizeof(io_buffer));
 
     if (msg->tx.size >= MESSAGE_SIZE)
@@ -359,6 +1215,53 @@ int my_tegra_bpmp_transfer(struct tegra_bpmp *bpmp, struct tegra_bpmp_message *m
     return msg->rx.ret;
 }
 
+/*
+ * Transfers an inline message (struct bpmp_virt_msg_hdr followed by the
+ * tx and rx data), the same format the host proxy accepts
+ */
+static ssize_t write_inline(const char __user *buffer, size_t len)
+{
+	struct {
+		struct bpmp_virt_msg_hdr hdr;
+		u8 data[2 * BPMP_HOST_MAX_PAYLOAD];
+	} kbuf;
+	struct bpmp_virt_msg_hdr *hdr = &kbuf.hdr;
+	struct tegra_bpmp_message msg = {};
+
+	if (len < sizeof(*hdr) || len > sizeof(kbuf))
+		return -EINVAL;
+
+	if (copy_from_user(&kbuf, buffer, len)) {
+		deb_error("copy_from_user(inline) failed\n");
+		return -EFAULT;
+	}
+
+	if (hdr->version != BPMP_VIRT_MSG_VERSION || hdr->hdr_size != sizeof(*hdr) ||
+	    hdr->flags || hdr->tx_size > BPMP_HOST_MAX_PAYLOAD ||
+	    hdr->rx_size > BPMP_HOST_MAX_PAYLOAD ||
+	    len != BPMP_VIRT_MSG_SIZE(hdr->tx_size, hdr->rx_size)) {
+		deb_error("invalid inline message header\n");
+		return -EINVAL;
+	}
+
+	msg.mrq = hdr->mrq;
+	msg.tx.data = kbuf.data;
+	msg.tx.size = hdr->tx_size;
+	msg.rx.data = kbuf.data + hdr->tx_size;
+	msg.rx.size = hdr->rx_size;
+
+	hdr->err = tegra_bpmp_transfer(tegra_bpmp_host_device, &msg);
+	hdr->ret = msg.rx.ret;
+	hdr->rx_size = msg.rx.size;
+
+	if (copy_to_user((void __user *)buffer, &kbuf, len)) {
+		deb_error("copy_to_user(inline) failed\n");
+		return -EFAULT;
+	}
+
+	return len;
+}
+
 /*
  * Writes to the device
  */
@@ -374,6 +1277,11 @@ static ssize_t write(struct file *filep, const char *buffer, size_t len, loff_t
 	void *rxbuf = NULL;
 	void *usertxbuf = NULL;
 	void *userrxbuf = NULL;
+	__u32 magic;
+
+	if (len >= sizeof(magic) && !get_user(magic, (const __u32 __user *)buffer) &&
+	    magic == BPMP_VIRT_MSG_MAGIC)
+		return write_inline(buffer, len);
 
 	if (len > 65535) {	/* paranoia */
 		deb_error("count %zu exceeds max # of bytes allowed, "
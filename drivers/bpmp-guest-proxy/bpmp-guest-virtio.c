@@ -0,0 +1,311 @@
+/**
+ *
+ * NVIDIA BPMP Guest Proxy Kernel Module
+ * virtio-bpmp transport
+ *
+ * When the VMM provides a virtio-bpmp device, the messages are queued to
+ * its request virtqueue instead of being copied through the virtual-pa
+ * window. The messages of concurrent callers are notified together, and
+ * the callers sleep until the completion interrupt. Callers with the
+ * interrupts disabled, like tegra_bpmp_transfer_atomic, poll the used
+ * ring instead.
+ *
+ * The device is probed after the BPMP, so the first messages still go
+ * through the window.
+ *
+ * virtio_find_vqs() takes struct virtqueue_info since Linux 6.11, the
+ * target is the 6.12 kernel of the BPMP driver patch.
+ *
+*/
+#include <linux/kernel.h>
+#include <linux/version.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/atomic.h>
+#include <linux/wait.h>
+#include <linux/completion.h>
+#include <linux/scatterlist.h>
+#include <linux/virtio.h>
+#include <linux/virtio_config.h>
+#include "bpmp-guest-internal.h"
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 11, 0)
+#error "the virtio-bpmp transport needs Linux 6.11 or later"
+#endif
+
+struct bpmp_virtio {
+	struct virtio_device *vdev;
+	struct virtqueue *vq;
+	spinlock_t lock;		///< Protects the virtqueue
+	u32 max_payload;
+	atomic_t users;			///< Transfers using the device
+	wait_queue_head_t idle;		///< Woken up when users drops to 0
+};
+
+/**
+ * A message in the virtqueue. The data holds the tx data, then the
+ * completed header and the rx data written by the device.
+ */
+struct bpmp_virtio_req {
+	struct completion done;
+	bool completed;
+	u32 len;			///< Bytes written by the device
+	int err;			///< Set when the device went away
+	struct bpmp_virt_msg_hdr hdr;
+	u8 data[];
+};
+
+// Protects bpmp_virtio
+static DEFINE_SPINLOCK(bpmp_virtio_dev_lock);
+static struct bpmp_virtio *bpmp_virtio;
+
+static struct bpmp_virtio *bpmp_virtio_get(void)
+{
+	struct bpmp_virtio *vb;
+	unsigned long flags;
+
+	spin_lock_irqsave(&bpmp_virtio_dev_lock, flags);
+	vb = bpmp_virtio;
+	if (vb)
+		atomic_inc(&vb->users);
+	spin_unlock_irqrestore(&bpmp_virtio_dev_lock, flags);
+
+	return vb;
+}
+
+static void bpmp_virtio_put(struct bpmp_virtio *vb)
+{
+	if (atomic_dec_and_test(&vb->users))
+		wake_up(&vb->idle);
+}
+
+/*
+ * Completes the messages that the device used. Called with the
+ * virtqueue lock held.
+ */
+static void bpmp_virtio_reap(struct bpmp_virtio *vb)
+{
+	struct bpmp_virtio_req *req;
+	unsigned int len;
+
+	while ((req = virtqueue_get_buf(vb->vq, &len))) {
+		req->len = len;
+		WRITE_ONCE(req->completed, true);
+		complete(&req->done);
+	}
+}
+
+static void bpmp_virtio_done(struct virtqueue *vq)
+{
+	struct bpmp_virtio *vb = vq->vdev->priv;
+	unsigned long flags;
+
+	spin_lock_irqsave(&vb->lock, flags);
+	bpmp_virtio_reap(vb);
+	spin_unlock_irqrestore(&vb->lock, flags);
+}
+
+static int bpmp_virtio_queue(struct bpmp_virtio *vb, struct bpmp_virtio_req *req,
+	u32 tx_size, u32 rx_size)
+{
+	struct scatterlist out, in, *sgs[2] = { &out, &in };
+	unsigned long flags;
+	bool notify;
+	int ret;
+
+	sg_init_one(&out, &req->hdr, sizeof(req->hdr) + tx_size);
+	sg_init_one(&in, req->data + tx_size, sizeof(req->hdr) + rx_size);
+
+	spin_lock_irqsave(&vb->lock, flags);
+	ret = virtqueue_add_sgs(vb->vq, sgs, 1, 1, req, GFP_ATOMIC);
+	notify = !ret && virtqueue_kick_prepare(vb->vq);
+	spin_unlock_irqrestore(&vb->lock, flags);
+
+	// Notified out of the lock, the callers queueing meanwhile share it
+	if (notify)
+		virtqueue_notify(vb->vq);
+
+	return ret;
+}
+
+static void bpmp_virtio_wait(struct bpmp_virtio *vb, struct bpmp_virtio_req *req)
+{
+	if (!irqs_disabled()) {
+		wait_for_completion(&req->done);
+		return;
+	}
+
+	while (!READ_ONCE(req->completed)) {
+		spin_lock(&vb->lock);
+		bpmp_virtio_reap(vb);
+		spin_unlock(&vb->lock);
+		cpu_relax();
+	}
+}
+
+/*
+ * Transfers a message through the virtio-bpmp device. Returns false,
+ * without transferring it, when there is no device.
+ */
+bool bpmp_guest_virtio_transfer(struct tegra_bpmp_message *msg, int *ret)
+{
+	struct bpmp_virtio *vb;
+	struct bpmp_virtio_req *req;
+	struct bpmp_virt_msg_hdr hdr;
+	u32 tx_size, rx_size;
+
+	vb = bpmp_virtio_get();
+	if (!vb)
+		return false;
+
+	tx_size = msg->tx.data ? msg->tx.size : 0;
+	rx_size = msg->rx.data ? min_t(size_t, msg->rx.size, vb->max_payload) : 0;
+
+	if (tx_size > vb->max_payload) {
+		*ret = -EINVAL;
+		goto out;
+	}
+
+	req = kzalloc(sizeof(*req) + tx_size + sizeof(hdr) + rx_size,
+		irqs_disabled() ? GFP_ATOMIC : GFP_KERNEL);
+	if (!req) {
+		*ret = -ENOMEM;
+		goto out;
+	}
+
+	init_completion(&req->done);
+	req->hdr.magic = BPMP_VIRT_MSG_MAGIC;
+	req->hdr.version = BPMP_VIRT_MSG_VERSION;
+	req->hdr.hdr_size = sizeof(req->hdr);
+	req->hdr.mrq = msg->mrq;
+	req->hdr.tx_size = tx_size;
+	req->hdr.rx_size = rx_size;
+	memcpy(req->data, msg->tx.data, tx_size);
+
+	*ret = bpmp_virtio_queue(vb, req, tx_size, rx_size);
+	if (*ret)
+		goto out_free;
+
+	bpmp_virtio_wait(vb, req);
+
+	if (req->err) {
+		*ret = req->err;
+		goto out_free;
+	}
+
+	if (req->len < sizeof(hdr)) {
+		deb_error("short virtio-bpmp answer: %u bytes\n", req->len);
+		*ret = -EIO;
+		goto out_free;
+	}
+
+	memcpy(&hdr, req->data + tx_size, sizeof(hdr));
+	*ret = hdr.err;
+	if (!hdr.err) {
+		rx_size = min3(hdr.rx_size, rx_size, req->len - (u32)sizeof(hdr));
+		memcpy(msg->rx.data, req->data + tx_size + sizeof(hdr), rx_size);
+		msg->rx.size = rx_size;
+		msg->rx.ret = hdr.ret;
+	}
+
+out_free:
+	kfree(req);
+out:
+	bpmp_virtio_put(vb);
+	return true;
+}
+
+static int bpmp_virtio_probe(struct virtio_device *vdev)
+{
+	struct virtqueue_info vqs_info[] = {
+		{ "requests", bpmp_virtio_done },
+	};
+	struct bpmp_virtio *vb;
+	unsigned long flags;
+	u32 max_payload;
+	int ret;
+
+	vb = kzalloc(sizeof(*vb), GFP_KERNEL);
+	if (!vb)
+		return -ENOMEM;
+
+	vb->vdev = vdev;
+	spin_lock_init(&vb->lock);
+	atomic_set(&vb->users, 0);
+	init_waitqueue_head(&vb->idle);
+	vdev->priv = vb;
+
+	virtio_cread_le(vdev, struct bpmp_virtio_config, max_payload, &max_payload);
+	vb->max_payload = max_payload ? max_payload : BPMP_HOST_MAX_PAYLOAD;
+
+	ret = virtio_find_vqs(vdev, 1, &vb->vq, vqs_info, NULL);
+	if (ret)
+		goto err_free;
+
+	virtio_device_ready(vdev);
+
+	spin_lock_irqsave(&bpmp_virtio_dev_lock, flags);
+	if (bpmp_virtio) {
+		spin_unlock_irqrestore(&bpmp_virtio_dev_lock, flags);
+		deb_error("a virtio-bpmp device is already in use\n");
+		ret = -EBUSY;
+		goto err_vqs;
+	}
+	bpmp_virtio = vb;
+	spin_unlock_irqrestore(&bpmp_virtio_dev_lock, flags);
+
+	deb_info("virtio-bpmp transport, max payload %u\n", vb->max_payload);
+
+	return 0;
+
+err_vqs:
+	virtio_reset_device(vdev);
+	vdev->config->del_vqs(vdev);
+err_free:
+	kfree(vb);
+	return ret;
+}
+
+static void bpmp_virtio_remove(struct virtio_device *vdev)
+{
+	struct bpmp_virtio *vb = vdev->priv;
+	struct bpmp_virtio_req *req;
+	unsigned long flags;
+
+	spin_lock_irqsave(&bpmp_virtio_dev_lock, flags);
+	if (bpmp_virtio == vb)
+		bpmp_virtio = NULL;
+	spin_unlock_irqrestore(&bpmp_virtio_dev_lock, flags);
+
+	// The device does not use the buffers after the reset
+	virtio_reset_device(vdev);
+
+	spin_lock_irqsave(&vb->lock, flags);
+	bpmp_virtio_reap(vb);
+	while ((req = virtqueue_detach_unused_buf(vb->vq))) {
+		req->err = -ENODEV;
+		WRITE_ONCE(req->completed, true);
+		complete(&req->done);
+	}
+	spin_unlock_irqrestore(&vb->lock, flags);
+
+	wait_event(vb->idle, !atomic_read(&vb->users));
+
+	vdev->config->del_vqs(vdev);
+	kfree(vb);
+}
+
+static const struct virtio_device_id bpmp_virtio_ids[] = {
+	{ CONFIG_TEGRA_BPMP_GUEST_VIRTIO_DEVICE_ID, VIRTIO_DEV_ANY_ID },
+	{ 0 },
+};
+
+static struct virtio_driver bpmp_virtio_driver = {
+	.driver.name = "bpmp-virtio",
+	.id_table = bpmp_virtio_ids,
+	.probe = bpmp_virtio_probe,
+	.remove = bpmp_virtio_remove,
+};
+
+module_virtio_driver(bpmp_virtio_driver);
@@ -0,0 +1,600 @@
+/**
+ *
+ * NVIDIA BPMP Host Proxy Kernel Module
+ * Aggregation of the memory bandwidth requests of the VMs and the host
+ *
+ * The BPMP keeps one bandwidth request per client, so a VM setting the
+ * bandwidth of a client would overwrite the request of another VM, or of
+ * the host drivers, for the same client. Instead, the last request of
+ * each of them is kept, and the BPMP gets their aggregate:
+ *
+ *  - MRQ_BWMGR CMD_BWMGR_CALC_RATE: the sum of the non-ISO bandwidths
+ *    and, per ISO client, the sum of the ISO bandwidths.
+ *  - MRQ_BWMGR_INT CMD_BWMGR_INT_CALC_AND_SET: per client, the sum of
+ *    the bandwidths and the highest of the floors.
+ *  - MRQ_ISO_CLIENT CMD_ISO_CLIENT_CALCULATE_LA: per client, the sum of
+ *    the bandwidths and the highest of the initial floors.
+ *
+ * An aggregate is only sent when it changes, otherwise the requester gets
+ * the answer of the last one. The other commands are transferred as they
+ * are.
+ *
+ * The requests of the host drivers are taken over with the transfer
+ * filter of the BPMP driver, the aggregates sent by the proxy go through
+ * it untouched. Host requests made before the proxy probed are only known
+ * from their next update.
+ *
+ * Floors are only comparable in the same unit, a floor in another unit
+ * than the ones already requested for the client is refused.
+ *
+ * The VM requests come from the serialized transfers of the scheduler
+ * workers, the host requests from any thread: both are aggregated under
+ * bpmp_host_bwmgr_lock, which is held across the transfer of the
+ * aggregate.
+ *
+*/
+#include <linux/kernel.h>
+#include <linux/minmax.h>
+#include <linux/mutex.h>
+#include <linux/sched.h>
+#include <linux/string.h>
+#include "bpmp-host-internal.h"
+
+
+/**
+ * Aggregate last sent to the BPMP for a MRQ_BWMGR_INT client
+ */
+struct bpmp_host_bw_client {
+	bool valid;			///< sent is the state of the BPMP
+	struct bpmp_host_bw_req sent;
+	u64 rate;			///< EMC rate answered for sent
+};
+
+/**
+ * Aggregate last sent to the BPMP for a MRQ_ISO_CLIENT client
+ */
+struct bpmp_host_la_client {
+	bool valid;
+	struct bpmp_host_la_req sent;
+	struct cmd_iso_client_calculate_la_response resp;
+};
+
+/**
+ * Aggregate last sent with CMD_BWMGR_CALC_RATE
+ */
+struct bpmp_host_bw_rate {
+	bool valid;
+	struct cmd_bwmgr_calc_rate_request sent;
+	struct cmd_bwmgr_calc_rate_response resp;
+};
+
+// Requests of the host drivers, aggregated like the ones of a VM
+static struct bpmp_host_vm_bw bpmp_host_bw_host;
+
+static struct bpmp_host_bw_client bpmp_host_bw_clients[BPMP_HOST_BWMGR_MAX_CLIENTS];
+static struct bpmp_host_la_client bpmp_host_la_clients[BPMP_HOST_BWMGR_MAX_CLIENTS];
+static struct bpmp_host_bw_rate bpmp_host_bw_rate;
+
+static DEFINE_MUTEX(bpmp_host_bwmgr_lock);
+
+// Task transferring an aggregate, its messages are not filtered
+static struct task_struct *bpmp_host_bwmgr_sender;
+
+// The VMs, then the host
+#define BPMP_HOST_BW_PARTIES  (BPMP_HOST_MAX_VMS + 1)
+
+#define BPMP_HOST_ISO_LA_SIZE \
+	offsetofend(struct mrq_iso_client_request, calculate_la_req)
+
+#define BPMP_HOST_BW_RATE_SIZE(n) \
+	(sizeof(u32) + offsetof(struct cmd_bwmgr_calc_rate_request, isobw_reqs) + \
+	 (n) * sizeof(struct iso_req))
+
+static struct bpmp_host_vm_bw *bpmp_host_bwmgr_party(int i)
+{
+	return i < BPMP_HOST_MAX_VMS ? &bpmp_host_vms[i].bw : &bpmp_host_bw_host;
+}
+
+/*
+ * Checks if a message is a bandwidth request that is aggregated, with
+ * client ids that fit the tables
+ */
+bool bpmp_host_bwmgr_aggregated(const struct tegra_bpmp_message *msg)
+{
+	const struct mrq_bwmgr_request *bwmgr_req = msg->tx.data;
+	const struct mrq_bwmgr_int_request *bwmgr_int_req = msg->tx.data;
+	const struct mrq_iso_client_request *iso_req = msg->tx.data;
+	const struct cmd_bwmgr_calc_rate_request *rate_req;
+	u32 i;
+
+	if (!msg->tx.data || msg->tx.size < sizeof(u32))
+		return false;
+
+	switch (msg->mrq) {
+	case MRQ_BWMGR:
+		if (bwmgr_req->cmd != CMD_BWMGR_CALC_RATE ||
+		    msg->tx.size < BPMP_HOST_BW_RATE_SIZE(0))
+			return false;
+		rate_req = &bwmgr_req->bwmgr_rate_req;
+		if (rate_req->num_iso_clients > MAX_ISO_CLIENTS ||
+		    msg->tx.size < BPMP_HOST_BW_RATE_SIZE(rate_req->num_iso_clients))
+			return false;
+		for (i = 0; i < rate_req->num_iso_clients; i++)
+			if (rate_req->isobw_reqs[i].id >= BPMP_HOST_BWMGR_MAX_CLIENTS)
+				return false;
+		return true;
+	case MRQ_BWMGR_INT:
+		return bwmgr_int_req->cmd == CMD_BWMGR_INT_CALC_AND_SET &&
+			msg->tx.size >= BPMP_HOST_BWMGR_SET_SIZE &&
+			bwmgr_int_req->bwmgr_calc_set_req.client_id < BPMP_HOST_BWMGR_MAX_CLIENTS;
+	case MRQ_ISO_CLIENT:
+		return iso_req->cmd == CMD_ISO_CLIENT_CALCULATE_LA &&
+			msg->tx.size >= BPMP_HOST_ISO_LA_SIZE &&
+			iso_req->calculate_la_req.id < BPMP_HOST_BWMGR_MAX_CLIENTS;
+	default:
+		return false;
+	}
+}
+
+/*
+ * Transfers an aggregate, through the transfer filter
+ */
+static int bpmp_host_bwmgr_send(struct tegra_bpmp_message *msg)
+{
+	int ret;
+
+	WRITE_ONCE(bpmp_host_bwmgr_sender, current);
+	ret = tegra_bpmp_transfer(tegra_bpmp_host_device, msg);
+	WRITE_ONCE(bpmp_host_bwmgr_sender, NULL);
+
+	return ret;
+}
+
+static void bpmp_host_bwmgr_reply(struct tegra_bpmp_message *msg,
+	const void *resp, size_t size)
+{
+	memcpy(msg->rx.data, resp, min(msg->rx.size, size));
+	msg->rx.ret = 0;
+}
+
+static bool bpmp_host_bw_req_equal(const struct bpmp_host_bw_req *a,
+	const struct bpmp_host_bw_req *b)
+{
+	return a->niso_bw == b->niso_bw && a->iso_bw == b->iso_bw &&
+		a->mc_floor == b->mc_floor && a->floor_unit == b->floor_unit;
+}
+
+/*
+ * Checks if another party has a floor for the client in another unit
+ */
+static bool bpmp_host_bwmgr_unit_conflict(u32 client_id,
+	const struct bpmp_host_vm_bw *bw, u8 floor_unit)
+{
+	const struct bpmp_host_bw_req *req;
+	int i;
+
+	for (i = 0; i < BPMP_HOST_BW_PARTIES; i++) {
+		if (bpmp_host_bwmgr_party(i) == bw)
+			continue;
+		req = &bpmp_host_bwmgr_party(i)->client[client_id];
+		if (req->mc_floor && req->floor_unit != floor_unit)
+			return true;
+	}
+
+	return false;
+}
+
+static void bpmp_host_bwmgr_aggregate(u32 client_id, u8 floor_unit,
+	struct bpmp_host_bw_req *agg)
+{
+	const struct bpmp_host_bw_req *req;
+	u64 niso_bw = 0, iso_bw = 0;
+	u32 mc_floor = 0;
+	int i;
+
+	for (i = 0; i < BPMP_HOST_BW_PARTIES; i++) {
+		req = &bpmp_host_bwmgr_party(i)->client[client_id];
+		niso_bw += req->niso_bw;
+		iso_bw += req->iso_bw;
+		// All the non zero floors are in the same unit
+		if (req->mc_floor) {
+			mc_floor = max(mc_floor, req->mc_floor);
+			floor_unit = req->floor_unit;
+		}
+	}
+
+	agg->niso_bw = min_t(u64, niso_bw, U32_MAX);
+	agg->iso_bw = min_t(u64, iso_bw, U32_MAX);
+	agg->mc_floor = mc_floor;
+	agg->floor_unit = floor_unit;
+}
+
+static int bpmp_host_bwmgr_calc_and_set(struct bpmp_host_vm *vm,
+	struct bpmp_host_vm_bw *bw, struct tegra_bpmp_message *msg)
+{
+	const struct mrq_bwmgr_int_request *bwmgr_req = msg->tx.data;
+	const struct cmd_bwmgr_int_calc_and_set_request *set_req =
+		&bwmgr_req->bwmgr_calc_set_req;
+	struct bpmp_host_bw_client *client = &bpmp_host_bw_clients[set_req->client_id];
+	struct bpmp_host_bw_req *bw_req = &bw->client[set_req->client_id];
+	struct bpmp_host_bw_req old = *bw_req;
+	struct bpmp_host_bw_req agg;
+	struct mrq_bwmgr_int_request agg_req = {
+		.cmd = CMD_BWMGR_INT_CALC_AND_SET,
+	};
+	struct mrq_bwmgr_int_response agg_resp;
+	struct tegra_bpmp_message agg_msg = {
+		.mrq = MRQ_BWMGR_INT,
+		.tx = {
+			.data = &agg_req,
+			.size = BPMP_HOST_BWMGR_SET_SIZE,
+		},
+		.rx = {
+			.data = &agg_resp,
+			.size = sizeof(agg_resp),
+		},
+	};
+	int ret;
+
+	if (set_req->mc_floor &&
+	    bpmp_host_bwmgr_unit_conflict(set_req->client_id, bw, set_req->floor_unit)) {
+		deb_warn("Warning, bwmgr client %u floor unit %u differs from other requests\n",
+			set_req->client_id, set_req->floor_unit);
+		return -EINVAL;
+	}
+
+	WRITE_ONCE(bw_req->niso_bw, set_req->niso_bw);
+	WRITE_ONCE(bw_req->iso_bw, set_req->iso_bw);
+	bw_req->mc_floor = set_req->mc_floor;
+	bw_req->floor_unit = set_req->floor_unit;
+
+	bpmp_host_bwmgr_aggregate(set_req->client_id, set_req->floor_unit, &agg);
+
+	if (client->valid && bpmp_host_bw_req_equal(&client->sent, &agg)) {
+		agg_resp.bwmgr_calc_set_resp.rate = client->rate;
+		bpmp_host_bwmgr_reply(msg, &agg_resp, sizeof(agg_resp));
+		if (vm)
+			atomic64_inc(&vm->elided);
+		return 0;
+	}
+
+	agg_req.bwmgr_calc_set_req.client_id = set_req->client_id;
+	agg_req.bwmgr_calc_set_req.niso_bw = agg.niso_bw;
+	agg_req.bwmgr_calc_set_req.iso_bw = agg.iso_bw;
+	agg_req.bwmgr_calc_set_req.mc_floor = agg.mc_floor;
+	agg_req.bwmgr_calc_set_req.floor_unit = agg.floor_unit;
+
+	ret = bpmp_host_bwmgr_send(&agg_msg);
+	if (ret || agg_msg.rx.ret) {
+		// The request was not applied, the BPMP state is unknown
+		WRITE_ONCE(bw_req->niso_bw, old.niso_bw);
+		WRITE_ONCE(bw_req->iso_bw, old.iso_bw);
+		bw_req->mc_floor = old.mc_floor;
+		bw_req->floor_unit = old.floor_unit;
+		client->valid = false;
+		msg->rx.ret = agg_msg.rx.ret;
+		return ret;
+	}
+
+	client->sent = agg;
+	client->rate = agg_resp.bwmgr_calc_set_resp.rate;
+	client->valid = true;
+	bpmp_host_bwmgr_reply(msg, &agg_resp, sizeof(agg_resp));
+
+	return 0;
+}
+
+static int bpmp_host_bwmgr_calculate_la(struct bpmp_host_vm *vm,
+	struct bpmp_host_vm_bw *bw, struct tegra_bpmp_message *msg)
+{
+	const struct mrq_iso_client_request *iso_req = msg->tx.data;
+	const struct cmd_iso_client_calculate_la_request *la_req =
+		&iso_req->calculate_la_req;
+	struct bpmp_host_la_client *client = &bpmp_host_la_clients[la_req->id];
+	struct bpmp_host_la_req *bw_req = &bw->la[la_req->id];
+	struct bpmp_host_la_req old = *bw_req;
+	struct bpmp_host_la_req agg = { 0 };
+	struct mrq_iso_client_request agg_req = {
+		.cmd = CMD_ISO_CLIENT_CALCULATE_LA,
+	};
+	struct mrq_iso_client_response agg_resp;
+	struct tegra_bpmp_message agg_msg = {
+		.mrq = MRQ_ISO_CLIENT,
+		.tx = {
+			.data = &agg_req,
+			.size = BPMP_HOST_ISO_LA_SIZE,
+		},
+		.rx = {
+			.data = &agg_resp,
+			.size = sizeof(agg_resp),
+		},
+	};
+	u64 sum_bw = 0;
+	int ret;
+	int i;
+
+	WRITE_ONCE(bw_req->bw, la_req->bw);
+	bw_req->init_bw_floor = la_req->init_bw_floor;
+
+	for (i = 0; i < BPMP_HOST_BW_PARTIES; i++) {
+		sum_bw += bpmp_host_bwmgr_party(i)->la[la_req->id].bw;
+		agg.init_bw_floor = max(agg.init_bw_floor,
+			bpmp_host_bwmgr_party(i)->la[la_req->id].init_bw_floor);
+	}
+	agg.bw = min_t(u64, sum_bw, U32_MAX);
+
+	if (client->valid && client->sent.bw == agg.bw &&
+	    client->sent.init_bw_floor == agg.init_bw_floor) {
+		bpmp_host_bwmgr_reply(msg, &client->resp, sizeof(client->resp));
+		if (vm)
+			atomic64_inc(&vm->elided);
+		return 0;
+	}
+
+	agg_req.calculate_la_req.id = la_req->id;
+	agg_req.calculate_la_req.bw = agg.bw;
+	agg_req.calculate_la_req.init_bw_floor = agg.init_bw_floor;
+
+	ret = bpmp_host_bwmgr_send(&agg_msg);
+	if (ret || agg_msg.rx.ret) {
+		WRITE_ONCE(bw_req->bw, old.bw);
+		bw_req->init_bw_floor = old.init_bw_floor;
+		client->valid = false;
+		msg->rx.ret = agg_msg.rx.ret;
+		return ret;
+	}
+
+	client->sent = agg;
+	client->resp = agg_resp.calculate_la_resp;
+	client->valid = true;
+	bpmp_host_bwmgr_reply(msg, &client->resp, sizeof(client->resp));
+
+	return 0;
+}
+
+static int bpmp_host_bwmgr_calc_rate(struct bpmp_host_vm *vm,
+	struct bpmp_host_vm_bw *bw, struct tegra_bpmp_message *msg)
+{
+	const struct mrq_bwmgr_request *bwmgr_req = msg->tx.data;
+	const struct cmd_bwmgr_calc_rate_request *rate_req = &bwmgr_req->bwmgr_rate_req;
+	struct bpmp_host_bw_rate *rate = &bpmp_host_bw_rate;
+	struct mrq_bwmgr_request agg_req = {
+		.cmd = CMD_BWMGR_CALC_RATE,
+	};
+	struct cmd_bwmgr_calc_rate_request *agg = &agg_req.bwmgr_rate_req;
+	struct mrq_bwmgr_response agg_resp;
+	struct tegra_bpmp_message agg_msg = {
+		.mrq = MRQ_BWMGR,
+		.tx.data = &agg_req,
+		.rx = {
+			.data = &agg_resp,
+			.size = sizeof(agg_resp),
+		},
+	};
+	u32 old_iso_bw[BPMP_HOST_BWMGR_MAX_CLIENTS];
+	u32 old_niso_bw = bw->sum_niso_bw;
+	u64 sum;
+	int ret;
+	int i, j;
+
+	memcpy(old_iso_bw, bw->iso_bw, sizeof(old_iso_bw));
+
+	bw->sum_niso_bw = rate_req->sum_niso_bw;
+	memset(bw->iso_bw, 0, sizeof(bw->iso_bw));
+	for (i = 0; i < rate_req->num_iso_clients; i++) {
+		sum = (u64)bw->iso_bw[rate_req->isobw_reqs[i].id] +
+			rate_req->isobw_reqs[i].iso_bw;
+		bw->iso_bw[rate_req->isobw_reqs[i].id] = min_t(u64, sum, U32_MAX);
+	}
+
+	sum = 0;
+	for (i = 0; i < BPMP_HOST_BW_PARTIES; i++)
+		sum += bpmp_host_bwmgr_party(i)->sum_niso_bw;
+	agg->sum_niso_bw = min_t(u64, sum, U32_MAX);
+
+	for (j = 0; j < BPMP_HOST_BWMGR_MAX_CLIENTS; j++) {
+		sum = 0;
+		for (i = 0; i < BPMP_HOST_BW_PARTIES; i++)
+			sum += bpmp_host_bwmgr_party(i)->iso_bw[j];
+		if (!sum)
+			continue;
+
+		if (agg->num_iso_clients == MAX_ISO_CLIENTS) {
+			deb_warn("Warning, more than %d ISO clients requested\n", MAX_ISO_CLIENTS);
+			ret = -E2BIG;
+			goto err;
+		}
+
+		agg->isobw_reqs[agg->num_iso_clients].id = j;
+		agg->isobw_reqs[agg->num_iso_clients].iso_bw = min_t(u64, sum, U32_MAX);
+		agg->num_iso_clients++;
+	}
+
+	if (rate->valid && !memcmp(&rate->sent, agg, sizeof(*agg))) {
+		bpmp_host_bwmgr_reply(msg, &rate->resp, sizeof(rate->resp));
+		if (vm)
+			atomic64_inc(&vm->elided);
+		return 0;
+	}
+
+	agg_msg.tx.size = BPMP_HOST_BW_RATE_SIZE(agg->num_iso_clients);
+
+	ret = bpmp_host_bwmgr_send(&agg_msg);
+	if (ret || agg_msg.rx.ret) {
+		rate->valid = false;
+		msg->rx.ret = agg_msg.rx.ret;
+		goto err;
+	}
+
+	rate->sent = *agg;
+	rate->resp = agg_resp.bwmgr_rate_resp;
+	rate->valid = true;
+	bpmp_host_bwmgr_reply(msg, &rate->resp, sizeof(rate->resp));
+
+	return 0;
+
+err:
+	bw->sum_niso_bw = old_niso_bw;
+	memcpy(bw->iso_bw, old_iso_bw, sizeof(old_iso_bw));
+	return ret;
+}
+
+static int bpmp_host_bwmgr_aggregate_locked(struct bpmp_host_vm *vm,
+	struct bpmp_host_vm_bw *bw, struct tegra_bpmp_message *msg)
+{
+	switch (msg->mrq) {
+	case MRQ_BWMGR:
+		return bpmp_host_bwmgr_calc_rate(vm, bw, msg);
+	case MRQ_BWMGR_INT:
+		return bpmp_host_bwmgr_calc_and_set(vm, bw, msg);
+	default:
+		return bpmp_host_bwmgr_calculate_la(vm, bw, msg);
+	}
+}
+
+/*
+ * Aggregates a bandwidth request of a VM, or of the host drivers if vm
+ * is NULL
+ */
+static int bpmp_host_bwmgr_aggregate_xfer(struct bpmp_host_vm *vm,
+	struct tegra_bpmp_message *msg)
+{
+	struct bpmp_host_vm_bw *bw = vm ? &vm->bw : &bpmp_host_bw_host;
+	int ret;
+
+	mutex_lock(&bpmp_host_bwmgr_lock);
+	ret = bpmp_host_bwmgr_aggregate_locked(vm, bw, msg);
+	mutex_unlock(&bpmp_host_bwmgr_lock);
+
+	return ret;
+}
+
+/*
+ * Withdraws a request of a released VM, as if it had asked for no
+ * bandwidth. Called with bpmp_host_bwmgr_lock held.
+ */
+static void bpmp_host_bwmgr_release_xfer(struct bpmp_host_vm *vm, u32 mrq,
+	void *req, u32 size)
+{
+	union {
+		struct mrq_bwmgr_response bwmgr;
+		struct mrq_bwmgr_int_response bwmgr_int;
+		struct mrq_iso_client_response iso_client;
+	} resp;
+	struct tegra_bpmp_message msg = {
+		.mrq = mrq,
+		.tx = { .data = req, .size = size },
+		.rx = { .data = &resp, .size = sizeof(resp) },
+	};
+	int ret;
+
+	ret = bpmp_host_bwmgr_aggregate_locked(NULL, &vm->bw, &msg);
+	if (ret || msg.rx.ret)
+		deb_warn("vm %u release, mrq %u failed: %d, %d\n", vm->id, mrq,
+			ret, msg.rx.ret);
+}
+
+/*
+ * Drops the bandwidth requests of a VM, sending the aggregates without
+ * them to the BPMP, so that a VM restarted by its VMM starts clean
+ */
+void bpmp_host_bwmgr_release(struct bpmp_host_vm *vm)
+{
+	struct bpmp_host_vm_bw *bw = &vm->bw;
+	struct mrq_bwmgr_int_request set_req = {
+		.cmd = CMD_BWMGR_INT_CALC_AND_SET,
+	};
+	struct mrq_iso_client_request la_req = {
+		.cmd = CMD_ISO_CLIENT_CALCULATE_LA,
+	};
+	struct mrq_bwmgr_request rate_req = {
+		.cmd = CMD_BWMGR_CALC_RATE,
+	};
+	u32 i;
+
+	mutex_lock(&bpmp_host_bwmgr_lock);
+
+	for (i = 0; i < BPMP_HOST_BWMGR_MAX_CLIENTS; i++) {
+		if (bw->client[i].niso_bw || bw->client[i].iso_bw || bw->client[i].mc_floor) {
+			set_req.bwmgr_calc_set_req.client_id = i;
+			set_req.bwmgr_calc_set_req.floor_unit = bw->client[i].floor_unit;
+			bpmp_host_bwmgr_release_xfer(vm, MRQ_BWMGR_INT, &set_req,
+				BPMP_HOST_BWMGR_SET_SIZE);
+		}
+
+		if (bw->la[i].bw || bw->la[i].init_bw_floor) {
+			la_req.calculate_la_req.id = i;
+			bpmp_host_bwmgr_release_xfer(vm, MRQ_ISO_CLIENT, &la_req,
+				BPMP_HOST_ISO_LA_SIZE);
+		}
+	}
+
+	if (bw->sum_niso_bw || memchr_inv(bw->iso_bw, 0, sizeof(bw->iso_bw)))
+		bpmp_host_bwmgr_release_xfer(vm, MRQ_BWMGR, &rate_req,
+			BPMP_HOST_BW_RATE_SIZE(0));
+
+	// Even if the BPMP refused an aggregate, the next ones go without the VM
+	memset(bw, 0, sizeof(*bw));
+
+	mutex_unlock(&bpmp_host_bwmgr_lock);
+}
+
+/*
+ * Transfers a message of the VM, aggregating its bandwidth requests with
+ * the ones of the other VMs and of the host
+ */
+int bpmp_host_bwmgr_transfer(struct bpmp_host_vm *vm, struct tegra_bpmp_message *msg)
+{
+	if (bpmp_host_bwmgr_aggregated(msg))
+		return bpmp_host_bwmgr_aggregate_xfer(vm, msg);
+
+	return tegra_bpmp_transfer(tegra_bpmp_host_device, msg);
+}
+
+/*
+ * Transfer filter of the BPMP driver, reports the state changes of the
+ * host drivers to the state pages and takes over their bandwidth requests
+ */
+static bool bpmp_host_bwmgr_filter(struct tegra_bpmp *bpmp,
+	struct tegra_bpmp_message *msg, int *err)
+{
+	if (bpmp == tegra_bpmp_host_device && !bpmp_host_sched_serializing())
+		bpmp_host_state_host_xfer(msg);
+
+	if (READ_ONCE(bpmp_host_bwmgr_sender) == current ||
+	    bpmp != tegra_bpmp_host_device || !bpmp_host_bwmgr_aggregated(msg))
+		return false;
+
+	*err = bpmp_host_bwmgr_aggregate_xfer(NULL, msg);
+	return true;
+}
+
+/*
+ * Fills the bandwidth counters of the VM
+ */
+void bpmp_host_bwmgr_stats(struct bpmp_host_vm *vm, struct bpmp_host_vm_stats *stats)
+{
+	const struct bpmp_host_bw_req *req;
+	int i;
+
+	for (i = 0; i < BPMP_HOST_BWMGR_MAX_CLIENTS; i++) {
+		req = &vm->bw.client[i];
+		stats->niso_bw += READ_ONCE(req->niso_bw);
+		stats->iso_bw += READ_ONCE(req->iso_bw);
+		stats->iso_client_bw += READ_ONCE(vm->bw.la[i].bw);
+	}
+}
+
+void bpmp_host_bwmgr_init(void)
+{
+	WRITE_ONCE(tegra_bpmp_transfer_filter, bpmp_host_bwmgr_filter);
+}
+
+void bpmp_host_bwmgr_exit(void)
+{
+	WRITE_ONCE(tegra_bpmp_transfer_filter, NULL);
+
+	// Waits for the host requests being aggregated
+	mutex_lock(&bpmp_host_bwmgr_lock);
+	mutex_unlock(&bpmp_host_bwmgr_lock);
+}
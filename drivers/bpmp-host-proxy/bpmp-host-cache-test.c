@@ -0,0 +1,148 @@
+/**
+ *
+ * NVIDIA BPMP Host Proxy Kernel Module
+ * Tests of the clock tree tracking of the response cache
+ *
+ * Builds a small tree, a root with two children, through the same
+ * messages the guest clock driver sends, and checks that the change of a
+ * clock only drops what depends on it.
+ *
+*/
+#include <kunit/test.h>
+#include "bpmp-host-internal.h"
+
+
+#define TEST_CLK_ROOT     10
+#define TEST_CLK_A        11
+#define TEST_CLK_B        12
+#define TEST_CLK_ORPHAN   13
+
+static void bpmp_host_cache_test_xfer(u32 clk_cmd, u32 clk_id,
+	struct mrq_clk_request *req, struct mrq_clk_response *resp,
+	u32 tx_size, u32 rx_size)
+{
+	struct tegra_bpmp_message msg = {
+		.mrq = MRQ_CLK,
+		.tx = { .data = req, .size = tx_size },
+		.rx = { .data = resp, .size = rx_size },
+	};
+
+	req->cmd_and_id = (clk_cmd << 24) | clk_id;
+	bpmp_host_cache_insert(&msg, 0);
+}
+
+/*
+ * Answers a CMD_CLK_GET_ALL_INFO, num_parents 0 makes a root
+ */
+static void bpmp_host_cache_test_info(u32 clk_id, u8 num_parents, u32 parent)
+{
+	struct mrq_clk_request req = {};
+	struct mrq_clk_response resp = {};
+
+	resp.clk_get_all_info.num_parents = num_parents;
+	resp.clk_get_all_info.parent = parent;
+	bpmp_host_cache_test_xfer(CMD_CLK_GET_ALL_INFO, clk_id, &req, &resp,
+		sizeof(u32), sizeof(resp.clk_get_all_info));
+}
+
+static void bpmp_host_cache_test_set_rate(u32 clk_id, s64 rate)
+{
+	struct mrq_clk_request req = {};
+	struct mrq_clk_response resp = {};
+
+	req.clk_set_rate.rate = rate;
+	resp.clk_set_rate.rate = rate;
+	bpmp_host_cache_test_xfer(CMD_CLK_SET_RATE, clk_id, &req, &resp,
+		sizeof(u32) + sizeof(req.clk_set_rate), sizeof(resp.clk_set_rate));
+}
+
+/*
+ * Memoizes the answer of a CMD_CLK_ROUND_RATE, or looks it up
+ */
+static bool bpmp_host_cache_test_round_rate(u32 clk_id, s64 rate, bool insert)
+{
+	struct mrq_clk_request req = {
+		.cmd_and_id = (CMD_CLK_ROUND_RATE << 24) | clk_id,
+		.clk_round_rate.rate = rate,
+	};
+	struct mrq_clk_response resp = {
+		.clk_round_rate.rate = rate,
+	};
+	struct tegra_bpmp_message msg = {
+		.mrq = MRQ_CLK,
+		.tx = { .data = &req, .size = sizeof(u32) + sizeof(req.clk_round_rate) },
+		.rx = { .data = &resp, .size = sizeof(resp.clk_round_rate) },
+	};
+
+	if (insert) {
+		bpmp_host_cache_insert(&msg, 0);
+		return true;
+	}
+
+	return bpmp_host_cache_lookup(&msg, true);
+}
+
+static int bpmp_host_cache_test_init(struct kunit *test)
+{
+	bpmp_host_cache_invalidate();
+
+	bpmp_host_cache_test_info(TEST_CLK_ROOT, 0, 0);
+	bpmp_host_cache_test_info(TEST_CLK_A, 1, TEST_CLK_ROOT);
+	bpmp_host_cache_test_info(TEST_CLK_B, 1, TEST_CLK_ROOT);
+
+	return 0;
+}
+
+static void bpmp_host_cache_test_exit(struct kunit *test)
+{
+	bpmp_host_cache_invalidate();
+}
+
+static void bpmp_host_cache_test_depends(struct kunit *test)
+{
+	KUNIT_EXPECT_TRUE(test, bpmp_host_clk_depends(TEST_CLK_A, TEST_CLK_A));
+	KUNIT_EXPECT_TRUE(test, bpmp_host_clk_depends(TEST_CLK_A, TEST_CLK_ROOT));
+	KUNIT_EXPECT_FALSE(test, bpmp_host_clk_depends(TEST_CLK_A, TEST_CLK_B));
+	KUNIT_EXPECT_FALSE(test, bpmp_host_clk_depends(TEST_CLK_ROOT, TEST_CLK_A));
+
+	// Without a known path to a root, a clock depends on all of them
+	KUNIT_EXPECT_TRUE(test, bpmp_host_clk_depends(TEST_CLK_ORPHAN, TEST_CLK_B));
+}
+
+static void bpmp_host_cache_test_sibling_memo(struct kunit *test)
+{
+	bpmp_host_cache_test_round_rate(TEST_CLK_A, 1000000, true);
+	bpmp_host_cache_test_round_rate(TEST_CLK_B, 2000000, true);
+
+	bpmp_host_cache_test_set_rate(TEST_CLK_B, 3000000);
+
+	KUNIT_EXPECT_TRUE(test, bpmp_host_cache_test_round_rate(TEST_CLK_A, 1000000, false));
+	KUNIT_EXPECT_FALSE(test, bpmp_host_cache_test_round_rate(TEST_CLK_B, 2000000, false));
+}
+
+static void bpmp_host_cache_test_parent_memo(struct kunit *test)
+{
+	bpmp_host_cache_test_round_rate(TEST_CLK_A, 1000000, true);
+	bpmp_host_cache_test_round_rate(TEST_CLK_B, 2000000, true);
+
+	bpmp_host_cache_test_set_rate(TEST_CLK_ROOT, 4000000);
+
+	KUNIT_EXPECT_FALSE(test, bpmp_host_cache_test_round_rate(TEST_CLK_A, 1000000, false));
+	KUNIT_EXPECT_FALSE(test, bpmp_host_cache_test_round_rate(TEST_CLK_B, 2000000, false));
+}
+
+static struct kunit_case bpmp_host_cache_test_cases[] = {
+	KUNIT_CASE(bpmp_host_cache_test_depends),
+	KUNIT_CASE(bpmp_host_cache_test_sibling_memo),
+	KUNIT_CASE(bpmp_host_cache_test_parent_memo),
+	{}
+};
+
+static struct kunit_suite bpmp_host_cache_test_suite = {
+	.name = "bpmp-host-cache",
+	.init = bpmp_host_cache_test_init,
+	.exit = bpmp_host_cache_test_exit,
+	.test_cases = bpmp_host_cache_test_cases,
+};
+
+kunit_test_suite(bpmp_host_cache_test_suite);
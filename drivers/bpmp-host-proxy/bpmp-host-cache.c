@@ -0,0 +1,457 @@
+/**
+ *
+ * NVIDIA BPMP Host Proxy Kernel Module
+ * Response cache of the immutable BPMP queries, and memoization of the
+ * clock queries that only depend on the clock and its parents
+ *
+ * The answers of some queries (ABI, firmware tag, straps, clock and power
+ * domain enumeration) do not change while the host is up, but every guest
+ * boot asks them again. They are cached, keyed by the MRQ and the request
+ * payload, and served without going through the BPMP. Lookups only take
+ * the RCU read lock.
+ *
+ * MRQ_QUERY_TAG is not cached, its answer is written by the BPMP to the
+ * address given in the request, not in the rx data.
+ *
+ * The answers of CMD_CLK_ROUND_RATE, CMD_CLK_GET_PARENT and
+ * CMD_CLK_GET_FMAX_AT_VMIN, asked again and again by the guest clock
+ * drivers while they negotiate rates, are kept in a bounded direct mapped
+ * table. An answer is dropped when a CMD_CLK_SET_RATE or CMD_CLK_SET_PARENT
+ * of its clock, or of an ancestor of it, goes through the proxy. The
+ * parents, and the root clocks, are learnt from the GET_ALL_INFO,
+ * GET_PARENT and SET_PARENT messages: only the answers of a clock whose
+ * ancestors are all known up to a root survive the change of a clock
+ * that is not one of them. Clock
+ * changes made by the host drivers are not seen, hence the invalidate
+ * ioctl drops these answers too.
+ *
+*/
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/rcupdate.h>
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
+#include <linux/uaccess.h>
+#include <linux/capability.h>
+#include "bpmp-host-internal.h"
+
+
+#define BPMP_HOST_CACHE_BITS          8
+#define BPMP_HOST_CACHE_MAX_ENTRIES   1024
+
+struct bpmp_host_cache_entry {
+	struct hlist_node node;
+	struct rcu_head rcu;
+	u32 mrq;
+	u32 tx_size;
+	u32 rx_size;
+	s32 rx_ret;
+	u8 tx[BPMP_HOST_MAX_PAYLOAD];
+	u8 rx[BPMP_HOST_MAX_PAYLOAD];
+};
+
+static DEFINE_HASHTABLE(bpmp_host_cache, BPMP_HOST_CACHE_BITS);
+
+// Serializes the cache updates
+static DEFINE_SPINLOCK(bpmp_host_cache_lock);
+static unsigned int bpmp_host_cache_entries;
+
+static atomic64_t bpmp_host_cache_hits;
+static atomic64_t bpmp_host_cache_misses;
+
+#define BPMP_HOST_MEMO_SIZE           256   // Power of two
+#define BPMP_HOST_MEMO_DATA_SIZE      16
+#define BPMP_HOST_MEMO_MAX_DEPTH      8
+
+// Parent of a clock not seen yet, and of a root clock
+#define BPMP_HOST_CLK_PARENT_UNKNOWN  U32_MAX
+#define BPMP_HOST_CLK_PARENT_NONE     (U32_MAX - 1)
+
+struct bpmp_host_memo_entry {
+	bool valid;
+	u32 clk_id;
+	u32 tx_size;
+	u32 rx_size;
+	s32 rx_ret;
+	u8 tx[BPMP_HOST_MEMO_DATA_SIZE];
+	u8 rx[BPMP_HOST_MEMO_DATA_SIZE];
+};
+
+// Protects the memoization table and the clock parents
+static DEFINE_SPINLOCK(bpmp_host_memo_lock);
+static struct bpmp_host_memo_entry bpmp_host_memo[BPMP_HOST_MEMO_SIZE];
+static u32 bpmp_host_clk_parent[BPMP_HOST_MAX_RES_ID];
+
+static atomic64_t bpmp_host_memo_hits;
+static atomic64_t bpmp_host_memo_misses;
+
+/*
+ * Checks if the answer of a message never changes
+ */
+static bool bpmp_host_cache_immutable(const struct tegra_bpmp_message *msg)
+{
+	const struct mrq_clk_request *clock_req = msg->tx.data;
+	const struct mrq_pg_request *pg_req = msg->tx.data;
+
+	if (msg->tx.size > BPMP_HOST_MAX_PAYLOAD || msg->rx.size > BPMP_HOST_MAX_PAYLOAD)
+		return false;
+
+	switch (msg->mrq) {
+	case MRQ_QUERY_ABI:
+	case MRQ_QUERY_FW_TAG:
+	case MRQ_STRAP:
+		return true;
+	case MRQ_CLK:
+		if (msg->tx.size < sizeof(u32))
+			return false;
+		switch (clock_req->cmd_and_id >> 24) {
+		case CMD_CLK_GET_MAX_CLK_ID:
+		case CMD_CLK_GET_ALL_INFO:
+			return true;
+		}
+		return false;
+	case MRQ_PG:
+		if (msg->tx.size < offsetofend(struct mrq_pg_request, id))
+			return false;
+		switch (pg_req->cmd) {
+		case CMD_PG_GET_NAME:
+		case CMD_PG_GET_MAX_ID:
+			return true;
+		}
+		return false;
+	default:
+		return false;
+	}
+}
+
+/*
+ * Checks if the answer of a message only depends on its clock and the
+ * rates and parents of the clock and its ancestors
+ */
+static bool bpmp_host_memo_pure(const struct tegra_bpmp_message *msg)
+{
+	const struct mrq_clk_request *clock_req = msg->tx.data;
+
+	if (msg->mrq != MRQ_CLK || msg->tx.size < sizeof(u32) ||
+	    msg->tx.size > BPMP_HOST_MEMO_DATA_SIZE ||
+	    msg->rx.size > BPMP_HOST_MEMO_DATA_SIZE)
+		return false;
+
+	switch (clock_req->cmd_and_id >> 24) {
+	case CMD_CLK_ROUND_RATE:
+	case CMD_CLK_GET_PARENT:
+	case CMD_CLK_GET_FMAX_AT_VMIN:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static u32 bpmp_host_cache_hash(const struct tegra_bpmp_message *msg)
+{
+	return jhash(msg->tx.data, msg->tx.size, msg->mrq ^ (msg->rx.size << 16));
+}
+
+static bool bpmp_host_cache_match(const struct bpmp_host_cache_entry *entry,
+	const struct tegra_bpmp_message *msg)
+{
+	return entry->mrq == msg->mrq && entry->tx_size == msg->tx.size &&
+		entry->rx_size == msg->rx.size &&
+		!memcmp(entry->tx, msg->tx.data, msg->tx.size);
+}
+
+static struct bpmp_host_memo_entry *bpmp_host_memo_slot(const struct tegra_bpmp_message *msg)
+{
+	return &bpmp_host_memo[bpmp_host_cache_hash(msg) & (BPMP_HOST_MEMO_SIZE - 1)];
+}
+
+static bool bpmp_host_memo_lookup(struct tegra_bpmp_message *msg)
+{
+	struct bpmp_host_memo_entry *entry = bpmp_host_memo_slot(msg);
+	bool hit = false;
+
+	spin_lock(&bpmp_host_memo_lock);
+	if (entry->valid && entry->tx_size == msg->tx.size &&
+	    entry->rx_size == msg->rx.size &&
+	    !memcmp(entry->tx, msg->tx.data, msg->tx.size)) {
+		memcpy(msg->rx.data, entry->rx, entry->rx_size);
+		msg->rx.ret = entry->rx_ret;
+		hit = true;
+	}
+	spin_unlock(&bpmp_host_memo_lock);
+
+	atomic64_inc(hit ? &bpmp_host_memo_hits : &bpmp_host_memo_misses);
+
+	return hit;
+}
+
+/*
+ * Checks if the answers about a clock can change with the rate or parent
+ * of another one. A clock with an ancestor whose parent is not known, or
+ * deeper than BPMP_HOST_MEMO_MAX_DEPTH, depends on all of them, one whose
+ * ancestors are known up to a root only on them.
+ */
+static bool bpmp_host_memo_depends(u32 clk_id, u32 changed_id)
+{
+	u32 parent;
+	int depth;
+
+	for (depth = 0; depth < BPMP_HOST_MEMO_MAX_DEPTH; depth++) {
+		if (clk_id == changed_id)
+			return true;
+
+		parent = clk_id < BPMP_HOST_MAX_RES_ID ?
+			bpmp_host_clk_parent[clk_id] : BPMP_HOST_CLK_PARENT_UNKNOWN;
+		if (parent == BPMP_HOST_CLK_PARENT_UNKNOWN)
+			return true;
+		if (parent == BPMP_HOST_CLK_PARENT_NONE)
+			return false;
+
+		clk_id = parent;
+	}
+
+	return true;
+}
+
+/*
+ * Checks if the rate of a clock can change with the rate or parent of
+ * another one, as far as the proxy knows the clock tree
+ */
+bool bpmp_host_clk_depends(u32 clk_id, u32 changed_id)
+{
+	bool depends;
+
+	spin_lock(&bpmp_host_memo_lock);
+	depends = bpmp_host_memo_depends(clk_id, changed_id);
+	spin_unlock(&bpmp_host_memo_lock);
+
+	return depends;
+}
+
+/*
+ * Drops the answers that the rate or parent change of a clock can modify
+ */
+static void bpmp_host_memo_invalidate_clk(u32 changed_id)
+{
+	int i;
+
+	for (i = 0; i < BPMP_HOST_MEMO_SIZE; i++) {
+		if (bpmp_host_memo[i].valid &&
+		    bpmp_host_memo_depends(bpmp_host_memo[i].clk_id, changed_id))
+			bpmp_host_memo[i].valid = false;
+	}
+}
+
+static void bpmp_host_memo_set_parent(u32 clk_id, u32 parent_id)
+{
+	if (clk_id < BPMP_HOST_MAX_RES_ID)
+		bpmp_host_clk_parent[clk_id] = parent_id;
+}
+
+/*
+ * Learns from a transferred MRQ_CLK message, ret being the
+ * tegra_bpmp_transfer return code
+ */
+static void bpmp_host_memo_update(const struct tegra_bpmp_message *msg, int ret)
+{
+	const struct mrq_clk_request *clock_req = msg->tx.data;
+	const struct mrq_clk_response *clock_resp = msg->rx.data;
+	struct bpmp_host_memo_entry *entry;
+	u32 clk_cmd, clk_id;
+	bool ok = !ret && !msg->rx.ret;
+
+	if (msg->mrq != MRQ_CLK || msg->tx.size < sizeof(u32))
+		return;
+
+	clk_cmd = clock_req->cmd_and_id >> 24;
+	clk_id = clock_req->cmd_and_id & 0x00FFFFFF;
+
+	spin_lock(&bpmp_host_memo_lock);
+
+	switch (clk_cmd) {
+	case CMD_CLK_SET_PARENT:
+		// Even a failed change can have moved the clock
+		bpmp_host_memo_set_parent(clk_id, ok && msg->rx.size >= sizeof(u32) ?
+			clock_resp->clk_set_parent.parent_id : BPMP_HOST_CLK_PARENT_UNKNOWN);
+		fallthrough;
+	case CMD_CLK_SET_RATE:
+		bpmp_host_memo_invalidate_clk(clk_id);
+		break;
+	case CMD_CLK_GET_PARENT:
+		if (ok && msg->rx.size >= sizeof(u32))
+			bpmp_host_memo_set_parent(clk_id, clock_resp->clk_get_parent.parent_id);
+		break;
+	case CMD_CLK_GET_ALL_INFO:
+		// A clock without possible parents is a root
+		if (ok && msg->rx.size >= sizeof(clock_resp->clk_get_all_info))
+			bpmp_host_memo_set_parent(clk_id, clock_resp->clk_get_all_info.num_parents ?
+				clock_resp->clk_get_all_info.parent : BPMP_HOST_CLK_PARENT_NONE);
+		break;
+	}
+
+	if (!ret && bpmp_host_memo_pure(msg)) {
+		entry = bpmp_host_memo_slot(msg);
+		entry->valid = true;
+		entry->clk_id = clk_id;
+		entry->tx_size = msg->tx.size;
+		entry->rx_size = msg->rx.size;
+		entry->rx_ret = msg->rx.ret;
+		memcpy(entry->tx, msg->tx.data, msg->tx.size);
+		memcpy(entry->rx, msg->rx.data, msg->rx.size);
+	}
+
+	spin_unlock(&bpmp_host_memo_lock);
+}
+
+static void bpmp_host_memo_invalidate(void)
+{
+	int i;
+
+	spin_lock(&bpmp_host_memo_lock);
+	for (i = 0; i < BPMP_HOST_MEMO_SIZE; i++)
+		bpmp_host_memo[i].valid = false;
+	for (i = 0; i < BPMP_HOST_MAX_RES_ID; i++)
+		bpmp_host_clk_parent[i] = BPMP_HOST_CLK_PARENT_UNKNOWN;
+	spin_unlock(&bpmp_host_memo_lock);
+}
+
+/*
+ * Answers a message from the cache or, with memo, the memoized clock
+ * answers. Returns true, with the rx data filled in, if it was found.
+ */
+bool bpmp_host_cache_lookup(struct tegra_bpmp_message *msg, bool memo)
+{
+	struct bpmp_host_cache_entry *entry;
+	bool hit = false;
+	u32 hash;
+
+	if (bpmp_host_memo_pure(msg))
+		return memo && bpmp_host_memo_lookup(msg);
+
+	if (!bpmp_host_cache_immutable(msg))
+		return false;
+
+	hash = bpmp_host_cache_hash(msg);
+
+	rcu_read_lock();
+	hash_for_each_possible_rcu(bpmp_host_cache, entry, node, hash) {
+		if (bpmp_host_cache_match(entry, msg)) {
+			memcpy(msg->rx.data, entry->rx, entry->rx_size);
+			msg->rx.ret = entry->rx_ret;
+			hit = true;
+			break;
+		}
+	}
+	rcu_read_unlock();
+
+	atomic64_inc(hit ? &bpmp_host_cache_hits : &bpmp_host_cache_misses);
+
+	return hit;
+}
+
+/*
+ * Caches the answer of a transferred message, ret being the
+ * tegra_bpmp_transfer return code. Called for the state changes in the
+ * order they are transferred, and for the queries not overtaken by one.
+ */
+void bpmp_host_cache_insert(const struct tegra_bpmp_message *msg, int ret)
+{
+	struct bpmp_host_cache_entry *entry, *old;
+	u32 hash;
+
+	bpmp_host_memo_update(msg, ret);
+
+	if (ret || !bpmp_host_cache_immutable(msg))
+		return;
+
+	entry = kzalloc(sizeof(*entry), GFP_KERNEL);
+	if (!entry)
+		return;
+
+	entry->mrq = msg->mrq;
+	entry->tx_size = msg->tx.size;
+	entry->rx_size = msg->rx.size;
+	entry->rx_ret = msg->rx.ret;
+	memcpy(entry->tx, msg->tx.data, msg->tx.size);
+	memcpy(entry->rx, msg->rx.data, msg->rx.size);
+
+	hash = bpmp_host_cache_hash(msg);
+
+	spin_lock(&bpmp_host_cache_lock);
+
+	if (bpmp_host_cache_entries >= BPMP_HOST_CACHE_MAX_ENTRIES)
+		goto out_free;
+
+	hash_for_each_possible(bpmp_host_cache, old, node, hash) {
+		if (bpmp_host_cache_match(old, msg))
+			goto out_free;
+	}
+
+	hash_add_rcu(bpmp_host_cache, &entry->node, hash);
+	bpmp_host_cache_entries++;
+	spin_unlock(&bpmp_host_cache_lock);
+	return;
+
+out_free:
+	spin_unlock(&bpmp_host_cache_lock);
+	kfree(entry);
+}
+
+/*
+ * Drops all the cached answers, for instance after a BPMP firmware reload
+ */
+void bpmp_host_cache_invalidate(void)
+{
+	struct bpmp_host_cache_entry *entry;
+	struct hlist_node *tmp;
+	int bkt;
+
+	spin_lock(&bpmp_host_cache_lock);
+	hash_for_each_safe(bpmp_host_cache, bkt, tmp, entry, node) {
+		hash_del_rcu(&entry->node);
+		kfree_rcu(entry, rcu);
+	}
+	bpmp_host_cache_entries = 0;
+	spin_unlock(&bpmp_host_cache_lock);
+
+	bpmp_host_memo_invalidate();
+	bpmp_host_state_invalidate();
+}
+
+long bpmp_host_cache_ioctl(unsigned int cmd, void __user *argp)
+{
+	struct bpmp_host_cache_stats stats = {};
+
+	switch (cmd) {
+	case BPMP_HOST_IOCTL_CACHE_STATS:
+		stats.hits = atomic64_read(&bpmp_host_cache_hits);
+		stats.misses = atomic64_read(&bpmp_host_cache_misses);
+		stats.entries = READ_ONCE(bpmp_host_cache_entries);
+		stats.memo_hits = atomic64_read(&bpmp_host_memo_hits);
+		stats.memo_misses = atomic64_read(&bpmp_host_memo_misses);
+		if (copy_to_user(argp, &stats, sizeof(stats)))
+			return -EFAULT;
+		return 0;
+	case BPMP_HOST_IOCTL_CACHE_INVALIDATE:
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+		bpmp_host_cache_invalidate();
+		return 0;
+	default:
+		return -ENOTTY;
+	}
+}
+
+void bpmp_host_cache_init(void)
+{
+	bpmp_host_memo_invalidate();
+}
+
+void bpmp_host_cache_exit(void)
+{
+	bpmp_host_cache_invalidate();
+
+	// Wait for the entries freed with kfree_rcu
+	rcu_barrier();
+}
@@ -0,0 +1,146 @@
+/**
+ *
+ * NVIDIA BPMP Host Proxy Kernel Module
+ * Compound messages
+ *
+ * A BPMP_VIRT_MSG_F_COMPOUND inline message carries a sequence of
+ * messages, like the clock, reset and power domain requests of a device
+ * probe, that is transferred with a single round trip through the VMM.
+ * Each step goes through the policy and the scheduler like a message of
+ * its own: the steps are queued one after the other, each one once the
+ * previous one is done, so a compound message saves the VMM round trips
+ * but not the scheduler ones.
+ *
+*/
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include "bpmp-host-internal.h"
+
+
+/**
+ * A step of a compound message, pointing into its tx and rx data
+ */
+struct bpmp_host_compound_step {
+	struct bpmp_virt_step *answer;		///< Step header in the rx data
+	struct tegra_bpmp_message msg;
+};
+
+/*
+ * Splits the tx data of a compound message into its steps, returns the
+ * number of steps or -EINVAL if they do not fit the message
+ */
+static int bpmp_host_compound_parse(const struct tegra_bpmp_message *msg,
+	struct bpmp_host_compound_step *steps)
+{
+	const u8 *tx = msg->tx.data;
+	u8 *rx = msg->rx.data;
+	struct bpmp_virt_step step;
+	size_t tx_off = 0, rx_off = 0;
+	int n;
+
+	for (n = 0; tx_off < msg->tx.size; n++) {
+		if (n == BPMP_VIRT_COMPOUND_MAX_STEPS ||
+		    msg->tx.size - tx_off < sizeof(step))
+			return -EINVAL;
+
+		memcpy(&step, tx + tx_off, sizeof(step));
+		if (step.tx_size > BPMP_HOST_MAX_PAYLOAD ||
+		    step.rx_size > BPMP_HOST_MAX_PAYLOAD ||
+		    msg->tx.size - tx_off < BPMP_VIRT_STEP_SIZE(step.tx_size) ||
+		    msg->rx.size - rx_off < BPMP_VIRT_STEP_SIZE(step.rx_size))
+			return -EINVAL;
+
+		steps[n].answer = (struct bpmp_virt_step *)(rx + rx_off);
+		steps[n].msg = (struct tegra_bpmp_message) {
+			.mrq = step.mrq,
+			.tx = {
+				.data = tx + tx_off + sizeof(step),
+				.size = step.tx_size,
+			},
+			.rx = {
+				.data = rx + rx_off + sizeof(step),
+				.size = step.rx_size,
+			},
+		};
+
+		tx_off += BPMP_VIRT_STEP_SIZE(step.tx_size);
+		rx_off += BPMP_VIRT_STEP_SIZE(step.rx_size);
+	}
+
+	return n ? n : -EINVAL;
+}
+
+static void bpmp_host_compound_answer(struct bpmp_host_compound_step *step, int err)
+{
+	struct bpmp_virt_step *answer = step->answer;
+
+	answer->mrq = step->msg.mrq;
+	answer->tx_size = step->msg.tx.size;
+	answer->rx_size = err ? 0 : step->msg.rx.size;
+	answer->err = err;
+	answer->ret = err ? 0 : step->msg.rx.ret;
+	answer->reserved = 0;
+}
+
+/*
+ * Transfers the steps of a compound message whose tx and rx data are in
+ * kernel buffers, and writes their answers to its rx data.
+ *
+ * Returns 0 once the steps were processed, with the error of the step
+ * that failed, if any, in xfer_ret, or a negative error if the message
+ * is invalid or its first step could not be queued, in which case the
+ * whole message can be submitted again.
+ */
+int bpmp_host_compound_xfer(struct bpmp_host_vm *vm, struct tegra_bpmp_message *msg,
+	bool nonblock, int *xfer_ret)
+{
+	struct bpmp_host_compound_step steps[BPMP_VIRT_COMPOUND_MAX_STEPS];
+	int err = 0;
+	int ret;
+	int n, i, j;
+
+	n = bpmp_host_compound_parse(msg, steps);
+	if (n < 0)
+		return n;
+
+	memset(msg->rx.data, 0, msg->rx.size);
+
+	// Nothing is executed if a step is not allowed
+	for (i = 0; i < n; i++) {
+		err = bpmp_host_proxy_validate(vm, &steps[i].msg);
+		if (err) {
+			for (j = 0; j < n; j++)
+				bpmp_host_compound_answer(&steps[j], j == i ? err : -ECANCELED);
+			goto out;
+		}
+	}
+
+	for (i = 0; i < n && !err; i++) {
+		ret = bpmp_host_sched_xfer(vm, &steps[i].msg, nonblock, &err);
+
+		// Only the first step can be left for a retry, the others are waited for
+		if ((ret == -EAGAIN || ret == -ERESTARTSYS) && !i)
+			return ret;
+		// The steps before it were executed, the message can not be restarted
+		if (ret == -ERESTARTSYS)
+			ret = -EINTR;
+		if (ret)
+			err = ret;
+
+		bpmp_host_compound_answer(&steps[i], err);
+
+		if (!err && steps[i].msg.rx.ret)
+			err = -EREMOTEIO;
+
+		nonblock = false;
+	}
+
+	for (; i < n; i++)
+		bpmp_host_compound_answer(&steps[i], -ECANCELED);
+
+out:
+	*xfer_ret = err;
+	msg->rx.ret = 0;
+
+	return 0;
+}
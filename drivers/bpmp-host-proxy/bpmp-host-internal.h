@@ -0,0 +1,339 @@
+/**
+ *
+ * NVIDIA BPMP Host Proxy Kernel Module, internal definitions shared
+ * by the host proxy source files
+ *
+*/
+#ifndef __BPMP_HOST_INTERNAL__H__
+#define __BPMP_HOST_INTERNAL__H__
+
+#include <linux/kernel.h>
+#include <linux/bitmap.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/poll.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/rcupdate.h>
+#include <linux/atomic.h>
+#include <linux/cache.h>
+#include <linux/mempool.h>
+#include <linux/list.h>
+#include <linux/wait.h>
+#include <linux/ktime.h>
+#include <soc/tegra/bpmp.h>
+#include "bpmp-host-proxy.h"
+
+
+#define DEVICE_NAME "bpmp-host"   // Device name.
+
+#define BPMP_HOST_VERBOSE    0
+
+/**
+ * Put this flag in 0 in order that the BPMP host proxy only allows
+ * the allowed BPMP resources to be used by the VMs.
+ *
+ * Put this flag in 1 in order that the BPMP host proxy allows
+ * all the BPMP resources to be accessible by the virtual machines.
+ * This option is useful for debugging, but is INSECURE, and it could
+ * stop the host. To avoid stop the host use
+ * "clk_ignore_unused pd_ignore_unused" in kernel command line
+ *
+*/
+#define BPMP_HOST_ALLOWS_ALL   0
+
+/**
+ * Put this flag in 1 in order that the VMs can set the bandwidth of the
+ * MRQ_BWMGR_INT clients. Their requests are aggregated with the ones of
+ * the other VMs and of the host, but a VM can still raise the memory
+ * clock floor of the whole system.
+ *
+*/
+#define BPMP_HOST_ALLOWS_BWMGR_INT   0
+
+#if BPMP_HOST_VERBOSE
+#define deb_info(...)     printk(KERN_INFO DEVICE_NAME ": "__VA_ARGS__)
+#else
+#define deb_info(...)
+#endif
+
+#define deb_error(...)    printk(KERN_ALERT DEVICE_NAME ": "__VA_ARGS__)
+#define deb_warn(...)     printk(KERN_WARNING DEVICE_NAME ": "__VA_ARGS__)
+
+#define BUF_SIZE 1024
+
+// Number of transfer buffers reserved for allocations under memory pressure
+#define BPMP_HOST_POOL_MIN   4
+
+// Number of transfer buffers reserved per VM
+#define BPMP_HOST_VM_POOL_MIN   2
+
+extern int tegra_bpmp_transfer(struct tegra_bpmp *, struct tegra_bpmp_message *);
+extern struct tegra_bpmp *tegra_bpmp_host_device;
+extern bool (*tegra_bpmp_transfer_filter)(struct tegra_bpmp *, struct tegra_bpmp_message *, int *);
+
+// Highest clock, reset and power domain id (+1) that can be allowed
+#define BPMP_HOST_MAX_RES_ID       1024
+
+// Size of the MRQ indexed policy table
+#define BPMP_HOST_MRQ_TABLE_SIZE   128
+
+// Dispatch classes of the messages, in priority order
+#define BPMP_HOST_CLASS_CRITICAL   0
+#define BPMP_HOST_CLASS_BULK       1
+#define BPMP_HOST_NR_CLASSES       2
+
+/**
+ * BPMP access policy, compiled from struct bpmp_allowed_res
+ */
+struct bpmp_host_policy {
+	DECLARE_BITMAP(clock, BPMP_HOST_MAX_RES_ID);
+	DECLARE_BITMAP(reset, BPMP_HOST_MAX_RES_ID);
+	DECLARE_BITMAP(pd, BPMP_HOST_MAX_RES_ID);
+	DECLARE_BITMAP(critical_mrq, BPMP_HOST_MRQ_TABLE_SIZE);
+	u32 critical_clk_cmds;		///< Bit n set for a critical CMD_CLK n
+	u32 critical_pg_cmds;		///< Bit n set for a critical CMD_PG n
+	struct rcu_head rcu;
+};
+
+/**
+ * Per VM queue and token bucket of the scheduler, protected by the
+ * scheduler lock
+ */
+struct bpmp_host_vm_sched {
+	struct list_head queue[BPMP_HOST_NR_CLASSES];	///< Requests waiting to be dispatched
+	u32 queued;			///< In all the classes
+	u32 depth;			///< Submitters wait while queued reaches it
+	u32 rate;			///< Messages per second, 0 for no limit
+	u32 burst;
+	u64 credit;			///< In BPMP_HOST_SCHED_COST units per message
+	ktime_t last;			///< Last refill of the credit
+	bool coalesce_rates;		///< Coalesce the queued CMD_CLK_SET_RATE of a clock
+	wait_queue_head_t space;	///< Submitters waiting for room in the queue
+	atomic_t clk_changes;		///< Clock rate and parent changes not completed yet
+};
+
+/**
+ * Per VM shadow of the resources state, only used by the serialized transfers
+ */
+struct bpmp_host_vm_shadow {
+	DECLARE_BITMAP(clk_enabled, BPMP_HOST_MAX_RES_ID);	///< Clocks enabled by the VM
+	DECLARE_BITMAP(pd_on, BPMP_HOST_MAX_RES_ID);		///< Power domains turned on by the VM
+	DECLARE_BITMAP(reset_known, BPMP_HOST_MAX_RES_ID);	///< Resets driven by the VM
+	DECLARE_BITMAP(reset_asserted, BPMP_HOST_MAX_RES_ID);
+};
+
+// Highest MRQ_BWMGR, MRQ_BWMGR_INT and MRQ_ISO_CLIENT client id (+1) that is aggregated
+#define BPMP_HOST_BWMGR_MAX_CLIENTS  64
+
+#define BPMP_HOST_BWMGR_SET_SIZE \
+	offsetofend(struct mrq_bwmgr_int_request, bwmgr_calc_set_req)
+
+/**
+ * Bandwidth request of a MRQ_BWMGR_INT client
+ */
+struct bpmp_host_bw_req {
+	u32 niso_bw;		///< kBps
+	u32 iso_bw;		///< kBps
+	u32 mc_floor;		///< In floor_unit
+	u8 floor_unit;		///< BWMGR_INT_UNIT_*
+};
+
+/**
+ * Latency allowance request of a MRQ_ISO_CLIENT client
+ */
+struct bpmp_host_la_req {
+	u32 bw;			///< kBps
+	u32 init_bw_floor;	///< kBps
+};
+
+/**
+ * Bandwidth requests of a VM, or of the host drivers, protected by the
+ * bandwidth aggregation lock
+ */
+struct bpmp_host_vm_bw {
+	struct bpmp_host_bw_req client[BPMP_HOST_BWMGR_MAX_CLIENTS];	///< CMD_BWMGR_INT_CALC_AND_SET
+	struct bpmp_host_la_req la[BPMP_HOST_BWMGR_MAX_CLIENTS];	///< CMD_ISO_CLIENT_CALCULATE_LA
+	u32 sum_niso_bw;		///< CMD_BWMGR_CALC_RATE, kBps
+	u32 iso_bw[BPMP_HOST_BWMGR_MAX_CLIENTS];	///< CMD_BWMGR_CALC_RATE per client, kBps
+};
+
+/**
+ * Per VM state of the host proxy. Each VM has its own cache line, so
+ * the VMs do not contend on each other's counters.
+ */
+struct bpmp_host_vm {
+	u32 id;
+	struct bpmp_host_policy __rcu *policy;	///< Runtime policy, NULL for the device tree one
+	mempool_t *buf_pool;			///< Reserved buffers for concurrent users of a file
+	atomic_t opens;				///< Open files bound to the VM
+	atomic64_t xfers;
+	atomic64_t rejected;
+	atomic64_t errors;
+	atomic64_t tx_bytes;
+	atomic64_t rx_bytes;
+	atomic64_t elided;
+	atomic64_t coalesced;
+	struct bpmp_host_vm_sched sched;
+	struct bpmp_host_vm_shadow shadow;
+	struct bpmp_host_vm_bw bw;
+	struct bpmp_host_state_page *state;	///< Mapped by the VMM, NULL until then
+} ____cacheline_aligned_in_smp;
+
+/**
+ * A transfer request of a VM, queued to the scheduler. The message and
+ * its data must stay valid until done is called.
+ */
+struct bpmp_host_req {
+	struct list_head node;
+	struct bpmp_host_vm *vm;
+	struct tegra_bpmp_message *msg;
+	int class;				///< BPMP_HOST_CLASS_*, set when queued
+	bool clk_change;			///< Counted in the clk_changes of the VM
+	int ret;				///< tegra_bpmp_transfer return code
+	void (*done)(struct bpmp_host_req *req);
+	struct list_head coalesced;		///< Requests superseded by this one
+};
+
+struct bpmp_host_ring;
+struct bpmp_host_vhost;
+
+/**
+ * Kernel tx/rx buffers of a synchronous transfer
+ */
+struct bpmp_host_xfer_buf {
+	u8 tx[BUF_SIZE];
+	u8 rx[BUF_SIZE];
+};
+
+/**
+ * Per open file state of the host proxy device
+ */
+struct bpmp_host_proxy_file {
+	struct bpmp_host_vm *vm;	///< VM whose policy applies to the transfers
+	struct bpmp_host_ring *ring;	///< Shared memory rings, if set up
+	struct bpmp_host_vhost *vhost;	///< In-kernel slot backend, if set up
+	struct mutex buf_lock;		///< Protects buf
+	struct bpmp_host_xfer_buf buf;	///< Preallocated buffers of write() and ioctl()
+};
+
+// Workqueue that runs the asynchronous (ring) transfers
+extern struct workqueue_struct *bpmp_host_proxy_wq;
+
+// Policy compiled from the device tree, used by the VMs without a runtime policy
+extern struct bpmp_host_policy *bpmp_host_default_policy;
+
+extern struct bpmp_host_vm bpmp_host_vms[BPMP_HOST_MAX_VMS];
+
+// bpmp-host-proxy.c
+int bpmp_host_proxy_validate(struct bpmp_host_vm *vm, struct tegra_bpmp_message *msg);
+int bpmp_host_proxy_transfer(struct bpmp_host_vm *vm, struct tegra_bpmp_message *msg);
+
+// bpmp-host-policy.c
+struct bpmp_host_policy *bpmp_host_policy_create(const struct bpmp_allowed_res *res);
+void bpmp_host_policy_free(struct bpmp_host_policy *policy);
+bool bpmp_host_policy_check(const struct bpmp_host_policy *policy,
+	const struct tegra_bpmp_message *msg);
+int bpmp_host_policy_class(const struct bpmp_host_policy *policy,
+	const struct tegra_bpmp_message *msg);
+
+// bpmp-host-vm.c
+struct bpmp_host_vm *bpmp_host_vm_get(u32 vm_id);
+bool bpmp_host_vm_check(struct bpmp_host_vm *vm, const struct tegra_bpmp_message *msg);
+int bpmp_host_vm_class(struct bpmp_host_vm *vm, const struct tegra_bpmp_message *msg);
+long bpmp_host_vm_load_policy(struct bpmp_host_policy_desc __user *udesc);
+long bpmp_host_vm_drop_policy(__u32 __user *uvm_id);
+long bpmp_host_vm_bind(struct bpmp_host_proxy_file *pfile, __u32 __user *uvm_id);
+void bpmp_host_vm_open(struct bpmp_host_vm *vm);
+void bpmp_host_vm_close(struct bpmp_host_vm *vm);
+void bpmp_host_vm_account(struct bpmp_host_vm *vm,
+	const struct tegra_bpmp_message *msg, int ret);
+long bpmp_host_vm_stats(struct bpmp_host_vm *vm,
+	struct bpmp_host_vm_stats __user *ustats);
+int bpmp_host_vm_init(void);
+void bpmp_host_vm_release_all(void);
+void bpmp_host_vm_exit(void);
+
+// bpmp-host-sched.c
+int bpmp_host_sched_submit(struct bpmp_host_req *req, bool nonblock);
+int bpmp_host_sched_xfer(struct bpmp_host_vm *vm, struct tegra_bpmp_message *msg,
+	bool nonblock, int *xfer_ret);
+long bpmp_host_sched_set_quota(struct bpmp_host_vm_quota __user *uquota);
+void bpmp_host_sched_release(struct bpmp_host_vm *vm,
+	const struct bpmp_host_policy *keep);
+bool bpmp_host_sched_serializing(void);
+int bpmp_host_sched_init(void);
+void bpmp_host_sched_exit(void);
+
+// bpmp-host-cache.c
+bool bpmp_host_cache_lookup(struct tegra_bpmp_message *msg, bool memo);
+void bpmp_host_cache_insert(const struct tegra_bpmp_message *msg, int ret);
+void bpmp_host_cache_invalidate(void);
+long bpmp_host_cache_ioctl(unsigned int cmd, void __user *argp);
+bool bpmp_host_clk_depends(u32 clk_id, u32 changed_id);
+void bpmp_host_cache_init(void);
+void bpmp_host_cache_exit(void);
+
+// bpmp-host-shadow.c
+bool bpmp_host_shadow_filter(struct bpmp_host_vm *vm, struct tegra_bpmp_message *msg);
+void bpmp_host_shadow_update(struct bpmp_host_vm *vm,
+	const struct tegra_bpmp_message *msg, int ret);
+void bpmp_host_shadow_release(struct bpmp_host_vm *vm,
+	const struct bpmp_host_policy *keep);
+
+// bpmp-host-compound.c
+int bpmp_host_compound_xfer(struct bpmp_host_vm *vm, struct tegra_bpmp_message *msg,
+	bool nonblock, int *xfer_ret);
+
+// bpmp-host-bwmgr.c
+bool bpmp_host_bwmgr_aggregated(const struct tegra_bpmp_message *msg);
+int bpmp_host_bwmgr_transfer(struct bpmp_host_vm *vm, struct tegra_bpmp_message *msg);
+void bpmp_host_bwmgr_release(struct bpmp_host_vm *vm);
+void bpmp_host_bwmgr_stats(struct bpmp_host_vm *vm, struct bpmp_host_vm_stats *stats);
+void bpmp_host_bwmgr_init(void);
+void bpmp_host_bwmgr_exit(void);
+
+// bpmp-host-state.c
+void bpmp_host_state_update(const struct tegra_bpmp_message *msg, int ret);
+void bpmp_host_state_host_xfer(const struct tegra_bpmp_message *msg);
+void bpmp_host_state_reset(struct bpmp_host_vm *vm);
+void bpmp_host_state_invalidate(void);
+int bpmp_host_state_mmap(struct bpmp_host_vm *vm, struct vm_area_struct *vma);
+void bpmp_host_state_exit(void);
+
+// bpmp-host-thermal.c
+long bpmp_host_thermal_setup(struct bpmp_host_thermal_setup __user *usetup);
+long bpmp_host_thermal_set_eventfd(struct bpmp_host_vm *vm, __s32 __user *ufd);
+int bpmp_host_thermal_mmap(struct vm_area_struct *vma);
+int bpmp_host_thermal_init(void);
+void bpmp_host_thermal_exit(void);
+
+// bpmp-host-ring.c
+long bpmp_host_ring_setup(struct bpmp_host_proxy_file *pfile,
+	struct bpmp_host_ring_setup __user *usetup);
+void bpmp_host_ring_kick(struct bpmp_host_proxy_file *pfile);
+int bpmp_host_ring_mmap(struct bpmp_host_proxy_file *pfile,
+	struct vm_area_struct *vma);
+__poll_t bpmp_host_ring_poll(struct bpmp_host_proxy_file *pfile,
+	struct file *filep, poll_table *wait);
+void bpmp_host_ring_release(struct bpmp_host_proxy_file *pfile);
+
+// bpmp-host-vhost.c
+long bpmp_host_vhost_setup(struct bpmp_host_proxy_file *pfile,
+	struct bpmp_host_vhost_setup __user *usetup);
+void bpmp_host_vhost_release(struct bpmp_host_proxy_file *pfile);
+
+// bpmp-host-profile.c
+struct device_node;
+int bpmp_host_profile_parse(struct device_node *np);
+long bpmp_host_profile_run(struct bpmp_host_vm *vm,
+	struct bpmp_host_profile_run __user *urun);
+void bpmp_host_profile_free(void);
+
+// bpmp-host-uring.c
+struct io_uring_cmd;
+int bpmp_host_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags);
+int bpmp_host_uring_init(void);
+void bpmp_host_uring_exit(void);
+
+#endif
@@ -0,0 +1,322 @@
+/**
+ *
+ * NVIDIA BPMP Host Proxy Kernel Module
+ * BPMP access policy
+ *
+ * The allowed resources are compiled into bitmaps, and each MRQ is
+ * checked by the validator of its entry in an MRQ indexed table, so
+ * the cost of a check does not depend on the number of allowed
+ * resources. The tx payload size is checked before it is dereferenced.
+ *
+*/
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/bitmap.h>
+#include "bpmp-host-internal.h"
+
+
+typedef bool (*bpmp_host_validator)(const struct bpmp_host_policy *policy,
+	const struct tegra_bpmp_message *msg);
+
+/**
+ * Rule of an MRQ: its validator and the minimal tx payload size
+ * needed by the validator
+ */
+struct bpmp_host_mrq_rule {
+	bpmp_host_validator validate;
+	u32 min_tx_size;
+};
+
+/**
+ * Rule of an MRQ_CLK or MRQ_PG sub-command
+ */
+struct bpmp_host_cmd_rule {
+	u32 min_tx_size;	///< Header plus the sub-command request
+	bool any_id;		///< Information query allowed for any resource id
+};
+
+#define CLK_REQ_SIZE(field) \
+	(sizeof(u32) + sizeof_field(struct mrq_clk_request, field))
+
+#define BPMP_HOST_CLK_CMD_SIZE  32
+
+static const struct bpmp_host_cmd_rule bpmp_host_clk_rules[BPMP_HOST_CLK_CMD_SIZE] = {
+	[CMD_CLK_SET_RATE]       = { CLK_REQ_SIZE(clk_set_rate), false },
+	[CMD_CLK_ROUND_RATE]     = { CLK_REQ_SIZE(clk_round_rate), false },
+	[CMD_CLK_GET_PARENT]     = { sizeof(u32), true },
+	[CMD_CLK_SET_PARENT]     = { CLK_REQ_SIZE(clk_set_parent), false },
+	[CMD_CLK_GET_ALL_INFO]   = { sizeof(u32), true },
+	[CMD_CLK_GET_MAX_CLK_ID] = { sizeof(u32), true },
+};
+
+#define PG_REQ_HDR_SIZE  offsetofend(struct mrq_pg_request, id)
+
+#define BPMP_HOST_PG_CMD_SIZE   8
+
+static const struct bpmp_host_cmd_rule bpmp_host_pg_rules[BPMP_HOST_PG_CMD_SIZE] = {
+	[CMD_PG_SET_STATE]  = { PG_REQ_HDR_SIZE + sizeof_field(struct mrq_pg_request, set_state), false },
+	[CMD_PG_GET_STATE]  = { PG_REQ_HDR_SIZE, true },
+	[CMD_PG_GET_NAME]   = { PG_REQ_HDR_SIZE, true },
+	[CMD_PG_GET_MAX_ID] = { PG_REQ_HDR_SIZE, true },
+};
+
+static inline bool bpmp_host_id_allowed(const unsigned long *bitmap, u32 id)
+{
+	return id < BPMP_HOST_MAX_RES_ID && test_bit(id, bitmap);
+}
+
+/*
+ * Get information and DVFS mrqs are allowed
+ */
+static bool bpmp_host_allow_any(const struct bpmp_host_policy *policy,
+	const struct tegra_bpmp_message *msg)
+{
+	return true;
+}
+
+static bool bpmp_host_check_reset(const struct bpmp_host_policy *policy,
+	const struct tegra_bpmp_message *msg)
+{
+	const struct mrq_reset_request *reset_req = msg->tx.data;
+
+	if (bpmp_host_id_allowed(policy->reset, reset_req->reset_id))
+		return true;
+
+	deb_warn("Warning, reset not allowed for: %d", reset_req->reset_id);
+	return false;
+}
+
+static bool bpmp_host_check_clk(const struct bpmp_host_policy *policy,
+	const struct tegra_bpmp_message *msg)
+{
+	const struct mrq_clk_request *clock_req = msg->tx.data;
+	const struct bpmp_host_cmd_rule *rule = NULL;
+	// bits[31..24] are the command, bits[23..0] are the clock id
+	u32 clk_cmd = clock_req->cmd_and_id >> 24;
+	u32 clk_id = clock_req->cmd_and_id & 0x00FFFFFF;
+	u32 min_tx_size = sizeof(u32);
+
+	if (clk_cmd < BPMP_HOST_CLK_CMD_SIZE) {
+		rule = &bpmp_host_clk_rules[clk_cmd];
+		if (rule->min_tx_size)
+			min_tx_size = rule->min_tx_size;
+	}
+
+	if (msg->tx.size < min_tx_size) {
+		deb_warn("Warning, short clock request: %zu bytes, with command: %d",
+			msg->tx.size, clk_cmd);
+		return false;
+	}
+
+	if (bpmp_host_id_allowed(policy->clock, clk_id))
+		return true;
+
+	// If there is a get info command, allow it no matters the ID
+	if (rule && rule->any_id)
+		return true;
+
+	deb_warn("Warning, clock not allowed for: %d, with command: %d",
+		clk_id, clk_cmd);
+	return false;
+}
+
+static bool bpmp_host_check_pg(const struct bpmp_host_policy *policy,
+	const struct tegra_bpmp_message *msg)
+{
+	const struct mrq_pg_request *pg_req = msg->tx.data;
+	const struct bpmp_host_cmd_rule *rule = NULL;
+	u32 min_tx_size = PG_REQ_HDR_SIZE;
+
+	if (pg_req->cmd < BPMP_HOST_PG_CMD_SIZE) {
+		rule = &bpmp_host_pg_rules[pg_req->cmd];
+		if (rule->min_tx_size)
+			min_tx_size = rule->min_tx_size;
+	}
+
+	if (msg->tx.size < min_tx_size) {
+		deb_warn("Warning, short pg request: %zu bytes, with command: %d",
+			msg->tx.size, pg_req->cmd);
+		return false;
+	}
+
+	if (bpmp_host_id_allowed(policy->pd, pg_req->id))
+		return true;
+
+	// If there is a get info command, allow it no matters the ID
+	if (rule && rule->any_id)
+		return true;
+
+	deb_warn("Warning, pg not allowed for: %d, with command: %d",
+		pg_req->id, pg_req->cmd);
+	return false;
+}
+
+/*
+ * The bandwidth requests of the VMs are aggregated per client with the
+ * ones of the host, the client ids must fit the aggregation tables
+ */
+static bool bpmp_host_check_bwmgr(const struct bpmp_host_policy *policy,
+	const struct tegra_bpmp_message *msg)
+{
+	const struct mrq_bwmgr_request *bwmgr_req = msg->tx.data;
+
+	if (bwmgr_req->cmd == CMD_BWMGR_QUERY_ABI || bpmp_host_bwmgr_aggregated(msg))
+		return true;
+
+	deb_warn("Warning, bwmgr command not allowed: %d", bwmgr_req->cmd);
+	return false;
+}
+
+static bool bpmp_host_check_iso_client(const struct bpmp_host_policy *policy,
+	const struct tegra_bpmp_message *msg)
+{
+	const struct mrq_iso_client_request *iso_req = msg->tx.data;
+
+	if (iso_req->cmd != CMD_ISO_CLIENT_CALCULATE_LA || bpmp_host_bwmgr_aggregated(msg))
+		return true;
+
+	deb_warn("Warning, iso client request not allowed: %zu bytes", msg->tx.size);
+	return false;
+}
+
+#if BPMP_HOST_ALLOWS_BWMGR_INT
+/*
+ * A VM can not cap the memory bandwidth of the whole system
+ */
+static bool bpmp_host_check_bwmgr_int(const struct bpmp_host_policy *policy,
+	const struct tegra_bpmp_message *msg)
+{
+	const struct mrq_bwmgr_int_request *bwmgr_req = msg->tx.data;
+
+	if (bwmgr_req->cmd == CMD_BWMGR_INT_QUERY_ABI || bpmp_host_bwmgr_aggregated(msg))
+		return true;
+
+	deb_warn("Warning, bwmgr command not allowed: %d", bwmgr_req->cmd);
+	return false;
+}
+#endif
+
+static const struct bpmp_host_mrq_rule bpmp_host_mrq_rules[BPMP_HOST_MRQ_TABLE_SIZE] = {
+	[MRQ_PING]             = { bpmp_host_allow_any, 0 },
+	[MRQ_QUERY_TAG]        = { bpmp_host_allow_any, 0 },
+	[MRQ_THREADED_PING]    = { bpmp_host_allow_any, 0 },
+	[MRQ_QUERY_ABI]        = { bpmp_host_allow_any, 0 },
+	[MRQ_DEBUG]            = { bpmp_host_allow_any, 0 },
+	[MRQ_EMC_DVFS_LATENCY] = { bpmp_host_allow_any, 0 },
+	[MRQ_EMC_DVFS_EMCHUB]  = { bpmp_host_allow_any, 0 },
+	[MRQ_ISO_CLIENT]       = { bpmp_host_check_iso_client, sizeof(u32) },
+	[MRQ_STRAP]            = { bpmp_host_allow_any, 0 },
+	[MRQ_BWMGR]            = { bpmp_host_check_bwmgr, sizeof(u32) },
+#if BPMP_HOST_ALLOWS_BWMGR_INT
+	[MRQ_BWMGR_INT]        = { bpmp_host_check_bwmgr_int, sizeof(u32) },
+#endif
+	[MRQ_QUERY_FW_TAG]     = { bpmp_host_allow_any, 0 },
+	[MRQ_RESET]            = { bpmp_host_check_reset, sizeof(struct mrq_reset_request) },
+	[MRQ_CLK]              = { bpmp_host_check_clk, sizeof(u32) },
+	[MRQ_PG]               = { bpmp_host_check_pg, PG_REQ_HDR_SIZE },
+};
+
+/*
+ * Checks if the msg that wants to transmit through the
+ * bpmp-host is allowed by the policy
+ */
+bool bpmp_host_policy_check(const struct bpmp_host_policy *policy,
+	const struct tegra_bpmp_message *msg)
+{
+	const struct bpmp_host_mrq_rule *rule;
+
+	if (msg->mrq >= BPMP_HOST_MRQ_TABLE_SIZE ||
+	    !bpmp_host_mrq_rules[msg->mrq].validate) {
+		deb_warn("Warning, msg->mrq %d not allowed", msg->mrq);
+		return false;
+	}
+
+	rule = &bpmp_host_mrq_rules[msg->mrq];
+
+	if (rule->min_tx_size && (msg->tx.size < rule->min_tx_size || !msg->tx.data)) {
+		deb_warn("Warning, msg->mrq %d with short tx payload: %zu bytes",
+			msg->mrq, msg->tx.size);
+		return false;
+	}
+
+	return rule->validate(policy, msg);
+}
+
+static void bpmp_host_policy_set(unsigned long *bitmap, const uint32_t *ids,
+	int size, const char *name)
+{
+	int i;
+
+	for (i = 0; i < size; i++) {
+		if (ids[i] >= BPMP_HOST_MAX_RES_ID) {
+			deb_error("Ignoring %s %u, max id is %d", name, ids[i],
+				BPMP_HOST_MAX_RES_ID - 1);
+			continue;
+		}
+		__set_bit(ids[i], bitmap);
+	}
+}
+
+/*
+ * Returns the dispatch class of a message
+ */
+int bpmp_host_policy_class(const struct bpmp_host_policy *policy,
+	const struct tegra_bpmp_message *msg)
+{
+	const struct mrq_clk_request *clock_req = msg->tx.data;
+	const struct mrq_pg_request *pg_req = msg->tx.data;
+	u32 cmd;
+
+	switch (msg->mrq) {
+	case MRQ_CLK:
+		if (msg->tx.size < sizeof(u32))
+			break;
+		cmd = clock_req->cmd_and_id >> 24;
+		if (cmd < 32 && (policy->critical_clk_cmds & BIT(cmd)))
+			return BPMP_HOST_CLASS_CRITICAL;
+		break;
+	case MRQ_PG:
+		if (msg->tx.size < PG_REQ_HDR_SIZE)
+			break;
+		cmd = pg_req->cmd;
+		if (cmd < 32 && (policy->critical_pg_cmds & BIT(cmd)))
+			return BPMP_HOST_CLASS_CRITICAL;
+		break;
+	default:
+		if (msg->mrq < BPMP_HOST_MRQ_TABLE_SIZE &&
+		    test_bit(msg->mrq, policy->critical_mrq))
+			return BPMP_HOST_CLASS_CRITICAL;
+		break;
+	}
+
+	return BPMP_HOST_CLASS_BULK;
+}
+
+/*
+ * Compiles the allowed resources into a policy
+ */
+struct bpmp_host_policy *bpmp_host_policy_create(const struct bpmp_allowed_res *res)
+{
+	struct bpmp_host_policy *policy;
+
+	policy = kzalloc(sizeof(*policy), GFP_KERNEL);
+	if (!policy)
+		return NULL;
+
+	bpmp_host_policy_set(policy->clock, res->clock, res->clocks_size, "clock");
+	bpmp_host_policy_set(policy->reset, res->reset, res->resets_size, "reset");
+	bpmp_host_policy_set(policy->pd, res->pd, res->pd_size, "power domain");
+
+	// Device probe and resume paths, the information queries are bulk
+	__set_bit(MRQ_RESET, policy->critical_mrq);
+	policy->critical_clk_cmds = BIT(CMD_CLK_ENABLE) | BIT(CMD_CLK_DISABLE) |
+		BIT(CMD_CLK_SET_RATE) | BIT(CMD_CLK_SET_PARENT);
+	policy->critical_pg_cmds = BIT(CMD_PG_SET_STATE);
+
+	return policy;
+}
+
+void bpmp_host_policy_free(struct bpmp_host_policy *policy)
+{
+	kfree(policy);
+}
@@ -0,0 +1,373 @@
+/**
+ *
+ * NVIDIA BPMP Host Proxy Kernel Module
+ * Bring-up profiles
+ *
+ * A profile holds the power domain, clock and reset requests that bring
+ * a passthrough device up, read from a child node of the "profiles" node
+ * of the host proxy:
+ *
+ *	profiles {
+ *		uarta {
+ *			bringup-power-domains = <pd ...>;
+ *			bringup-clock-parents = <clk parent ...>;
+ *			bringup-clock-rates = <clk rate_hi rate_lo ...>;
+ *			bringup-clocks = <clk ...>;
+ *			bringup-resets = <reset ...>;
+ *		};
+ *	};
+ *
+ * A rate is a 64-bit value in Hz, as a pair of cells, most significant
+ * first. The VMM runs a profile before the guest boots. The steps go through the
+ * scheduler like the messages of the VM, so the shadow records the clocks
+ * and power domains they turned on and the identical requests of the
+ * guest driver probe are answered without a BPMP round trip.
+ *
+ * The teardown is derived from the bring-up: the resets are asserted,
+ * then the clocks disabled and the power domains turned off in the
+ * reverse order.
+ *
+*/
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/uaccess.h>
+#include <linux/of.h>
+#include <linux/capability.h>
+#include "bpmp-host-internal.h"
+
+
+/**
+ * A step of a profile, a single BPMP request
+ */
+struct bpmp_host_profile_step {
+	u32 mrq;
+	u32 cmd;
+	u32 id;
+	u64 arg;			///< Parent id, rate in Hz or power state
+};
+
+struct bpmp_host_profile {
+	char name[BPMP_HOST_PROFILE_NAME_SIZE];
+	struct bpmp_host_profile_step *steps;	///< Bring-up, then teardown steps
+	int num_bringup;
+	int num_teardown;
+};
+
+/**
+ * Request and answer storage of a step
+ */
+struct bpmp_host_profile_buf {
+	union {
+		struct mrq_clk_request clk;
+		struct mrq_reset_request reset;
+		struct mrq_pg_request pg;
+	} tx;
+	struct mrq_clk_response rx;
+};
+
+// Read-only once parsed at probe
+static struct bpmp_host_profile *bpmp_host_profiles;
+static int bpmp_host_num_profiles;
+
+/*
+ * Reads a u32 array property of a profile node made of tuples of cells.
+ * Returns the number of values, 0 if the property is absent, or a negative
+ * error if it is malformed or has an incomplete tuple.
+ */
+static int bpmp_host_profile_read(struct device_node *np, const char *prop,
+	u32 **vals, int cells)
+{
+	int n;
+
+	*vals = NULL;
+
+	n = of_property_count_u32_elems(np, prop);
+	if (n == -EINVAL)
+		return 0;
+	if (n < 0 || n % cells)
+		return -EINVAL;
+
+	*vals = kcalloc(n, sizeof(u32), GFP_KERNEL);
+	if (!*vals)
+		return -ENOMEM;
+
+	if (of_property_read_u32_array(np, prop, *vals, n)) {
+		kfree(*vals);
+		*vals = NULL;
+		return -EINVAL;
+	}
+
+	return n;
+}
+
+static struct bpmp_host_profile_step *bpmp_host_profile_add(
+	struct bpmp_host_profile_step *step, u32 mrq, u32 cmd, u32 id, u64 arg)
+{
+	*step = (struct bpmp_host_profile_step) {
+		.mrq = mrq,
+		.cmd = cmd,
+		.id = id,
+		.arg = arg,
+	};
+
+	return step + 1;
+}
+
+/*
+ * Compiles the properties of a profile node into its bring-up and
+ * teardown steps
+ */
+static int bpmp_host_profile_build(struct device_node *np,
+	struct bpmp_host_profile *profile)
+{
+	u32 *pds, *parents, *rates, *clocks, *resets;
+	int num_pds, num_parents, num_rates, num_clocks, num_resets;
+	struct bpmp_host_profile_step *step;
+	int ret = -EINVAL;
+	int i;
+
+	num_pds = bpmp_host_profile_read(np, "bringup-power-domains", &pds, 1);
+	num_parents = bpmp_host_profile_read(np, "bringup-clock-parents", &parents, 2);
+	num_rates = bpmp_host_profile_read(np, "bringup-clock-rates", &rates, 3);
+	num_clocks = bpmp_host_profile_read(np, "bringup-clocks", &clocks, 1);
+	num_resets = bpmp_host_profile_read(np, "bringup-resets", &resets, 1);
+
+	if (num_pds < 0 || num_parents < 0 || num_rates < 0 ||
+	    num_clocks < 0 || num_resets < 0) {
+		deb_error("invalid profile %pOFn\n", np);
+		goto out;
+	}
+
+	profile->num_bringup = num_pds + num_parents / 2 + num_rates / 3 +
+		num_clocks + num_resets;
+	profile->num_teardown = num_resets + num_clocks + num_pds;
+
+	if (!profile->num_bringup) {
+		deb_error("empty profile %pOFn\n", np);
+		goto out;
+	}
+
+	profile->steps = kcalloc(profile->num_bringup + profile->num_teardown,
+		sizeof(*step), GFP_KERNEL);
+	if (!profile->steps) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	snprintf(profile->name, sizeof(profile->name), "%pOFn", np);
+
+	step = profile->steps;
+
+	for (i = 0; i < num_pds; i++)
+		step = bpmp_host_profile_add(step, MRQ_PG, CMD_PG_SET_STATE, pds[i], PG_STATE_ON);
+	for (i = 0; i < num_parents; i += 2)
+		step = bpmp_host_profile_add(step, MRQ_CLK, CMD_CLK_SET_PARENT,
+			parents[i], parents[i + 1]);
+	for (i = 0; i < num_rates; i += 3)
+		step = bpmp_host_profile_add(step, MRQ_CLK, CMD_CLK_SET_RATE,
+			rates[i], ((u64)rates[i + 1] << 32) | rates[i + 2]);
+	for (i = 0; i < num_clocks; i++)
+		step = bpmp_host_profile_add(step, MRQ_CLK, CMD_CLK_ENABLE, clocks[i], 0);
+	for (i = 0; i < num_resets; i++)
+		step = bpmp_host_profile_add(step, MRQ_RESET, CMD_RESET_DEASSERT, resets[i], 0);
+
+	for (i = num_resets - 1; i >= 0; i--)
+		step = bpmp_host_profile_add(step, MRQ_RESET, CMD_RESET_ASSERT, resets[i], 0);
+	for (i = num_clocks - 1; i >= 0; i--)
+		step = bpmp_host_profile_add(step, MRQ_CLK, CMD_CLK_DISABLE, clocks[i], 0);
+	for (i = num_pds - 1; i >= 0; i--)
+		step = bpmp_host_profile_add(step, MRQ_PG, CMD_PG_SET_STATE, pds[i], PG_STATE_OFF);
+
+	deb_info("profile %s: %d bring-up and %d teardown steps\n", profile->name,
+		profile->num_bringup, profile->num_teardown);
+
+	ret = 0;
+
+out:
+	kfree(pds);
+	kfree(parents);
+	kfree(rates);
+	kfree(clocks);
+	kfree(resets);
+	return ret;
+}
+
+/*
+ * Reads the profiles of the host proxy node, if it has any
+ */
+int bpmp_host_profile_parse(struct device_node *np)
+{
+	struct device_node *profiles, *child;
+	int n = 0;
+	int ret;
+
+	profiles = of_get_child_by_name(np, "profiles");
+	if (!profiles)
+		return 0;
+
+	bpmp_host_profiles = kcalloc(of_get_child_count(profiles),
+		sizeof(*bpmp_host_profiles), GFP_KERNEL);
+	if (!bpmp_host_profiles) {
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	for_each_child_of_node(profiles, child) {
+		ret = bpmp_host_profile_build(child, &bpmp_host_profiles[n]);
+		if (ret) {
+			of_node_put(child);
+			goto err;
+		}
+		bpmp_host_num_profiles = ++n;
+	}
+
+	of_node_put(profiles);
+	return 0;
+
+err:
+	of_node_put(profiles);
+	bpmp_host_profile_free();
+	return ret;
+}
+
+void bpmp_host_profile_free(void)
+{
+	int i;
+
+	for (i = 0; i < bpmp_host_num_profiles; i++)
+		kfree(bpmp_host_profiles[i].steps);
+
+	kfree(bpmp_host_profiles);
+	bpmp_host_profiles = NULL;
+	bpmp_host_num_profiles = 0;
+}
+
+static const struct bpmp_host_profile *bpmp_host_profile_find(const char *name)
+{
+	int i;
+
+	for (i = 0; i < bpmp_host_num_profiles; i++)
+		if (!strcmp(bpmp_host_profiles[i].name, name))
+			return &bpmp_host_profiles[i];
+
+	return NULL;
+}
+
+/*
+ * Builds the BPMP message of a step
+ */
+static void bpmp_host_profile_msg(const struct bpmp_host_profile_step *step,
+	struct bpmp_host_profile_buf *buf, struct tegra_bpmp_message *msg)
+{
+	memset(buf, 0, sizeof(*buf));
+	*msg = (struct tegra_bpmp_message) {
+		.mrq = step->mrq,
+		.tx.data = &buf->tx,
+	};
+
+	switch (step->mrq) {
+	case MRQ_PG:
+		buf->tx.pg.cmd = step->cmd;
+		buf->tx.pg.id = step->id;
+		buf->tx.pg.set_state.state = step->arg;
+		msg->tx.size = offsetofend(struct mrq_pg_request, set_state);
+		break;
+	case MRQ_RESET:
+		buf->tx.reset.cmd = step->cmd;
+		buf->tx.reset.reset_id = step->id;
+		msg->tx.size = sizeof(buf->tx.reset);
+		break;
+	case MRQ_CLK:
+		// bits[31..24] are the command, bits[23..0] are the clock id
+		buf->tx.clk.cmd_and_id = (step->cmd << 24) | step->id;
+		msg->tx.size = sizeof(u32);
+		if (step->cmd == CMD_CLK_SET_PARENT) {
+			buf->tx.clk.clk_set_parent.parent_id = step->arg;
+			msg->tx.size += sizeof(buf->tx.clk.clk_set_parent);
+		} else if (step->cmd == CMD_CLK_SET_RATE) {
+			buf->tx.clk.clk_set_rate.rate = step->arg;
+			msg->tx.size += sizeof(buf->tx.clk.clk_set_rate);
+		}
+		msg->rx.data = &buf->rx;
+		msg->rx.size = sizeof(buf->rx);
+		break;
+	}
+}
+
+/*
+ * Runs the bring-up or the teardown of a profile as messages of the VM
+ */
+long bpmp_host_profile_run(struct bpmp_host_vm *vm,
+	struct bpmp_host_profile_run __user *urun)
+{
+	const struct bpmp_host_profile_step *steps;
+	const struct bpmp_host_profile *profile;
+	struct bpmp_host_profile_run run;
+	struct tegra_bpmp_message msg;
+	struct bpmp_host_profile_buf buf;
+	int num_steps;
+	int ret, err;
+	int i;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	if (copy_from_user(&run, urun, sizeof(run)))
+		return -EFAULT;
+
+	if (run.op > BPMP_HOST_PROFILE_TEARDOWN || run.reserved)
+		return -EINVAL;
+
+	run.name[sizeof(run.name) - 1] = '\0';
+	profile = bpmp_host_profile_find(run.name);
+	if (!profile)
+		return -ENOENT;
+
+	if (run.op == BPMP_HOST_PROFILE_BRINGUP) {
+		steps = profile->steps;
+		num_steps = profile->num_bringup;
+	} else {
+		steps = profile->steps + profile->num_bringup;
+		num_steps = profile->num_teardown;
+	}
+
+	// Nothing is executed if a step is not allowed
+	for (i = 0; i < num_steps; i++) {
+		bpmp_host_profile_msg(&steps[i], &buf, &msg);
+		ret = bpmp_host_proxy_validate(vm, &msg);
+		if (ret)
+			return ret;
+	}
+
+	run.done = 0;
+	run.err = 0;
+
+	for (i = 0; i < num_steps; i++) {
+		bpmp_host_profile_msg(&steps[i], &buf, &msg);
+		ret = bpmp_host_sched_xfer(vm, &msg, false, &err);
+		if (!ret)
+			ret = err;
+		if (!ret && msg.rx.ret)
+			ret = -EREMOTEIO;
+
+		if (!ret) {
+			run.done++;
+			continue;
+		}
+
+		deb_warn("profile %s, step %d failed: %d\n", profile->name, i, ret);
+
+		if (!run.err)
+			run.err = ret;
+
+		// A teardown goes on to release what it still can
+		if (run.op == BPMP_HOST_PROFILE_BRINGUP)
+			break;
+	}
+
+	if (copy_to_user(urun, &run, sizeof(run)))
+		return -EFAULT;
+
+	return 0;
+}
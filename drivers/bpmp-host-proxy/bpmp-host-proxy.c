@@ -11,12 +11,14 @@
 #include <linux/fs.h>		  // File-system support.
 #include <linux/uaccess.h>	  // User access copy function support.
 #include <linux/slab.h>
+#include <linux/poll.h>
+#include <linux/workqueue.h>
+#include <linux/mempool.h>
 #include <soc/tegra/bpmp.h>
 #include <linux/platform_device.h>
-#include "bpmp-host-proxy.h"
+#include "bpmp-host-internal.h"
 
 
-#define DEVICE_NAME "bpmp-host"   // Device name.
 #define CLASS_NAME  "chardrv"	  // < The device class -- this is a character device driver
 
 MODULE_LICENSE("GPL");						 ///< The license type -- this affects available functionality
@@ -25,30 +27,6 @@ MODULE_DESCRIPTION("NVidia BPMP Host Proxy Kernel Module"); ///< The description
 MODULE_VERSION("0.1");						 ///< A version number to inform users
 
 
-#define BPMP_HOST_VERBOSE    0
-
-/**
- * Put this flag in 0 in order that the BPMP host proxy only allows
- * the allowed BPMP resources to be used by the VMs.
- * 
- * Put this flag in 1 in order that the BPMP host proxy allows
- * all the BPMP resources to be accessible by the virtual machines.
- * This option is useful for debugging, but is INSECURE, and it could
- * stop the host. To avoid stop the host use 
- * "clk_ignore_unused pd_ignore_unused" in kernel command line
- * 
-*/
-#define BPMP_HOST_ALLOWS_ALL   0
-
-#if BPMP_HOST_VERBOSE
-#define deb_info(...)     printk(KERN_INFO DEVICE_NAME ": "__VA_ARGS__)
-#else
-#define deb_info(...)
-#endif
-
-#define deb_error(...)    printk(KERN_ALERT DEVICE_NAME ": "__VA_ARGS__)
-#define deb_warn(...)     printk(KERN_WARNING DEVICE_NAME ": "__VA_ARGS__)
-
 /**
  * Important variables that store data and keep track of relevant information.
  */
@@ -57,6 +35,8 @@ static int major_number;
 static struct class *bpmp_host_proxy_class = NULL;	///< The device-driver class struct pointer
 static struct device *bpmp_host_proxy_device = NULL; ///< The device-driver device struct pointer
 
+struct workqueue_struct *bpmp_host_proxy_wq = NULL;	///< Runs the asynchronous transfers
+
 /**
  * Prototype functions for file operations.
  */
@@ -64,6 +44,9 @@ static int open(struct inode *, struct file *);
 static int close(struct inode *, struct file *);
 static ssize_t read(struct file *, char *, size_t, loff_t *);
 static ssize_t write(struct file *, const char *, size_t, loff_t *);
+static long ioctl(struct file *, unsigned int, unsigned long);
+static int mmap(struct file *, struct vm_area_struct *);
+static __poll_t poll(struct file *, struct poll_table_struct *);
 
 /**
  * File operations structure and the functions it points to.
@@ -75,11 +58,18 @@ static struct file_operations fops =
 		.release = close,
 		.read = read,
 		.write = write,
+		.unlocked_ioctl = ioctl,
+		.mmap = mmap,
+		.poll = poll,
+		.uring_cmd = bpmp_host_uring_cmd,
 };
 
-// BPMP allowed resources structure
+// BPMP allowed resources structure, as read from the device tree
 static struct bpmp_allowed_res bpmp_ares; 
 
+// BPMP allowed resources compiled for the message checks
+struct bpmp_host_policy *bpmp_host_default_policy = NULL;
+
 #if BPMP_HOST_VERBOSE
 // Usage:
 //     hexDump(desc, addr, len, perLine);
@@ -168,11 +158,110 @@ void static hexDump (
 	#define hexDump(...)
 #endif
 
+/*
+ * Compiles the policy and allocates the per VM state, the workqueue and
+ * the memory pools used by the transfers
+ */
+static int bpmp_host_proxy_alloc(void)
+{
+	bpmp_host_default_policy = bpmp_host_policy_create(&bpmp_ares);
+	if (!bpmp_host_default_policy)
+		return -ENOMEM;
+
+	if (bpmp_host_vm_init())
+		goto err_policy;
+
+	bpmp_host_cache_init();
+
+	if (bpmp_host_thermal_init())
+		goto err_cache;
+
+	bpmp_host_proxy_wq = alloc_workqueue("bpmp-host", WQ_UNBOUND | WQ_MEM_RECLAIM, 0);
+	if (!bpmp_host_proxy_wq)
+		goto err_thermal;
+
+	if (bpmp_host_uring_init())
+		goto err_wq;
+
+	if (bpmp_host_sched_init())
+		goto err_uring;
+
+	bpmp_host_bwmgr_init();
+
+	return 0;
+
+err_uring:
+	bpmp_host_uring_exit();
+err_wq:
+	destroy_workqueue(bpmp_host_proxy_wq);
+err_thermal:
+	bpmp_host_thermal_exit();
+err_cache:
+	bpmp_host_cache_exit();
+	bpmp_host_vm_exit();
+err_policy:
+	bpmp_host_policy_free(bpmp_host_default_policy);
+	return -ENOMEM;
+}
+
+/*
+ * Frees what bpmp_host_proxy_alloc allocated, in the reverse order. The
+ * VMs are released first, as that goes through the scheduler, the shadow
+ * state and the state pages.
+ */
+static void bpmp_host_proxy_free(void)
+{
+	bpmp_host_vm_release_all();
+	bpmp_host_bwmgr_exit();
+	bpmp_host_sched_exit();
+	bpmp_host_state_exit();
+	bpmp_host_uring_exit();
+	destroy_workqueue(bpmp_host_proxy_wq);
+	bpmp_host_thermal_exit();
+	bpmp_host_cache_exit();
+	bpmp_host_vm_exit();
+	bpmp_host_policy_free(bpmp_host_default_policy);
+	bpmp_host_profile_free();
+}
+
+/*
+ * Destroys the /dev/bpmp-host-vmN devices of VMs 1 to count - 1
+ */
+static void bpmp_host_proxy_destroy_vm_devices(int count)
+{
+	int i;
+
+	for (i = 1; i < count; i++)
+		device_destroy(bpmp_host_proxy_class, MKDEV(major_number, i));
+}
+
+/*
+ * Creates one /dev/bpmp-host-vmN device per VM, its minor being the VM id.
+ * VM 0 is served by /dev/bpmp-host.
+ */
+static int bpmp_host_proxy_create_vm_devices(void)
+{
+	struct device *dev;
+	int i;
+
+	for (i = 1; i < BPMP_HOST_MAX_VMS; i++) {
+		dev = device_create(bpmp_host_proxy_class, NULL, MKDEV(major_number, i),
+			NULL, DEVICE_NAME "-vm%d", i);
+		if (IS_ERR(dev)) {
+			bpmp_host_proxy_destroy_vm_devices(i);
+			return PTR_ERR(dev);
+		}
+	}
+
+	return 0;
+}
+
 /**
  * Initializes module at installation
  */
 static int bpmp_host_proxy_probe(struct platform_device *pdev)
 {
+	int ret;
 	int i;
 	
 	deb_info("%s, installing module.", __func__);
@@ -215,11 +304,24 @@ static int bpmp_host_proxy_probe(struct platform_device *pdev)
 		deb_info("bpmp_ares.pd %d", bpmp_ares.pd[i]);
 	}
 
+	ret = bpmp_host_proxy_alloc();
+	if (ret)
+		return ret;
+
+	// Read the bring-up profiles, defined next to the allowed resources
+	ret = bpmp_host_profile_parse(pdev->dev.of_node);
+	if (ret) {
+		deb_error("could not read the bring-up profiles\n");
+		bpmp_host_proxy_free();
+		return ret;
+	}
+
 	// Allocate a major number for the device.
 	major_number = register_chrdev(0, DEVICE_NAME, &fops);
 	if (major_number < 0)
 	{
 		deb_error("could not register number.\n");
+		bpmp_host_proxy_free();
 		return major_number;
 	}
 	deb_info("registered correctly with major number %d\n", major_number);
@@ -229,6 +331,7 @@ static int bpmp_host_proxy_probe(struct platform_device *pdev)
 	if (IS_ERR(bpmp_host_proxy_class))
 	{ // Check for error and clean up if there is
 		unregister_chrdev(major_number, DEVICE_NAME);
+		bpmp_host_proxy_free();
 		deb_error("Failed to register device class\n");
 		return PTR_ERR(bpmp_host_proxy_class); // Correct way to return an error on a pointer
 	}
@@ -240,10 +343,22 @@ static int bpmp_host_proxy_probe(struct platform_device *pdev)
 	{								 // Clean up if there is an error
 		class_destroy(bpmp_host_proxy_class); 
 		unregister_chrdev(major_number, DEVICE_NAME);
+		bpmp_host_proxy_free();
 		deb_error("Failed to create the device\n");
 		return PTR_ERR(bpmp_host_proxy_device);
 	}
 
+	ret = bpmp_host_proxy_create_vm_devices();
+	if (ret)
+	{
+		device_destroy(bpmp_host_proxy_class, MKDEV(major_number, 0));
+		class_destroy(bpmp_host_proxy_class);
+		unregister_chrdev(major_number, DEVICE_NAME);
+		bpmp_host_proxy_free();
+		deb_error("Failed to create the VM devices\n");
+		return ret;
+	}
+
 	deb_info("device class created correctly\n"); // Made it! device was initialized
 
 	return 0;
@@ -257,12 +372,13 @@ static int bpmp_host_proxy_probe(struct platform_device *pdev)
 static int bpmp_host_proxy_remove(struct platform_device *pdev)
 {
 	deb_info("removing module.\n");
+	bpmp_host_proxy_destroy_vm_devices(BPMP_HOST_MAX_VMS);
 	device_destroy(bpmp_host_proxy_class, MKDEV(major_number, 0)); // remove the device
 	class_unregister(bpmp_host_proxy_class);						  // unregister the device class
 	class_destroy(bpmp_host_proxy_class);						  // remove the device class
 	unregister_chrdev(major_number, DEVICE_NAME);		  // unregister the major number
+	bpmp_host_proxy_free();
 	deb_info("Goodbye from the LKM!\n");
-	unregister_chrdev(major_number, DEVICE_NAME);
 	return 0;
 }
 
@@ -271,6 +387,23 @@ static int bpmp_host_proxy_remove(struct platform_device *pdev)
  */
 static int open(struct inode *inodep, struct file *filep)
 {
+	struct bpmp_host_proxy_file *pfile;
+	struct bpmp_host_vm *vm;
+
+	// The minor of the device is the VM id
+	vm = bpmp_host_vm_get(iminor(inodep));
+	if (!vm)
+		return -ENODEV;
+
+	pfile = kzalloc(sizeof(*pfile), GFP_KERNEL);
+	if (!pfile)
+		return -ENOMEM;
+
+	mutex_init(&pfile->buf_lock);
+	pfile->vm = vm;
+	bpmp_host_vm_open(vm);
+
+	filep->private_data = pfile;
 	deb_info("device opened.\n");
 	return 0;
 }
@@ -280,6 +413,12 @@ static int open(struct inode *inodep, struct file *filep)
  */
 static int close(struct inode *inodep, struct file *filep)
 {
+	struct bpmp_host_proxy_file *pfile = filep->private_data;
+
+	bpmp_host_vhost_release(pfile);
+	bpmp_host_ring_release(pfile);
+	bpmp_host_vm_close(pfile->vm);
+	kfree(pfile);
 	deb_info("device closed.\n");
 	return 0;
 }
@@ -294,214 +433,410 @@ static ssize_t read(struct file *filep, char *buffer, size_t len, loff_t *offset
 }
 
 /*
- * Checks if the msg that wants to transmit through the
- * bpmp-host is allowed by the device tree configuration
+ * Checks that a message, with its tx data already in kernel memory,
+ * can be forwarded to the BPMP
  */
-static bool check_if_allowed(struct tegra_bpmp_message *msg)
+int bpmp_host_proxy_validate(struct bpmp_host_vm *vm, struct tegra_bpmp_message *msg)
 {
-	struct mrq_reset_request *reset_req = NULL;
-	struct mrq_clk_request *clock_req = NULL;
-	struct mrq_pg_request *pg_req = NULL;
-	uint32_t clk_cmd = 0;
-	int i = 0;
-
-	// Allow get information, DVFS, ISO Client and bandwidth mrqs
-	if(msg->mrq == MRQ_PING ||
-	   msg->mrq == MRQ_QUERY_TAG ||
-	   msg->mrq == MRQ_THREADED_PING ||
-	   msg->mrq == MRQ_QUERY_ABI ||
-	   msg->mrq == MRQ_DEBUG ||
-	   msg->mrq == MRQ_EMC_DVFS_LATENCY ||
-	   msg->mrq == MRQ_EMC_DVFS_EMCHUB ||
-	   msg->mrq == MRQ_ISO_CLIENT ||
-	   msg->mrq == MRQ_STRAP ||
-	   msg->mrq == MRQ_BWMGR || 
-	   msg->mrq == MRQ_QUERY_FW_TAG ){
-		return true;
+	if(!tegra_bpmp_host_device){
+		deb_error("host device not initialised, can't do transfer!");
+		return -ENODEV;
 	}
 
-	// Check for reset and clock mrq
-	if(msg->mrq == MRQ_RESET){
-		reset_req = (struct mrq_reset_request*) msg->tx.data;
-
-		for(i = 0; i < bpmp_ares.resets_size; i++){
-			if(bpmp_ares.reset[i] == reset_req->reset_id){
-				return true;
-			}
-		}
-		deb_warn("Warning, reset not allowed for: %d", reset_req->reset_id);
-		return false;
+	// Only continue if allowed or BPMP_HOST_ALLOWS_ALL
+	if(!bpmp_host_vm_check(vm, msg) && !BPMP_HOST_ALLOWS_ALL){
+		bpmp_host_vm_account(vm, msg, -EPERM);
+		return -EPERM;
 	}
-	else if (msg->mrq == MRQ_CLK){
-		clock_req = (struct mrq_clk_request*) msg->tx.data;
 
-		for(i = 0; i < bpmp_ares.clocks_size; i++){
-			// bits[23..0] are the clock id
-			if(bpmp_ares.clock[i] == (clock_req->cmd_and_id & 0x0FFF)){
-				return true;
-			}
-		}
+	return 0;
+}
 
-		clk_cmd = (clock_req->cmd_and_id >> 24) & 0x000F;
+/*
+ * Forwards a kernel message to the BPMP through the scheduler if it is
+ * allowed, waiting for room in the queue of the VM. Returns the rejection
+ * error or the tegra_bpmp_transfer return code.
+ */
+int bpmp_host_proxy_transfer(struct bpmp_host_vm *vm, struct tegra_bpmp_message *msg)
+{
+	int xfer_ret = 0;
+	int ret;
 
-		// If there is a get info command, allow it no matters the ID
-		if(clk_cmd == CMD_CLK_GET_MAX_CLK_ID ||
-		   clk_cmd == CMD_CLK_GET_ALL_INFO ||
-		   clk_cmd == CMD_CLK_GET_PARENT){
-			return true;
-		}
+	ret = bpmp_host_proxy_validate(vm, msg);
+	if (ret)
+		return ret;
 
-		deb_warn("Warning, clock not allowed for: %d, with command: %d", 
-			clock_req->cmd_and_id & 0x0FFF, clk_cmd);
-		return false;
+	ret = bpmp_host_sched_xfer(vm, msg, false, &xfer_ret);
+	if (ret)
+		return ret;
+
+	return xfer_ret;
+}
+
+/*
+ * Gets the tx/rx buffers for a transfer. The buffers preallocated with the
+ * open file are used, unless another thread is using them, in which case
+ * a buffer from the reserved pool of the VM is taken. This can wait for a
+ * buffer to be returned, but never fails.
+ */
+static struct bpmp_host_xfer_buf *bpmp_host_get_buf(struct bpmp_host_proxy_file *pfile,
+	struct bpmp_host_vm *vm)
+{
+	if (mutex_trylock(&pfile->buf_lock))
+		return &pfile->buf;
+
+	return mempool_alloc(vm->buf_pool, GFP_KERNEL);
+}
+
+static void bpmp_host_put_buf(struct bpmp_host_proxy_file *pfile,
+	struct bpmp_host_vm *vm, struct bpmp_host_xfer_buf *buf)
+{
+	if (buf == &pfile->buf)
+		mutex_unlock(&pfile->buf_lock);
+	else
+		mempool_free(buf, vm->buf_pool);
+}
+
+/*
+ * Copies a userspace message and its tx/rx data into kernel buffers, 
+ * transfers it to the BPMP if it is allowed and copies the results back.
+ *
+ * Returns 0 if the message was transferred, with the tegra_bpmp_transfer
+ * return code in xfer_ret, or a negative error if it was rejected or, with
+ * nonblock, if the queue of the VM is full.
+ */
+static int bpmp_host_proxy_xfer_user(struct bpmp_host_vm *vm,
+	struct tegra_bpmp_message __user *umsg, struct bpmp_host_xfer_buf *buf,
+	bool nonblock, int *xfer_ret)
+{
+	void *txbuf = buf->tx;
+	void *rxbuf = buf->rx;
+	struct tegra_bpmp_message kmsg;
+	const void __user *usertxbuf = NULL;
+	void __user *userrxbuf = NULL;
+	int ret;
+
+	// Copy header
+	if (copy_from_user(&kmsg, umsg, sizeof(kmsg))) {
+		deb_error("copy_from_user(1) failed\n");
+		return -EFAULT;
 	}
-	else if(msg->mrq == MRQ_PG){
-		pg_req = (struct mrq_pg_request*) msg->tx.data;
 
-		for(i = 0; i < bpmp_ares.pd_size; i++){
-			if(bpmp_ares.pd[i] == pg_req->id){
-				return true;
-			}
-		}
-		
-		// If there is a get info command, allow it no matters the ID
-		if(pg_req->cmd == CMD_PG_GET_STATE ||
-		   pg_req->cmd == CMD_PG_GET_NAME ||
-		   pg_req->cmd == CMD_PG_GET_MAX_ID){
-			return true;
-		}
+	deb_info("\nwants to transfer mrq: %d\n", kmsg.mrq);
 
-		deb_warn("Warning, pg not allowed for: %d, with command: %d", 
-			pg_req->id, pg_req->cmd);
-		return false;
+	if (kmsg.tx.size > BUF_SIZE || kmsg.rx.size > BUF_SIZE) {
+		deb_error("tx size %zu or rx size %zu exceeds %d bytes\n",
+			kmsg.tx.size, kmsg.rx.size, BUF_SIZE);
+		return -EINVAL;
 	}
 
-	deb_warn("Warning, msg->mrq %d not allowed", msg->mrq);
+	usertxbuf = (const void __user *)kmsg.tx.data; //save userspace buffers addresses
+	userrxbuf = (void __user *)kmsg.rx.data;
 
-	return false;
-}
+	if (copy_from_user(txbuf, usertxbuf, kmsg.tx.size)) {
+		deb_error("copy_from_user(2) failed\n");
+		return -EFAULT;
+	}
 
-extern int tegra_bpmp_transfer(struct tegra_bpmp *, struct tegra_bpmp_message *);
-extern struct tegra_bpmp *tegra_bpmp_host_device;
+	// The rx data is only written by the BPMP, clear what will be copied back
+	memset(rxbuf, 0, kmsg.rx.size);
 
-#define BUF_SIZE 1024 
+	kmsg.tx.data = txbuf; //reassing to kernel space buffers
+	kmsg.rx.data = rxbuf;
 
-/*
- * Writes to the device
- */
+	ret = bpmp_host_proxy_validate(vm, &kmsg);
+	if (ret)
+		return ret;
 
-static ssize_t write(struct file *filep, const char *buffer, size_t len, loff_t *offset)
-{
+	hexDump (DEVICE_NAME ": kmsg", &kmsg, sizeof(kmsg));
+	hexDump (DEVICE_NAME ": txbuf", txbuf, kmsg.tx.size);
+
+	ret = bpmp_host_sched_xfer(vm, &kmsg, nonblock, xfer_ret);
+	if (ret)
+		return ret;
+
+	// The tx data is not modified by the transfer, only copy back the rx data
+	if (copy_to_user(userrxbuf, kmsg.rx.data, kmsg.rx.size)) {
+		deb_error("copy_to_user(3) failed\n");
+		return -EFAULT;
+	}
+
+	kmsg.tx.data = (const void __force *)usertxbuf;
+	kmsg.rx.data = (void __force *)userrxbuf;
 
-	int ret = len;
-	struct tegra_bpmp_message *kbuf = NULL;
-	void *txbuf = NULL;
-	void *rxbuf = NULL;
-	void *usertxbuf = NULL;
-	void *userrxbuf = NULL;
-
-	if (len > 65535) {	/* paranoia */
-		deb_error("count %zu exceeds max # of bytes allowed, "
-			"aborting write\n", len);
-		goto out_nomem;
+	if (copy_to_user(umsg, &kmsg, sizeof(kmsg))) {
+		deb_error("copy_to_user(1) failed\n");
+		return -EFAULT;
 	}
 
-	ret = -ENOMEM;
-	kbuf = kmalloc(len, GFP_KERNEL);
+	return 0;
+}
 
+/*
+ * Kernel copy of an inline message, header followed by tx and rx data
+ */
+struct bpmp_host_inline_msg {
+	struct bpmp_virt_msg_hdr hdr;
+	u8 data[2 * BPMP_VIRT_COMPOUND_MAX_SIZE];
+};
 
-	if (!kbuf)
-		goto out_nomem;
+/*
+ * Transfers an inline message (struct bpmp_virt_msg_hdr followed by the
+ * tx and rx data) with one copy in and one copy out
+ */
+static ssize_t bpmp_host_proxy_write_inline(struct bpmp_host_proxy_file *pfile,
+	struct bpmp_host_vm *vm, const char __user *buffer, size_t len, bool nonblock)
+{
+	struct bpmp_host_xfer_buf *buf;
+	struct bpmp_host_inline_msg *kbuf;
+	struct bpmp_virt_msg_hdr *hdr;
+	struct tegra_bpmp_message msg = {};
+	u32 max_size = BPMP_HOST_MAX_PAYLOAD;
+	int xfer_ret = 0;
+	ssize_t ret;
+
+	// Compound messages do not fit the stack, the transfer buffers hold them
+	BUILD_BUG_ON(sizeof(*kbuf) > sizeof(*buf));
+
+	if (len < sizeof(*hdr) || len > sizeof(*kbuf)) {
+		deb_error("inline message size %zu out of range\n", len);
+		return -EINVAL;
+	}
 
-	memset(kbuf, 0, len);
+	buf = bpmp_host_get_buf(pfile, vm);
+	kbuf = (struct bpmp_host_inline_msg *)buf;
+	hdr = &kbuf->hdr;
 
-	ret = -EFAULT;
-	
-	// Copy header
 	if (copy_from_user(kbuf, buffer, len)) {
-		deb_error("copy_from_user(1) failed\n");
-		goto out_cfu;
+		deb_error("copy_from_user(inline) failed\n");
+		ret = -EFAULT;
+		goto out;
 	}
 
-	deb_info("\nwants to write %zu bytes, with mrq: %d\n", len, kbuf->mrq);
+	if (hdr->flags == BPMP_VIRT_MSG_F_COMPOUND)
+		max_size = BPMP_VIRT_COMPOUND_MAX_SIZE;
 
-	if(kbuf->tx.size > 0){
-		txbuf = kmalloc(BUF_SIZE, GFP_KERNEL);
-		if (!txbuf)
-			goto out_nomem;
-		memset(txbuf, 0, BUF_SIZE);
-		if (copy_from_user(txbuf, kbuf->tx.data, kbuf->tx.size)) {
-			deb_error("copy_from_user(2) failed\n");
-			goto out_cfu;
+	if (hdr->version != BPMP_VIRT_MSG_VERSION || hdr->hdr_size != sizeof(*hdr) ||
+	    (hdr->flags & ~BPMP_VIRT_MSG_F_COMPOUND) || hdr->tx_size > max_size ||
+	    hdr->rx_size > max_size ||
+	    len != BPMP_VIRT_MSG_SIZE(hdr->tx_size, hdr->rx_size)) {
+		deb_error("invalid inline message header\n");
+		ret = -EINVAL;
+		goto out;
+	}
+
+	msg.mrq = hdr->mrq;
+	msg.tx.data = kbuf->data;
+	msg.tx.size = hdr->tx_size;
+	msg.rx.data = kbuf->data + hdr->tx_size;
+	msg.rx.size = hdr->rx_size;
+
+	hexDump (DEVICE_NAME ": inline", kbuf, len);
+
+	if (hdr->flags & BPMP_VIRT_MSG_F_COMPOUND) {
+		ret = bpmp_host_compound_xfer(vm, &msg, nonblock, &xfer_ret);
+		if (ret == -EAGAIN || ret == -ERESTARTSYS)
+			goto out;
+		if (!ret)
+			ret = xfer_ret;
+	} else {
+		ret = bpmp_host_proxy_validate(vm, &msg);
+		if (!ret) {
+			// Nothing is reported in the message if it could not be queued
+			ret = bpmp_host_sched_xfer(vm, &msg, nonblock, &xfer_ret);
+			if (ret)
+				goto out;
+			ret = xfer_ret;
 		}
 	}
 
-	rxbuf = kmalloc(BUF_SIZE, GFP_KERNEL);
-	if (!rxbuf)
-		goto out_nomem;
-	
-	memset(rxbuf, 0, BUF_SIZE);
-	if (copy_from_user(rxbuf, kbuf->rx.data, kbuf->rx.size)) {
-		deb_error("copy_from_user(3) failed\n");
-		goto out_cfu;
-	}	
+	hdr->err = ret;
+	hdr->ret = msg.rx.ret;
+	hdr->rx_size = msg.rx.size;
 
+	if (copy_to_user((void __user *)buffer, kbuf, len)) {
+		deb_error("copy_to_user(inline) failed\n");
+		ret = -EFAULT;
+		goto out;
+	}
 
-	usertxbuf = (void*)kbuf->tx.data; //save userspace buffers addresses
-	userrxbuf = kbuf->rx.data;
+	ret = len;
+out:
+	bpmp_host_put_buf(pfile, vm, buf);
+	return ret;
+}
 
+/*
+ * Writes to the device
+ */
 
-	kbuf->tx.data = txbuf; //reassing to kernel space buffers
-	kbuf->rx.data = rxbuf;
+static ssize_t write(struct file *filep, const char *buffer, size_t len, loff_t *offset)
+{
+	struct bpmp_host_proxy_file *pfile = filep->private_data;
+	struct bpmp_host_vm *vm = READ_ONCE(pfile->vm);
+	bool nonblock = filep->f_flags & O_NONBLOCK;
+	struct bpmp_host_xfer_buf *buf;
+	int xfer_ret = 0;
+	__u32 magic;
+	int ret;
+
+	if (len < sizeof(magic) || get_user(magic, (const __u32 __user *)buffer))
+		return -EINVAL;
+
+	if (magic == BPMP_VIRT_MSG_MAGIC)
+		return bpmp_host_proxy_write_inline(pfile, vm, buffer, len, nonblock);
+
+	if (len != sizeof(struct tegra_bpmp_message)) {
+		deb_error("message size %zu != %zu", len, sizeof(struct tegra_bpmp_message));
+		return -EINVAL;
+	}
 
-	if(!tegra_bpmp_host_device){
-		deb_error("host device not initialised, can't do transfer!");
+	buf = bpmp_host_get_buf(pfile, vm);
+	ret = bpmp_host_proxy_xfer_user(vm, (struct tegra_bpmp_message __user *)buffer,
+		buf, nonblock, &xfer_ret);
+	bpmp_host_put_buf(pfile, vm, buf);
+
+	if (ret == -EAGAIN || ret == -ERESTARTSYS)
+		return ret;
+
+	if (ret)
+		return -EINVAL;
+
+	return len;
+}
+
+/*
+ * Transfers an array of messages in a single syscall, storing the 
+ * result of each one in the results array.
+ *
+ * Returns the number of processed messages
+ */
+static long bpmp_host_proxy_xfer_batch(struct bpmp_host_proxy_file *pfile,
+	struct bpmp_host_batch __user *ubatch, bool nonblock)
+{
+	struct bpmp_host_vm *vm = READ_ONCE(pfile->vm);
+	struct bpmp_host_batch batch;
+	struct tegra_bpmp_message __user *umsgs;
+	__s32 __user *uresults;
+	struct bpmp_host_xfer_buf *buf;
+	int xfer_ret;
+	long ret;
+	int err;
+	u32 i;
+
+	if (copy_from_user(&batch, ubatch, sizeof(batch)))
 		return -EFAULT;
-	}
 
-	// Only continue if allowed or BPMP_HOST_ALLOWS_ALL
-	if(!check_if_allowed(kbuf) && !BPMP_HOST_ALLOWS_ALL){
-		goto out_cfu;
-	}
+	if (!batch.count || batch.count > BPMP_HOST_MAX_BATCH_SIZE ||
+	    batch.flags & ~BPMP_HOST_BATCH_STOP_ON_ERROR)
+		return -EINVAL;
 
-	hexDump (DEVICE_NAME ": kbuf", kbuf, len);
-	hexDump (DEVICE_NAME ": txbuf", txbuf, kbuf->tx.size);
+	umsgs = u64_to_user_ptr(batch.msgs);
+	uresults = u64_to_user_ptr(batch.results);
 
-	ret = tegra_bpmp_transfer(tegra_bpmp_host_device, (struct tegra_bpmp_message *)kbuf);
+	// The tx/rx buffers are reused by every message of the batch
+	buf = bpmp_host_get_buf(pfile, vm);
 
+	for (i = 0; i < batch.count; i++) {
+		xfer_ret = 0;
+		err = bpmp_host_proxy_xfer_user(vm, &umsgs[i], buf, nonblock, &xfer_ret);
 
+		// Not queued, the rest of the batch is left to be submitted again
+		if (err == -EAGAIN || err == -ERESTARTSYS) {
+			ret = i ? i : err;
+			goto out;
+		}
 
-	if (copy_to_user((void *)usertxbuf, kbuf->tx.data, kbuf->tx.size)) {
-		deb_error("copy_to_user(2) failed\n");
-		goto out_notok;
-	}
+		if (!err)
+			err = xfer_ret;
 
-	if (copy_to_user((void *)userrxbuf, kbuf->rx.data, kbuf->rx.size)) {
-		deb_error("copy_to_user(3) failed\n");
-		goto out_notok;
+		if (put_user(err, &uresults[i])) {
+			ret = -EFAULT;
+			goto out;
+		}
+
+		if (err && (batch.flags & BPMP_HOST_BATCH_STOP_ON_ERROR)) {
+			i++;
+			break;
+		}
 	}
+	ret = i;
 
-	kbuf->tx.data=usertxbuf;
-	kbuf->rx.data=userrxbuf;
-	
-	if (copy_to_user((void *)buffer, kbuf, len)) {
-		deb_error("copy_to_user(1) failed\n");
-		goto out_notok;
+out:
+	bpmp_host_put_buf(pfile, vm, buf);
+	return ret;
+}
+
+/*
+ * Handles the device ioctls
+ */
+static long ioctl(struct file *filep, unsigned int cmd, unsigned long arg)
+{
+	struct bpmp_host_proxy_file *pfile = filep->private_data;
+	void __user *argp = (void __user *)arg;
+
+	switch (cmd) {
+	case BPMP_HOST_IOCTL_XFER_BATCH:
+		return bpmp_host_proxy_xfer_batch(pfile, argp, filep->f_flags & O_NONBLOCK);
+	case BPMP_HOST_IOCTL_RING_SETUP:
+		return bpmp_host_ring_setup(pfile, argp);
+	case BPMP_HOST_IOCTL_RING_KICK:
+		if (!pfile->ring)
+			return -ENXIO;
+		bpmp_host_ring_kick(pfile);
+		return 0;
+	case BPMP_HOST_IOCTL_BIND_VM:
+		// The files of the /dev/bpmp-host-vmN devices stay bound to their VM
+		if (iminor(file_inode(filep)))
+			return -EPERM;
+		return bpmp_host_vm_bind(pfile, argp);
+	case BPMP_HOST_IOCTL_LOAD_POLICY:
+		return bpmp_host_vm_load_policy(argp);
+	case BPMP_HOST_IOCTL_DROP_POLICY:
+		return bpmp_host_vm_drop_policy(argp);
+	case BPMP_HOST_IOCTL_VM_STATS:
+		return bpmp_host_vm_stats(READ_ONCE(pfile->vm), argp);
+	case BPMP_HOST_IOCTL_SET_QUOTA:
+		return bpmp_host_sched_set_quota(argp);
+	case BPMP_HOST_IOCTL_CACHE_STATS:
+	case BPMP_HOST_IOCTL_CACHE_INVALIDATE:
+		return bpmp_host_cache_ioctl(cmd, argp);
+	case BPMP_HOST_IOCTL_THERMAL_SETUP:
+		return bpmp_host_thermal_setup(argp);
+	case BPMP_HOST_IOCTL_THERMAL_EVENTFD:
+		return bpmp_host_thermal_set_eventfd(READ_ONCE(pfile->vm), argp);
+	case BPMP_HOST_IOCTL_VHOST_SETUP:
+		return bpmp_host_vhost_setup(pfile, argp);
+	case BPMP_HOST_IOCTL_PROFILE:
+		return bpmp_host_profile_run(READ_ONCE(pfile->vm), argp);
+	default:
+		return -ENOTTY;
 	}
+}
 
+/*
+ * Maps the shared memory rings, the thermal sampling page or the state
+ * page of the VM
+ */
+static int mmap(struct file *filep, struct vm_area_struct *vma)
+{
+	struct bpmp_host_proxy_file *pfile = filep->private_data;
 
+	if (vma->vm_pgoff == BPMP_HOST_THERMAL_MMAP_OFFSET >> PAGE_SHIFT)
+		return bpmp_host_thermal_mmap(vma);
 
-	kfree(kbuf);
-	return len;
-out_notok:
-out_nomem:
-	deb_error("memory allocation failed");
-out_cfu:
-	kfree(kbuf);
-	kfree(txbuf);
-	kfree(rxbuf);
-    return -EINVAL;
+	if (vma->vm_pgoff == BPMP_HOST_STATE_MMAP_OFFSET >> PAGE_SHIFT)
+		return bpmp_host_state_mmap(READ_ONCE(pfile->vm), vma);
 
+	return bpmp_host_ring_mmap(pfile, vma);
+}
+
+/*
+ * Waits for ring completions
+ */
+static __poll_t poll(struct file *filep, struct poll_table_struct *wait)
+{
+	return bpmp_host_ring_poll(filep->private_data, filep, wait);
 }
 
 static const struct of_device_id bpmp_host_proxy_ids[] = {
@@ -2,6 +2,7 @@
 #define __BPMP_HOST_PROXY__H__
 
 #include <linux/types.h>
+#include <linux/ioctl.h>
 
 #define BPMP_HOST_MAX_CLOCKS_SIZE          256
 #define BPMP_HOST_MAX_RESETS_SIZE          256
@@ -17,4 +18,514 @@ struct bpmp_allowed_res {
 
 };
 
-#endif
\ No newline at end of file
+/**
+ * Inline message wire format, shared by the host and guest proxies
+ *
+ * A message is a struct bpmp_virt_msg_hdr immediately followed by tx_size
+ * bytes of tx data and by an rx buffer of rx_size bytes, all contiguous.
+ * It is copied in and out in one go, without pointers to rewrite. On
+ * completion the proxy updates rx_size with the received bytes and fills
+ * err and ret; the tx data is left untouched.
+ *
+ * The magic can not be mistaken for the mrq of a struct tegra_bpmp_message,
+ * so both formats can be written to the same device.
+ */
+#define BPMP_VIRT_MSG_MAGIC            0x504d5042  // "BPMP"
+#define BPMP_VIRT_MSG_VERSION          1
+
+#define BPMP_HOST_MAX_PAYLOAD          120  // The BPMP MSG_DATA_MIN_SZ, tegra_bpmp_transfer() limit
+
+struct bpmp_virt_msg_hdr {
+	__u32 magic;       // BPMP_VIRT_MSG_MAGIC
+	__u16 version;     // BPMP_VIRT_MSG_VERSION
+	__u16 hdr_size;    // sizeof(struct bpmp_virt_msg_hdr)
+	__u32 mrq;
+	__u32 flags;       // BPMP_VIRT_MSG_F_*
+	__u32 tx_size;
+	__u32 rx_size;     // In: rx buffer size, out: rx data size
+	__s32 err;         // Out: rejection or tegra_bpmp_transfer error
+	__s32 ret;         // Out: BPMP return code (rx.ret)
+};
+
+#define BPMP_VIRT_MSG_SIZE(tx_size, rx_size) \
+	(sizeof(struct bpmp_virt_msg_hdr) + (tx_size) + (rx_size))
+
+/**
+ * Compound messages
+ *
+ * With BPMP_VIRT_MSG_F_COMPOUND, mrq is 0 and the tx data is a sequence
+ * of steps, each one a struct bpmp_virt_step followed by its tx data
+ * padded to 8 bytes. The rx buffer holds the answers of the steps in the
+ * same order, each one a struct bpmp_virt_step, with rx_size, err and ret
+ * filled, followed by its rx buffer padded to 8 bytes.
+ *
+ * All the steps are checked before the first one is executed, a rejected
+ * step fails the whole message without executing any. The steps are then
+ * executed in order, until one fails or gets a non-zero ret, and the ones
+ * after it get -ECANCELED. The err of the message is the one of the step
+ * that failed, or -EREMOTEIO for a non-zero ret.
+ */
+#define BPMP_VIRT_MSG_F_COMPOUND       (1 << 0)
+
+#define BPMP_VIRT_COMPOUND_MAX_STEPS   16
+#define BPMP_VIRT_COMPOUND_MAX_SIZE    512  // Max tx and rx size of a compound message
+
+struct bpmp_virt_step {
+	__u32 mrq;
+	__u32 tx_size;     // Up to BPMP_HOST_MAX_PAYLOAD
+	__u32 rx_size;     // In: rx buffer size, out: rx data size
+	__s32 err;         // Out: rejection or tegra_bpmp_transfer error
+	__s32 ret;         // Out: BPMP return code (rx.ret)
+	__u32 reserved;
+};
+
+#define BPMP_VIRT_STEP_SIZE(size) \
+	(sizeof(struct bpmp_virt_step) + (((size) + 7) & ~7))
+
+/**
+ * Guest transport registers, in the "virtual-pa" window of the VMM
+ *
+ * Version 1 is the fixed layout of the first 0x600 bytes: tx data, rx
+ * data, sizes, return code and mrq, all copied in and out on each message.
+ *
+ * A VMM that supports version 2 or later answers BPMP_VIRT_REG_MAGIC with
+ * BPMP_VIRT_REG_MAGIC_VALUE, which the version 1 layout never holds, and
+ * describes its message slots in the registers below. A message is an
+ * inline message (struct bpmp_virt_msg_hdr, tx data, rx buffer) written to
+ * a slot, executed when the slot index is written to BPMP_VIRT_REG_DOORBELL.
+ * Only the header and the used tx and rx bytes are copied.
+ *
+ * The guest writes the features it uses, among the ones the VMM offers,
+ * to BPMP_VIRT_REG_DRV_FEATURES before its first message.
+ */
+#define BPMP_VIRT_REG_MAGIC            0x0580  // RO
+#define BPMP_VIRT_REG_VERSION          0x0584  // RO
+#define BPMP_VIRT_REG_FEATURES         0x0588  // RO, BPMP_VIRT_F_*
+#define BPMP_VIRT_REG_DRV_FEATURES     0x058C  // WO, BPMP_VIRT_F_*
+#define BPMP_VIRT_REG_MAX_PAYLOAD      0x0590  // RO, max tx and rx size
+#define BPMP_VIRT_REG_NUM_SLOTS        0x0594  // RO
+#define BPMP_VIRT_REG_SLOT_BASE        0x0598  // RO, offset of slot 0 in the window
+#define BPMP_VIRT_REG_SLOT_SIZE        0x059C  // RO, bytes between slots
+#define BPMP_VIRT_REG_WINDOW_SIZE      0x05A0  // RO, size of the whole window
+#define BPMP_VIRT_REG_DOORBELL         0x05A4  // WO, slot index
+
+#define BPMP_VIRT_REG_MAGIC_VALUE      0x54524956  // "VIRT"
+#define BPMP_VIRT_TRANSPORT_VERSION    2
+
+/**
+ * With BPMP_VIRT_F_SLOT_STATE, each slot starts with struct
+ * bpmp_virt_slot_hdr, followed by the inline message. The doorbell write
+ * only notifies the VMM, which can then be a KVM ioeventfd: the guest sets
+ * the state to SUBMITTED before the doorbell, the backend sets it to DONE
+ * once the header and rx data are written, and the guest sets it back to
+ * FREE after reading them.
+ */
+#define BPMP_VIRT_F_SLOT_STATE         (1 << 0)
+#define BPMP_VIRT_F_COMPOUND           (1 << 1)  // BPMP_VIRT_MSG_F_COMPOUND messages
+
+#define BPMP_VIRT_SLOT_FREE            0
+#define BPMP_VIRT_SLOT_SUBMITTED       1
+#define BPMP_VIRT_SLOT_DONE            2
+
+struct bpmp_virt_slot_hdr {
+	__u32 state;       // BPMP_VIRT_SLOT_*
+	__u32 reserved;
+};
+
+/**
+ * virtio-bpmp guest transport
+ *
+ * The device has one request virtqueue. Each message is a descriptor
+ * chain with one device-readable buffer, an inline message without the rx
+ * buffer (struct bpmp_virt_msg_hdr and the tx data), and one
+ * device-writable buffer, where the device writes the completed header
+ * followed by the rx data. The device can complete the chains in any
+ * order. Since the buffers are inline messages, a userspace backend
+ * (vhost-user) only has to append the rx buffer to the device-readable
+ * one and write() it to /dev/bpmp-host-vmN.
+ *
+ * No device id is allocated to virtio-bpmp by the virtio specification,
+ * BPMP_VIRTIO_DEVICE_ID is a private one, only valid between a VMM and
+ * guests configured for it. The guest proxy binds to the id set with
+ * CONFIG_TEGRA_BPMP_GUEST_VIRTIO_DEVICE_ID, this one by default, so it
+ * can follow the VMM if the id collides with a device it provides.
+ */
+#define BPMP_VIRTIO_DEVICE_ID          0x4250  // "BP", private
+
+struct bpmp_virtio_config {
+	__le32 max_payload;    // Max tx and rx size, 0 for BPMP_HOST_MAX_PAYLOAD
+};
+
+/**
+ * Userspace (VMM) interface of /dev/bpmp-host
+ *
+ * Besides write() of a single struct tegra_bpmp_message or of an inline
+ * message (struct bpmp_virt_msg_hdr), several messages
+ * can be submitted in one syscall with BPMP_HOST_IOCTL_XFER_BATCH, or
+ * asynchronously through the shared memory rings (BPMP_HOST_IOCTL_RING_*).
+ */
+#define BPMP_HOST_IOC_MAGIC            'B'
+
+#define BPMP_HOST_MAX_BATCH_SIZE       64
+
+// Stop processing the batch at the first message that fails
+#define BPMP_HOST_BATCH_STOP_ON_ERROR  (1 << 0)
+
+struct bpmp_host_batch {
+	__u64 msgs;     // Userspace pointer to struct tegra_bpmp_message[count]
+	__u64 results;  // Userspace pointer to __s32[count], one result per message
+	__u32 count;    // Number of messages, up to BPMP_HOST_MAX_BATCH_SIZE
+	__u32 flags;    // BPMP_HOST_BATCH_* flags
+};
+
+#define BPMP_HOST_IOCTL_XFER_BATCH     _IOW(BPMP_HOST_IOC_MAGIC, 1, struct bpmp_host_batch)
+
+/**
+ * Shared memory submission/completion rings
+ *
+ * BPMP_HOST_IOCTL_RING_SETUP allocates the rings, which are then mapped
+ * with mmap() at offset 0 with the returned size. The mapping starts with
+ * struct bpmp_host_ring_ctrl, followed by the submission queue entries
+ * (SQEs) at sq_off and the completion queue entries (CQEs) at cq_off.
+ *
+ * The VMM fills SQEs, advances sq_tail and kicks the device with
+ * BPMP_HOST_IOCTL_RING_KICK. The kernel consumes them in order, advancing
+ * sq_head, and transfers them concurrently: the CQEs, one per SQE, are
+ * posted in completion order advancing cq_tail, and are matched to their
+ * SQEs by user_data. An SQE is only consumed while the CQ has room for
+ * its CQE and the ones of the SQEs in flight. Completions are
+ * signalled through poll() (EPOLLIN while CQEs are pending) and, if one
+ * was given, the eventfd. The VMM consumes CQEs advancing cq_head.
+ *
+ * Compound SQEs (BPMP_VIRT_MSG_F_COMPOUND) are accepted, with their steps
+ * and answers within the BPMP_HOST_MAX_PAYLOAD of inline data. Their steps
+ * are transferred one after the other before the next SQE is consumed, so
+ * a compound SQE serializes the ring until it completes.
+ *
+ * Indexes are free running, the slot is index & (entries - 1).
+ */
+#define BPMP_HOST_MAX_RING_ENTRIES     256
+
+struct bpmp_host_ring_ctrl {
+	__u32 sq_head;     // Written by the kernel
+	__u32 sq_tail;     // Written by the VMM
+	__u32 cq_head;     // Written by the VMM
+	__u32 cq_tail;     // Written by the kernel
+	__u32 entries;     // Number of SQEs and of CQEs
+	__u32 reserved[3];
+};
+
+struct bpmp_host_sqe {
+	__u64 user_data;   // Copied to the CQE
+	__u32 mrq;
+	__u32 tx_size;
+	__u32 rx_size;
+	__u32 flags;       // BPMP_VIRT_MSG_F_*
+	__u8 tx[BPMP_HOST_MAX_PAYLOAD];
+};
+
+struct bpmp_host_cqe {
+	__u64 user_data;
+	__s32 err;         // Rejection or tegra_bpmp_transfer error
+	__s32 ret;         // BPMP return code (rx.ret)
+	__u32 rx_size;
+	__u32 reserved;
+	__u8 rx[BPMP_HOST_MAX_PAYLOAD];
+};
+
+struct bpmp_host_ring_setup {
+	__u32 entries;     // In: power of two, up to BPMP_HOST_MAX_RING_ENTRIES
+	__s32 eventfd;     // In: eventfd signalled on completions, or -1
+	__u32 sq_off;      // Out: offset of the SQEs in the mapping
+	__u32 cq_off;      // Out: offset of the CQEs in the mapping
+	__u32 size;        // Out: size of the mapping
+	__u32 reserved;
+};
+
+#define BPMP_HOST_IOCTL_RING_SETUP     _IOWR(BPMP_HOST_IOC_MAGIC, 2, struct bpmp_host_ring_setup)
+#define BPMP_HOST_IOCTL_RING_KICK      _IO(BPMP_HOST_IOC_MAGIC, 3)
+
+/**
+ * io_uring passthrough (IORING_OP_URING_CMD) on /dev/bpmp-host
+ *
+ * The SQE cmd_op is BPMP_HOST_URING_CMD_XFER and its cmd area holds
+ * struct bpmp_host_uring_cmd. The message pointed by msg uses the same
+ * layout as write(), its rx data and rx.ret are updated on completion.
+ * The CQE res is 0, or the rejection or tegra_bpmp_transfer error.
+ */
+#define BPMP_HOST_URING_CMD_XFER       0x01
+
+struct bpmp_host_uring_cmd {
+	__u64 msg;         // Userspace pointer to struct tegra_bpmp_message
+	__u32 flags;       // Reserved, must be 0: compound messages are not supported
+	__u32 reserved;
+};
+
+/**
+ * Per VM runtime policies
+ *
+ * Each open file transfers on behalf of a VM, VM 0 unless rebound with
+ * BPMP_HOST_IOCTL_BIND_VM. A VM uses the policy of the device tree until
+ * one is loaded with BPMP_HOST_IOCTL_LOAD_POLICY, which replaces the
+ * previous one atomically, without stopping the transfers in flight.
+ * BPMP_HOST_IOCTL_DROP_POLICY goes back to the device tree policy.
+ * The three ioctls need CAP_SYS_ADMIN.
+ *
+ * A policy also sorts the messages in two classes: latency-critical ones,
+ * always dispatched first, and bulk ones. By default, MRQ_RESET and the
+ * MRQ_CLK and MRQ_PG commands changing the state of a resource are
+ * critical. With BPMP_HOST_POLICY_CLASSES, the critical_* masks are used.
+ */
+#define BPMP_HOST_MAX_VMS              16
+
+// Use the critical_* masks of the descriptor instead of the default classes
+#define BPMP_HOST_POLICY_CLASSES       (1 << 0)
+
+struct bpmp_host_policy_desc {
+	__u32 vm_id;       // Up to BPMP_HOST_MAX_VMS - 1
+	__u32 flags;       // BPMP_HOST_POLICY_* flags
+	__u32 clocks_size; // Up to BPMP_HOST_MAX_CLOCKS_SIZE
+	__u32 resets_size; // Up to BPMP_HOST_MAX_RESETS_SIZE
+	__u32 pd_size;     // Up to BPMP_HOST_MAX_POWER_DOMAINS_SIZE
+	__u32 reserved;
+	__u64 clocks;      // Userspace pointer to the allowed clock ids, __u32[clocks_size]
+	__u64 resets;      // Userspace pointer to the allowed reset ids, __u32[resets_size]
+	__u64 pds;         // Userspace pointer to the allowed power domain ids, __u32[pd_size]
+	__u64 critical_mrqs[2];   // Critical MRQs, bit n for MRQ n, besides MRQ_CLK and MRQ_PG
+	__u32 critical_clk_cmds;  // Critical MRQ_CLK commands, bit n for CMD_CLK n
+	__u32 critical_pg_cmds;   // Critical MRQ_PG commands, bit n for CMD_PG n
+};
+
+#define BPMP_HOST_IOCTL_BIND_VM        _IOW(BPMP_HOST_IOC_MAGIC, 4, __u32)
+#define BPMP_HOST_IOCTL_LOAD_POLICY    _IOW(BPMP_HOST_IOC_MAGIC, 5, struct bpmp_host_policy_desc)
+#define BPMP_HOST_IOCTL_DROP_POLICY    _IOW(BPMP_HOST_IOC_MAGIC, 6, __u32)
+
+/**
+ * Per VM devices and counters
+ *
+ * Besides /dev/bpmp-host (VM 0), there is one /dev/bpmp-host-vmN device
+ * per VM. The files opened through them are bound to VM N for their
+ * whole life, so each VMM only needs access to the device of its VM.
+ * BPMP_HOST_IOCTL_VM_STATS returns the counters of the VM of the file.
+ */
+struct bpmp_host_vm_stats {
+	__u32 vm_id;
+	__u32 reserved;
+	__u64 xfers;       // Messages transferred to the BPMP
+	__u64 rejected;    // Messages rejected by the policy
+	__u64 errors;      // Transfers that failed
+	__u64 tx_bytes;
+	__u64 rx_bytes;
+	__u64 elided;      // Messages answered from the shadow state, without the BPMP
+	__u64 coalesced;   // CMD_CLK_SET_RATE superseded by a later one
+	__u64 niso_bw;     // kBps requested with CMD_BWMGR_INT_CALC_AND_SET, all clients
+	__u64 iso_bw;      // kBps requested with CMD_BWMGR_INT_CALC_AND_SET, all clients
+	__u64 iso_client_bw; // kBps requested with CMD_ISO_CLIENT_CALCULATE_LA, all clients
+};
+
+#define BPMP_HOST_IOCTL_VM_STATS       _IOR(BPMP_HOST_IOC_MAGIC, 7, struct bpmp_host_vm_stats)
+
+/**
+ * Per VM quotas
+ *
+ * The messages of each VM are queued and dispatched to the BPMP in round
+ * robin between the VMs. A VM with a rate can send up to burst messages
+ * at once, and then rate messages per second. Writers wait while the
+ * queue of their VM holds queue_depth messages, or get EAGAIN when the
+ * file is O_NONBLOCK. Setting a quota needs CAP_SYS_ADMIN.
+ *
+ * With BPMP_HOST_QUOTA_COALESCE_RATES, a CMD_CLK_SET_RATE queued while an
+ * earlier one of the same clock is still waiting replaces it. Only the
+ * latest rate is sent, and all the writers get its result.
+ */
+#define BPMP_HOST_MAX_QUEUE_DEPTH      256
+
+#define BPMP_HOST_QUOTA_COALESCE_RATES (1 << 0)
+
+struct bpmp_host_vm_quota {
+	__u32 vm_id;
+	__u32 rate;        // Messages per second, 0 for no limit
+	__u32 burst;       // Messages sent at once after being idle, at least 1 with a rate
+	__u32 queue_depth; // Up to BPMP_HOST_MAX_QUEUE_DEPTH, 32 by default
+	__u32 flags;       // BPMP_HOST_QUOTA_* flags
+	__u32 reserved;
+};
+
+#define BPMP_HOST_IOCTL_SET_QUOTA      _IOW(BPMP_HOST_IOC_MAGIC, 8, struct bpmp_host_vm_quota)
+
+/**
+ * Response cache
+ *
+ * The answers of the queries that never change while the host is up
+ * (MRQ_QUERY_ABI, MRQ_QUERY_FW_TAG, MRQ_STRAP, CMD_CLK_GET_MAX_CLK_ID,
+ * CMD_CLK_GET_ALL_INFO, CMD_PG_GET_NAME and CMD_PG_GET_MAX_ID) are cached
+ * and shared by all the VMs. So are the answers of CMD_CLK_ROUND_RATE,
+ * CMD_CLK_GET_PARENT and CMD_CLK_GET_FMAX_AT_VMIN, until a rate or parent
+ * change of the clock or of an ancestor goes through the proxy.
+ * BPMP_HOST_IOCTL_CACHE_INVALIDATE drops both, and needs CAP_SYS_ADMIN.
+ */
+struct bpmp_host_cache_stats {
+	__u64 hits;
+	__u64 misses;
+	__u32 entries;
+	__u32 reserved;
+	__u64 memo_hits;   // Memoized clock queries
+	__u64 memo_misses;
+};
+
+#define BPMP_HOST_IOCTL_CACHE_STATS      _IOR(BPMP_HOST_IOC_MAGIC, 9, struct bpmp_host_cache_stats)
+#define BPMP_HOST_IOCTL_CACHE_INVALIDATE _IO(BPMP_HOST_IOC_MAGIC, 10)
+
+/**
+ * Thermal sampling page
+ *
+ * BPMP_HOST_IOCTL_THERMAL_SETUP (CAP_SYS_ADMIN) makes the host sample the
+ * temperature of the BPMP thermal zones every period_ms, 0 stops it. The
+ * samples are published in a read-only page shared by all the VMs, mapped
+ * with mmap() at BPMP_HOST_THERMAL_MMAP_OFFSET, so the VMs read them
+ * without a message to the BPMP.
+ *
+ * The page is written under seq, like a seqcount: a reader retries while
+ * seq is odd or when it changed during the read.
+ *
+ * The trip points of a zone split its temperatures into ranges. When the
+ * temperature of a zone enters another range, trip_seq is incremented and
+ * the eventfd that each VM set with BPMP_HOST_IOCTL_THERMAL_EVENTFD is
+ * signalled.
+ */
+#define BPMP_HOST_THERMAL_MAX_ZONES    16
+#define BPMP_HOST_THERMAL_MAX_TRIPS    4
+#define BPMP_HOST_THERMAL_MIN_PERIOD   10      // ms
+#define BPMP_HOST_THERMAL_MMAP_OFFSET  0x10000000
+
+struct bpmp_host_thermal_zone {
+	__s32 temp;        // millicelsius
+	__s32 err;         // Of the last sample, temp is the last good one
+	__u32 trip;        // Number of trip points at or below temp
+	__u32 reserved;
+	__u64 timestamp_ns; // CLOCK_MONOTONIC of the last good sample
+};
+
+struct bpmp_host_thermal_page {
+	__u32 seq;
+	__u32 num_zones;
+	__u32 period_ms;
+	__u32 trip_seq;    // Trip crossings of all the zones
+	__u64 timestamp_ns; // CLOCK_MONOTONIC of the last sampling
+	struct bpmp_host_thermal_zone zones[BPMP_HOST_THERMAL_MAX_ZONES];
+};
+
+struct bpmp_host_thermal_setup {
+	__u32 period_ms;   // 0, or at least BPMP_HOST_THERMAL_MIN_PERIOD
+	__u32 num_trips;   // Per zone, up to BPMP_HOST_THERMAL_MAX_TRIPS
+	__s32 trips[BPMP_HOST_THERMAL_MAX_ZONES][BPMP_HOST_THERMAL_MAX_TRIPS]; // millicelsius, ascending
+};
+
+#define BPMP_HOST_IOCTL_THERMAL_SETUP    _IOW(BPMP_HOST_IOC_MAGIC, 11, struct bpmp_host_thermal_setup)
+#define BPMP_HOST_IOCTL_THERMAL_EVENTFD  _IOW(BPMP_HOST_IOC_MAGIC, 12, __s32)
+
+/**
+ * Per VM state page
+ *
+ * The host mirrors the rate, parent and enable state of the clocks, and
+ * the state of the power domains, that a VM is allowed to use in a
+ * read-only page of that VM, mapped with mmap() at
+ * BPMP_HOST_STATE_MMAP_OFFSET of its /dev/bpmp-host-vmN device, with the
+ * size of struct bpmp_host_state_page rounded up to pages. The VMM maps it in the guest memory, and the
+ * guest proxy finds it at the "virtual-state-pa" property of the bpmp
+ * device tree node, so it answers CMD_CLK_GET_RATE, CMD_CLK_GET_PARENT,
+ * CMD_CLK_IS_ENABLED and CMD_PG_GET_STATE without a message to the host.
+ *
+ * The values are learnt from the messages that go through the proxy, so
+ * each one has its own valid flag. The values of the resources the host
+ * drivers also change, and the rates of the clocks below a clock whose
+ * rate the host changes, are never valid. A reader retries while seq is odd or
+ * when it changed during the read, like with a seqcount.
+ */
+#define BPMP_HOST_STATE_MAGIC          0x53504D42	// "BMPS"
+#define BPMP_HOST_STATE_MAX_ID         1024
+#define BPMP_HOST_STATE_MMAP_OFFSET    0x20000000
+
+#define BPMP_HOST_STATE_RATE_VALID     (1 << 0)
+#define BPMP_HOST_STATE_PARENT_VALID   (1 << 1)
+#define BPMP_HOST_STATE_ENABLED_VALID  (1 << 2)
+#define BPMP_HOST_STATE_ENABLED        (1 << 3)
+#define BPMP_HOST_STATE_PD_VALID       (1 << 0)
+
+struct bpmp_host_state_clk {
+	__s64 rate;
+	__u32 parent;
+	__u32 flags;       // BPMP_HOST_STATE_*
+};
+
+struct bpmp_host_state_pd {
+	__u32 state;       // PG_STATE_*
+	__u32 flags;       // BPMP_HOST_STATE_PD_VALID
+};
+
+struct bpmp_host_state_page {
+	__u32 magic;
+	__u32 seq;
+	__u32 max_id;      // BPMP_HOST_STATE_MAX_ID
+	__u32 reserved[13];
+	struct bpmp_host_state_clk clks[BPMP_HOST_STATE_MAX_ID];
+	struct bpmp_host_state_pd pds[BPMP_HOST_STATE_MAX_ID];
+};
+
+/**
+ * In-kernel slot backend
+ *
+ * BPMP_HOST_IOCTL_VHOST_SETUP on /dev/bpmp-host-vmN hands the slots of
+ * the BPMP_VIRT_F_SLOT_STATE transport of that VM to the host proxy. uaddr
+ * is the VMM address of slot 0 in the guest memory, kick_fd the eventfd
+ * bound to BPMP_VIRT_REG_DOORBELL (KVM_IOEVENTFD) and call_fd, if not -1,
+ * an eventfd signalled when slots are DONE (KVM_IRQFD). The messages of
+ * the guest are then checked and executed without going through the VMM.
+ * The backend stops when the file is closed. Setting it up needs
+ * CAP_SYS_ADMIN.
+ */
+#define BPMP_HOST_VHOST_MAX_SLOTS      64
+
+struct bpmp_host_vhost_setup {
+	__u64 uaddr;
+	__u32 num_slots;   // Up to BPMP_HOST_VHOST_MAX_SLOTS
+	__u32 slot_size;   // Bytes between slots, multiple of 8
+	__s32 kick_fd;
+	__s32 call_fd;
+};
+
+#define BPMP_HOST_IOCTL_VHOST_SETUP    _IOW(BPMP_HOST_IOC_MAGIC, 13, struct bpmp_host_vhost_setup)
+
+
+/**
+ * Bring-up profiles
+ *
+ * Each child node of the "profiles" node of the host proxy is a profile
+ * that brings a passthrough device up: it turns its power domains on,
+ * sets its clock parents and rates, enables its clocks and deasserts its
+ * resets. BPMP_HOST_IOCTL_PROFILE on /dev/bpmp-host-vmN runs the profile
+ * named after the node, or its teardown, which asserts the resets,
+ * disables the clocks and turns the power domains off in the reverse
+ * order, as messages of that VM. Nothing is executed if a step is not
+ * allowed for the VM. Running a profile needs CAP_SYS_ADMIN.
+ *
+ * A bring-up stops at the first step that fails, a teardown runs all of
+ * its steps. done is the number of steps that succeeded and err the
+ * error of the first one that failed, -EREMOTEIO if the BPMP refused it.
+ */
+#define BPMP_HOST_PROFILE_NAME_SIZE    32
+
+#define BPMP_HOST_PROFILE_BRINGUP      0
+#define BPMP_HOST_PROFILE_TEARDOWN     1
+
+struct bpmp_host_profile_run {
+	char name[BPMP_HOST_PROFILE_NAME_SIZE];  // In: node name of the profile
+	__u32 op;          // In: BPMP_HOST_PROFILE_*
+	__u32 done;        // Out: steps that succeeded
+	__s32 err;         // Out: error of the first step that failed
+	__u32 reserved;
+};
+
+#define BPMP_HOST_IOCTL_PROFILE        _IOWR(BPMP_HOST_IOC_MAGIC, 14, struct bpmp_host_profile_run)
+
+#endif
@@ -0,0 +1,424 @@
+/**
+ *
+ * NVIDIA BPMP Host Proxy Kernel Module
+ * Shared memory submission/completion rings
+ *
+ * The VMM queues requests with inline tx data in the submission ring
+ * and gets the rx data and return codes back in the completion ring,
+ * without a syscall or a user copy per message.
+ *
+ * The submission entries are all queued to the scheduler without waiting
+ * for the previous answers, each one with a completion entry reserved,
+ * and the completion entries are posted as the answers come back. The
+ * compound entries are the exception: their steps are transferred from
+ * the ring work, which only takes the next entry once they are done.
+ *
+*/
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/uaccess.h>
+#include <linux/eventfd.h>
+#include <linux/wait.h>
+#include <linux/mutex.h>
+#include <linux/log2.h>
+#include <linux/bitmap.h>
+#include <linux/spinlock.h>
+#include <linux/rcupdate.h>
+#include "bpmp-host-internal.h"
+
+
+/**
+ * A submission entry in flight, with private copies of its data since the
+ * VMM can change the shared entries at any time
+ */
+struct bpmp_host_ring_req {
+	struct bpmp_host_ring *ring;
+	struct bpmp_host_req req;           ///< Scheduler request
+	struct tegra_bpmp_message msg;
+	u64 user_data;
+	u8 tx[BPMP_HOST_MAX_PAYLOAD];
+	u8 rx[BPMP_HOST_MAX_PAYLOAD];
+};
+
+struct bpmp_host_ring {
+	struct bpmp_host_proxy_file *pfile;
+	void *mem;                          ///< vmalloc_user() area mapped by the VMM
+	size_t size;
+	u32 entries;
+	struct bpmp_host_ring_ctrl *ctrl;
+	struct bpmp_host_sqe *sqes;
+	struct bpmp_host_cqe *cqes;
+	u32 sq_head;                        ///< Kernel copies of the indexes the kernel owns,
+	u32 cq_tail;                        ///< the shared ones can be overwritten by the VMM
+	struct bpmp_host_ring_req *reqs;    ///< One per entry, as many as can be in flight
+	unsigned long *reqs_busy;
+	u32 inflight;                       ///< Each one has a CQE reserved
+	spinlock_t cq_lock;                 ///< Protects cq_tail, reqs_busy and inflight
+	struct eventfd_ctx *eventfd;
+	wait_queue_head_t wait;
+	wait_queue_head_t idle;             ///< Woken up when inflight drops to 0
+	struct work_struct work;
+	struct mutex lock;                  ///< Serializes the ring consumers
+	bool stopped;
+};
+
+/*
+ * Posts the completion entry of a request, whose room was reserved when
+ * its submission entry was taken. Called with cq_lock held.
+ */
+static void bpmp_host_ring_post(struct bpmp_host_ring *ring, u64 user_data,
+	int err, const struct tegra_bpmp_message *msg)
+{
+	struct bpmp_host_cqe *cqe = &ring->cqes[ring->cq_tail & (ring->entries - 1)];
+
+	memset(cqe, 0, offsetof(struct bpmp_host_cqe, rx));
+	cqe->user_data = user_data;
+	cqe->err = err;
+	if (msg && !err) {
+		cqe->ret = msg->rx.ret;
+		cqe->rx_size = msg->rx.size;
+		memcpy(cqe->rx, msg->rx.data, msg->rx.size);
+	}
+
+	ring->cq_tail++;
+	smp_store_release(&ring->ctrl->cq_tail, ring->cq_tail);
+}
+
+static void bpmp_host_ring_signal(struct bpmp_host_ring *ring)
+{
+	wake_up_interruptible(&ring->wait);
+	if (ring->eventfd)
+		eventfd_signal(ring->eventfd);
+}
+
+/*
+ * Posts the answer of a request. Called by the scheduler once transferred,
+ * possibly before bpmp_host_sched_submit() returns.
+ */
+static void bpmp_host_ring_done(struct bpmp_host_req *req)
+{
+	struct bpmp_host_ring_req *rreq = container_of(req, struct bpmp_host_ring_req, req);
+	struct bpmp_host_ring *ring = rreq->ring;
+	bool idle;
+
+	// The ring is freed once inflight drops to 0 and an RCU grace period passed
+	rcu_read_lock();
+
+	spin_lock(&ring->cq_lock);
+	bpmp_host_ring_post(ring, rreq->user_data, req->ret, &rreq->msg);
+	__clear_bit(rreq - ring->reqs, ring->reqs_busy);
+	idle = !--ring->inflight;
+	spin_unlock(&ring->cq_lock);
+
+	bpmp_host_ring_signal(ring);
+
+	// Submission entries can be waiting for the CQE or the queue slot just freed
+	if (!READ_ONCE(ring->stopped) &&
+	    READ_ONCE(ring->ctrl->sq_tail) != READ_ONCE(ring->sq_head))
+		queue_work(bpmp_host_proxy_wq, &ring->work);
+
+	if (idle)
+		wake_up(&ring->idle);
+
+	rcu_read_unlock();
+}
+
+/*
+ * Takes a submission entry: an invalid or rejected one is completed at
+ * once, a compound one is transferred step by step, any other one is
+ * queued to the scheduler and completed by bpmp_host_ring_done().
+ *
+ * Returns -EAGAIN, with the entry left in the ring, if the queue of the VM
+ * is full while requests of the ring are in flight, whose completions kick
+ * the ring again.
+ */
+static int bpmp_host_ring_submit(struct bpmp_host_ring *ring,
+	struct bpmp_host_vm *vm, const struct bpmp_host_sqe *sqe)
+{
+	struct bpmp_host_ring_req *rreq;
+	int xfer_ret = 0;
+	bool busy;
+	u32 index;
+	int ret;
+
+	if ((sqe->flags & ~BPMP_VIRT_MSG_F_COMPOUND) ||
+	    sqe->tx_size > BPMP_HOST_MAX_PAYLOAD ||
+	    sqe->rx_size > BPMP_HOST_MAX_PAYLOAD) {
+		ret = -EINVAL;
+		goto err_post;
+	}
+
+	// There is always a free one, inflight is below the number of CQEs
+	spin_lock(&ring->cq_lock);
+	index = find_first_zero_bit(ring->reqs_busy, ring->entries);
+	__set_bit(index, ring->reqs_busy);
+	busy = ring->inflight++;
+	spin_unlock(&ring->cq_lock);
+
+	rreq = &ring->reqs[index];
+	rreq->user_data = sqe->user_data;
+	memcpy(rreq->tx, sqe->tx, sqe->tx_size);
+	rreq->msg = (struct tegra_bpmp_message) {
+		.mrq = sqe->mrq,
+		.tx = { .data = rreq->tx, .size = sqe->tx_size },
+		.rx = { .data = rreq->rx, .size = sqe->rx_size },
+	};
+	rreq->req.vm = vm;
+	rreq->req.msg = &rreq->msg;
+	rreq->req.done = bpmp_host_ring_done;
+
+	// The steps are transferred one after the other, the ring waits for them,
+	// so a compound SQE serializes the ring
+	if (sqe->flags & BPMP_VIRT_MSG_F_COMPOUND) {
+		ret = bpmp_host_compound_xfer(vm, &rreq->msg, false, &xfer_ret);
+		rreq->req.ret = ret ? ret : xfer_ret;
+		bpmp_host_ring_done(&rreq->req);
+		return 0;
+	}
+
+	ret = bpmp_host_proxy_validate(vm, &rreq->msg);
+	if (ret)
+		goto err_put;
+
+	// Only waits for room in the queue when no completion would kick the ring
+	ret = bpmp_host_sched_submit(&rreq->req, busy);
+	if (ret)
+		goto err_put;
+
+	return 0;
+
+err_put:
+	spin_lock(&ring->cq_lock);
+	__clear_bit(index, ring->reqs_busy);
+	ring->inflight--;
+	if (ret != -EAGAIN)
+		bpmp_host_ring_post(ring, sqe->user_data, ret, NULL);
+	spin_unlock(&ring->cq_lock);
+	return ret == -EAGAIN ? ret : 0;
+
+err_post:
+	spin_lock(&ring->cq_lock);
+	bpmp_host_ring_post(ring, sqe->user_data, ret, NULL);
+	spin_unlock(&ring->cq_lock);
+	return 0;
+}
+
+/*
+ * Submits the submission entries until the ring is empty, or there is no
+ * room left for their completions or in the queue of the VM
+ */
+static void bpmp_host_ring_work(struct work_struct *work)
+{
+	struct bpmp_host_ring *ring = container_of(work, struct bpmp_host_ring, work);
+	struct bpmp_host_ring_ctrl *ctrl = ring->ctrl;
+	struct bpmp_host_sqe sqe;
+	u32 mask = ring->entries - 1;
+	u32 taken = 0;
+	u32 sq_tail, cq_head, used;
+
+	mutex_lock(&ring->lock);
+
+	while (!READ_ONCE(ring->stopped)) {
+		sq_tail = smp_load_acquire(&ctrl->sq_tail);
+		cq_head = smp_load_acquire(&ctrl->cq_head);
+
+		if (sq_tail == ring->sq_head)
+			break;
+
+		spin_lock(&ring->cq_lock);
+		used = ring->cq_tail - cq_head + ring->inflight;
+		spin_unlock(&ring->cq_lock);
+
+		// Stop if the VMM corrupted the indexes or there is no room for the completion
+		if (sq_tail - ring->sq_head > ring->entries || used >= ring->entries)
+			break;
+
+		// Take a private copy, the VMM can change the shared entry at any time
+		memcpy(&sqe, &ring->sqes[ring->sq_head & mask], sizeof(sqe));
+
+		if (bpmp_host_ring_submit(ring, READ_ONCE(ring->pfile->vm), &sqe))
+			break;
+
+		WRITE_ONCE(ring->sq_head, ring->sq_head + 1);
+		WRITE_ONCE(ctrl->sq_head, ring->sq_head);
+
+		if (!(++taken % 16))
+			cond_resched();
+	}
+
+	mutex_unlock(&ring->lock);
+
+	// Rejected entries were completed without going through the scheduler
+	if (taken)
+		bpmp_host_ring_signal(ring);
+}
+
+/*
+ * Allocates the rings of an open file
+ */
+long bpmp_host_ring_setup(struct bpmp_host_proxy_file *pfile,
+	struct bpmp_host_ring_setup __user *usetup)
+{
+	struct bpmp_host_ring_setup setup;
+	struct bpmp_host_ring *ring;
+	size_t sq_off, cq_off, size;
+	long ret;
+	u32 i;
+
+	if (copy_from_user(&setup, usetup, sizeof(setup)))
+		return -EFAULT;
+
+	if (!setup.entries || setup.entries > BPMP_HOST_MAX_RING_ENTRIES ||
+	    !is_power_of_2(setup.entries))
+		return -EINVAL;
+
+	sq_off = ALIGN(sizeof(struct bpmp_host_ring_ctrl), 64);
+	cq_off = ALIGN(sq_off + setup.entries * sizeof(struct bpmp_host_sqe), 64);
+	size = PAGE_ALIGN(cq_off + setup.entries * sizeof(struct bpmp_host_cqe));
+
+	ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+	if (!ring)
+		return -ENOMEM;
+
+	ring->reqs = kcalloc(setup.entries, sizeof(*ring->reqs), GFP_KERNEL);
+	ring->reqs_busy = bitmap_zalloc(setup.entries, GFP_KERNEL);
+	if (!ring->reqs || !ring->reqs_busy) {
+		ret = -ENOMEM;
+		goto err_free;
+	}
+
+	ring->mem = vmalloc_user(size);
+	if (!ring->mem) {
+		ret = -ENOMEM;
+		goto err_free;
+	}
+
+	if (setup.eventfd >= 0) {
+		ring->eventfd = eventfd_ctx_fdget(setup.eventfd);
+		if (IS_ERR(ring->eventfd)) {
+			ret = PTR_ERR(ring->eventfd);
+			goto err_vfree;
+		}
+	}
+
+	ring->pfile = pfile;
+	ring->size = size;
+	ring->entries = setup.entries;
+	ring->ctrl = ring->mem;
+	ring->sqes = ring->mem + sq_off;
+	ring->cqes = ring->mem + cq_off;
+	ring->ctrl->entries = setup.entries;
+	for (i = 0; i < setup.entries; i++)
+		ring->reqs[i].ring = ring;
+	spin_lock_init(&ring->cq_lock);
+	init_waitqueue_head(&ring->wait);
+	init_waitqueue_head(&ring->idle);
+	INIT_WORK(&ring->work, bpmp_host_ring_work);
+	mutex_init(&ring->lock);
+
+	setup.sq_off = sq_off;
+	setup.cq_off = cq_off;
+	setup.size = size;
+	if (copy_to_user(usetup, &setup, sizeof(setup))) {
+		ret = -EFAULT;
+		goto err_eventfd;
+	}
+
+	// Only one set of rings per open file
+	if (cmpxchg(&pfile->ring, NULL, ring)) {
+		ret = -EBUSY;
+		goto err_eventfd;
+	}
+
+	deb_info("ring set up with %u entries, %zu bytes\n", ring->entries, size);
+
+	return 0;
+
+err_eventfd:
+	if (ring->eventfd)
+		eventfd_ctx_put(ring->eventfd);
+err_vfree:
+	vfree(ring->mem);
+err_free:
+	bitmap_free(ring->reqs_busy);
+	kfree(ring->reqs);
+	kfree(ring);
+	return ret;
+}
+
+/*
+ * Schedules the processing of the new submission entries
+ */
+void bpmp_host_ring_kick(struct bpmp_host_proxy_file *pfile)
+{
+	queue_work(bpmp_host_proxy_wq, &pfile->ring->work);
+}
+
+/*
+ * Maps the rings to the VMM
+ */
+int bpmp_host_ring_mmap(struct bpmp_host_proxy_file *pfile,
+	struct vm_area_struct *vma)
+{
+	struct bpmp_host_ring *ring = pfile->ring;
+
+	if (!ring)
+		return -ENXIO;
+
+	if (vma->vm_pgoff || vma->vm_end - vma->vm_start != ring->size)
+		return -EINVAL;
+
+	return remap_vmalloc_range(vma, ring->mem, 0);
+}
+
+/*
+ * Reports pending completions
+ */
+__poll_t bpmp_host_ring_poll(struct bpmp_host_proxy_file *pfile,
+	struct file *filep, poll_table *wait)
+{
+	struct bpmp_host_ring *ring = pfile->ring;
+
+	if (!ring)
+		return EPOLLERR;
+
+	poll_wait(filep, &ring->wait, wait);
+
+	if (smp_load_acquire(&ring->ctrl->cq_head) != READ_ONCE(ring->cq_tail))
+		return EPOLLIN | EPOLLRDNORM;
+
+	return 0;
+}
+
+/*
+ * Frees the rings when the file is closed, once the requests in flight
+ * are answered. The VMM mapping holds a file reference, so the rings are
+ * not mapped anymore at this point.
+ */
+void bpmp_host_ring_release(struct bpmp_host_proxy_file *pfile)
+{
+	struct bpmp_host_ring *ring = pfile->ring;
+
+	if (!ring)
+		return;
+
+	WRITE_ONCE(ring->stopped, true);
+	cancel_work_sync(&ring->work);
+	wait_event(ring->idle, !READ_ONCE(ring->inflight));
+
+	// A completion can have queued the work, or be waking up idle
+	cancel_work_sync(&ring->work);
+	synchronize_rcu();
+
+	if (ring->eventfd)
+		eventfd_ctx_put(ring->eventfd);
+	vfree(ring->mem);
+	bitmap_free(ring->reqs_busy);
+	kfree(ring->reqs);
+	kfree(ring);
+	pfile->ring = NULL;
+}
@@ -0,0 +1,651 @@
+/**
+ *
+ * NVIDIA BPMP Host Proxy Kernel Module
+ * Fair scheduling of the VM transfers
+ *
+ * The transfers of all the VMs are queued per VM and taken, visiting the
+ * VMs in round robin, by a pool of workers, one per BPMP threaded channel,
+ * so that a slow transfer only holds its own channel. Each VM has a queue
+ * per class, and the latency-critical requests of all the VMs are taken
+ * before the bulk ones, so that the debug and information queries of a VM
+ * never delay the device bring-up of another. Each VM can have a token
+ * bucket quota, a VM out of tokens is skipped until it gets new ones. When the queue of a VM is full the submitters wait for room,
+ * or get -EAGAIN if they do not want to block, so a noisy VM slows down
+ * itself rather than the other VMs or the host drivers, which keep the
+ * rest of the BPMP channels.
+ *
+ * For the VMs with BPMP_HOST_QUOTA_COALESCE_RATES, a CMD_CLK_SET_RATE
+ * takes the place of the last one queued for the same clock, if no other
+ * command of the clock was queued after it. Only the latest rate is sent
+ * to the BPMP, and the superseded requests complete with its result.
+ *
+ * The messages that change the state followed by the proxy (clock enables,
+ * rates and parents, power domain states, resets and bandwidth requests)
+ * are transferred one at a time, so the shadow decisions are serialized
+ * with their transfers. The queries run in parallel with them, and their
+ * answers are only learnt by the cache and the state pages if no state
+ * change was transferred meanwhile.
+ *
+*/
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/completion.h>
+#include <linux/kthread.h>
+#include <linux/mutex.h>
+#include <linux/ktime.h>
+#include <linux/jiffies.h>
+#include <linux/uaccess.h>
+#include <linux/capability.h>
+#include "bpmp-host-internal.h"
+
+
+// Default queue depth of a VM
+#define BPMP_HOST_SCHED_DEPTH   32
+
+// Token bucket credit of one message, credits are refilled per nanosecond
+#define BPMP_HOST_SCHED_COST    NSEC_PER_SEC
+
+// Workers when the BPMP is not probed yet, its threaded channels on Tegra186 and later
+#define BPMP_HOST_SCHED_WORKERS       3
+#define BPMP_HOST_SCHED_MAX_WORKERS   8
+
+// Protects the queues and the token buckets of all the VMs
+static DEFINE_SPINLOCK(bpmp_host_sched_lock);
+
+static DECLARE_WAIT_QUEUE_HEAD(bpmp_host_sched_wait);
+static unsigned long bpmp_host_sched_kicks;	///< Bumped on each change of the queues
+static bool bpmp_host_sched_stopped;
+
+static struct task_struct *bpmp_host_sched_tasks[BPMP_HOST_SCHED_MAX_WORKERS];
+static unsigned int bpmp_host_sched_nr_workers;
+
+// Serializes the transfers of the state changes
+static DEFINE_MUTEX(bpmp_host_sched_serial_lock);
+static struct task_struct *bpmp_host_sched_serial_owner;
+
+// Protects bpmp_host_sched_gen, odd while a state change is transferred
+static DEFINE_MUTEX(bpmp_host_sched_gen_lock);
+static u32 bpmp_host_sched_gen;
+
+// Last VM served, per class
+static u32 bpmp_host_sched_cursor[BPMP_HOST_NR_CLASSES];
+
+/*
+ * Adds the credits earned since the last refill, up to the burst
+ */
+static void bpmp_host_sched_refill(struct bpmp_host_vm_sched *sched, ktime_t now)
+{
+	u64 max = (u64)sched->burst * BPMP_HOST_SCHED_COST;
+	u64 elapsed = ktime_to_ns(ktime_sub(now, sched->last));
+
+	sched->last = now;
+
+	// Bound the elapsed time to a full bucket, so that the product can not overflow
+	elapsed = min_t(u64, elapsed, div_u64(max, sched->rate) + 1);
+	sched->credit = min(sched->credit + elapsed * sched->rate, max);
+}
+
+/*
+ * Takes the next request of a class, in round robin from the VM after the
+ * last one served. Updates wait_ns with the time until a VM out of tokens
+ * gets its next one.
+ */
+static struct bpmp_host_req *bpmp_host_sched_next_class(int class, ktime_t now,
+	u64 *wait_ns)
+{
+	struct bpmp_host_vm_sched *sched;
+	struct bpmp_host_req *req;
+	u32 i, vm_id;
+
+	for (i = 1; i <= BPMP_HOST_MAX_VMS; i++) {
+		vm_id = (bpmp_host_sched_cursor[class] + i) % BPMP_HOST_MAX_VMS;
+		sched = &bpmp_host_vms[vm_id].sched;
+
+		if (list_empty(&sched->queue[class]))
+			continue;
+
+		if (sched->rate) {
+			bpmp_host_sched_refill(sched, now);
+			if (sched->credit < BPMP_HOST_SCHED_COST) {
+				*wait_ns = min(*wait_ns, div_u64(BPMP_HOST_SCHED_COST - sched->credit,
+					sched->rate) + 1);
+				continue;
+			}
+			sched->credit -= BPMP_HOST_SCHED_COST;
+		}
+
+		req = list_first_entry(&sched->queue[class], struct bpmp_host_req, node);
+		list_del(&req->node);
+		sched->queued--;
+		bpmp_host_sched_cursor[class] = vm_id;
+		return req;
+	}
+
+	return NULL;
+}
+
+/*
+ * Takes the next request to dispatch, latency-critical ones first. If the
+ * pending requests are all out of tokens, sets timeout to the time until
+ * the first one gets its token.
+ */
+static struct bpmp_host_req *bpmp_host_sched_next(long *timeout)
+{
+	struct bpmp_host_req *req = NULL;
+	u64 wait_ns = U64_MAX;
+	ktime_t now = ktime_get();
+	int class;
+
+	*timeout = MAX_SCHEDULE_TIMEOUT;
+
+	spin_lock(&bpmp_host_sched_lock);
+
+	for (class = 0; class < BPMP_HOST_NR_CLASSES && !req; class++)
+		req = bpmp_host_sched_next_class(class, now, &wait_ns);
+
+	spin_unlock(&bpmp_host_sched_lock);
+
+	if (req)
+		wake_up(&req->vm->sched.space);
+	else if (wait_ns != U64_MAX)
+		*timeout = max_t(long, nsecs_to_jiffies(wait_ns), 1);
+
+	return req;
+}
+
+static void bpmp_host_sched_done(struct bpmp_host_req *req)
+{
+	if (req->clk_change)
+		atomic_dec(&req->vm->sched.clk_changes);
+
+	req->done(req);
+}
+
+/*
+ * Completes a request and the ones it superseded, with its result
+ */
+static void bpmp_host_sched_complete(struct bpmp_host_req *req)
+{
+	struct bpmp_host_req *old, *tmp;
+
+	list_for_each_entry_safe(old, tmp, &req->coalesced, node) {
+		list_del(&old->node);
+		old->ret = req->ret;
+		if (!req->ret) {
+			memcpy(old->msg->rx.data, req->msg->rx.data,
+				min(old->msg->rx.size, req->msg->rx.size));
+			old->msg->rx.ret = req->msg->rx.ret;
+		}
+		bpmp_host_sched_done(old);
+	}
+
+	bpmp_host_sched_done(req);
+}
+
+/*
+ * Checks if a message changes the state followed by the shadow, the
+ * memoized clock answers, the state pages or the bandwidth aggregation
+ */
+static bool bpmp_host_sched_serialized(const struct tegra_bpmp_message *msg)
+{
+	const struct mrq_clk_request *clock_req = msg->tx.data;
+	const struct mrq_pg_request *pg_req = msg->tx.data;
+
+	switch (msg->mrq) {
+	case MRQ_CLK:
+		if (msg->tx.size < sizeof(u32))
+			return false;
+		switch (clock_req->cmd_and_id >> 24) {
+		case CMD_CLK_SET_RATE:
+		case CMD_CLK_SET_PARENT:
+		case CMD_CLK_ENABLE:
+		case CMD_CLK_DISABLE:
+			return true;
+		}
+		return false;
+	case MRQ_PG:
+		return msg->tx.size >= offsetofend(struct mrq_pg_request, id) &&
+			pg_req->cmd == CMD_PG_SET_STATE;
+	case MRQ_RESET:
+	case MRQ_BWMGR:
+	case MRQ_BWMGR_INT:
+	case MRQ_ISO_CLIENT:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static void bpmp_host_sched_gen_bump(void)
+{
+	mutex_lock(&bpmp_host_sched_gen_lock);
+	WRITE_ONCE(bpmp_host_sched_gen, bpmp_host_sched_gen + 1);
+	mutex_unlock(&bpmp_host_sched_gen_lock);
+}
+
+/*
+ * Transfers a state change, unless it does not change the shadow state
+ */
+static void bpmp_host_sched_run_serial(struct bpmp_host_req *req)
+{
+	mutex_lock(&bpmp_host_sched_serial_lock);
+	WRITE_ONCE(bpmp_host_sched_serial_owner, current);
+	bpmp_host_sched_gen_bump();
+
+	if (bpmp_host_shadow_filter(req->vm, req->msg)) {
+		req->ret = 0;
+		atomic64_inc(&req->vm->elided);
+		bpmp_host_vm_account(req->vm, req->msg, 0);
+		bpmp_host_state_update(req->msg, 0);
+		goto out;
+	}
+
+	req->ret = bpmp_host_bwmgr_transfer(req->vm, req->msg);
+	bpmp_host_vm_account(req->vm, req->msg, req->ret);
+	bpmp_host_shadow_update(req->vm, req->msg, req->ret);
+	bpmp_host_cache_insert(req->msg, req->ret);
+	bpmp_host_state_update(req->msg, req->ret);
+
+out:
+	bpmp_host_sched_gen_bump();
+	WRITE_ONCE(bpmp_host_sched_serial_owner, NULL);
+	mutex_unlock(&bpmp_host_sched_serial_lock);
+}
+
+/*
+ * Releases the shadow references of a VM, and with keep NULL its bandwidth
+ * requests, serialized with the state changes transferred by the workers
+ */
+void bpmp_host_sched_release(struct bpmp_host_vm *vm,
+	const struct bpmp_host_policy *keep)
+{
+	mutex_lock(&bpmp_host_sched_serial_lock);
+	WRITE_ONCE(bpmp_host_sched_serial_owner, current);
+	bpmp_host_sched_gen_bump();
+	bpmp_host_shadow_release(vm, keep);
+	if (!keep)
+		bpmp_host_bwmgr_release(vm);
+	bpmp_host_sched_gen_bump();
+	WRITE_ONCE(bpmp_host_sched_serial_owner, NULL);
+	mutex_unlock(&bpmp_host_sched_serial_lock);
+}
+
+/*
+ * Checks if the current task transfers the state changes of the VMs, to
+ * tell them from the ones of the host drivers
+ */
+bool bpmp_host_sched_serializing(void)
+{
+	return READ_ONCE(bpmp_host_sched_serial_owner) == current;
+}
+
+/*
+ * Transfers a query, in parallel with the other workers
+ */
+static void bpmp_host_sched_run_query(struct bpmp_host_req *req)
+{
+	u32 gen = READ_ONCE(bpmp_host_sched_gen);
+
+	req->ret = tegra_bpmp_transfer(tegra_bpmp_host_device, req->msg);
+	bpmp_host_vm_account(req->vm, req->msg, req->ret);
+
+	// The answer can predate a state change transferred meanwhile
+	mutex_lock(&bpmp_host_sched_gen_lock);
+	if (!(gen & 1) && gen == bpmp_host_sched_gen) {
+		bpmp_host_cache_insert(req->msg, req->ret);
+		bpmp_host_state_update(req->msg, req->ret);
+	}
+	mutex_unlock(&bpmp_host_sched_gen_lock);
+}
+
+static void bpmp_host_sched_run(struct bpmp_host_req *req)
+{
+	if (bpmp_host_sched_serialized(req->msg))
+		bpmp_host_sched_run_serial(req);
+	else
+		bpmp_host_sched_run_query(req);
+
+	bpmp_host_sched_complete(req);
+}
+
+static int bpmp_host_sched_thread(void *data)
+{
+	struct bpmp_host_req *req;
+	unsigned long kicks;
+	long timeout;
+
+	while (!kthread_should_stop()) {
+		kicks = READ_ONCE(bpmp_host_sched_kicks);
+
+		req = bpmp_host_sched_next(&timeout);
+		if (req) {
+			bpmp_host_sched_run(req);
+			cond_resched();
+			continue;
+		}
+
+		wait_event_interruptible_timeout(bpmp_host_sched_wait,
+			READ_ONCE(bpmp_host_sched_kicks) != kicks || kthread_should_stop(),
+			timeout);
+	}
+
+	return 0;
+}
+
+/*
+ * Checks if a message is a CMD_CLK_SET_RATE or CMD_CLK_SET_PARENT, that
+ * can change the memoized clock answers
+ */
+static bool bpmp_host_sched_clk_change(const struct tegra_bpmp_message *msg)
+{
+	const struct mrq_clk_request *clock_req = msg->tx.data;
+
+	if (msg->mrq != MRQ_CLK || msg->tx.size < sizeof(u32))
+		return false;
+
+	switch (clock_req->cmd_and_id >> 24) {
+	case CMD_CLK_SET_RATE:
+	case CMD_CLK_SET_PARENT:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/*
+ * Returns the clock of a CMD_CLK_SET_RATE, or -1
+ */
+static int bpmp_host_sched_set_rate_clk(const struct tegra_bpmp_message *msg)
+{
+	const struct mrq_clk_request *clock_req = msg->tx.data;
+
+	if (msg->mrq != MRQ_CLK ||
+	    msg->tx.size < offsetofend(struct mrq_clk_request, clk_set_rate) ||
+	    clock_req->cmd_and_id >> 24 != CMD_CLK_SET_RATE)
+		return -1;
+
+	return clock_req->cmd_and_id & 0x00FFFFFF;
+}
+
+/*
+ * Puts a CMD_CLK_SET_RATE in the place of the last one queued for the
+ * same clock, if no other command of the clock was queued after it.
+ * Called with the scheduler lock held, returns true if it did.
+ */
+static bool bpmp_host_sched_coalesce(struct bpmp_host_req *req)
+{
+	struct bpmp_host_vm_sched *sched = &req->vm->sched;
+	const struct mrq_clk_request *clock_req;
+	struct bpmp_host_req *old;
+	int clk_id;
+
+	if (!sched->coalesce_rates)
+		return false;
+
+	clk_id = bpmp_host_sched_set_rate_clk(req->msg);
+	if (clk_id < 0)
+		return false;
+
+	list_for_each_entry_reverse(old, &sched->queue[req->class], node) {
+		if (old->msg->mrq != MRQ_CLK || old->msg->tx.size < sizeof(u32))
+			continue;
+
+		clock_req = old->msg->tx.data;
+		if ((clock_req->cmd_and_id & 0x00FFFFFF) != clk_id)
+			continue;
+
+		if (bpmp_host_sched_set_rate_clk(old->msg) != clk_id)
+			return false;
+
+		list_replace(&old->node, &req->node);
+		list_splice_init(&old->coalesced, &req->coalesced);
+		list_add_tail(&old->node, &req->coalesced);
+		atomic64_inc(&req->vm->coalesced);
+		return true;
+	}
+
+	return false;
+}
+
+/*
+ * Queues a validated request of a VM. Waits for room in the queue of the
+ * VM, unless nonblock is set, then req->done is called once transferred,
+ * or before returning if the answer is cached.
+ */
+int bpmp_host_sched_submit(struct bpmp_host_req *req, bool nonblock)
+{
+	struct bpmp_host_vm_sched *sched = &req->vm->sched;
+	bool memo;
+	int ret;
+
+	// A memoized answer can be made stale by a change of the VM not completed yet
+	req->clk_change = false;
+	memo = !atomic_read(&sched->clk_changes);
+
+	// Cached answers complete right away, without taking a slot of the queue
+	if (bpmp_host_cache_lookup(req->msg, memo)) {
+		req->ret = 0;
+		bpmp_host_vm_account(req->vm, req->msg, 0);
+		req->done(req);
+		return 0;
+	}
+
+	req->class = bpmp_host_vm_class(req->vm, req->msg);
+	INIT_LIST_HEAD(&req->coalesced);
+
+	if (bpmp_host_sched_clk_change(req->msg)) {
+		req->clk_change = true;
+		atomic_inc(&sched->clk_changes);
+	}
+
+	spin_lock(&bpmp_host_sched_lock);
+
+	for (;;) {
+		if (bpmp_host_sched_stopped) {
+			ret = -ENODEV;
+			goto err_unlock;
+		}
+
+		// A coalesced request takes the slot of the one it supersedes
+		if (bpmp_host_sched_coalesce(req)) {
+			spin_unlock(&bpmp_host_sched_lock);
+			return 0;
+		}
+
+		if (sched->queued < sched->depth)
+			break;
+
+		spin_unlock(&bpmp_host_sched_lock);
+
+		if (nonblock) {
+			ret = -EAGAIN;
+			goto err;
+		}
+
+		ret = wait_event_killable(sched->space,
+			READ_ONCE(sched->queued) < READ_ONCE(sched->depth) ||
+			READ_ONCE(bpmp_host_sched_stopped));
+		if (ret)
+			goto err;
+
+		spin_lock(&bpmp_host_sched_lock);
+	}
+
+	list_add_tail(&req->node, &sched->queue[req->class]);
+	sched->queued++;
+	WRITE_ONCE(bpmp_host_sched_kicks, bpmp_host_sched_kicks + 1);
+
+	spin_unlock(&bpmp_host_sched_lock);
+
+	wake_up(&bpmp_host_sched_wait);
+
+	return 0;
+
+err_unlock:
+	spin_unlock(&bpmp_host_sched_lock);
+err:
+	if (req->clk_change)
+		atomic_dec(&sched->clk_changes);
+	return ret;
+}
+
+struct bpmp_host_sched_sync {
+	struct bpmp_host_req req;
+	struct completion done;
+};
+
+static void bpmp_host_sched_sync_done(struct bpmp_host_req *req)
+{
+	complete(&container_of(req, struct bpmp_host_sched_sync, req)->done);
+}
+
+/*
+ * Transfers a validated message through the scheduler and waits for it.
+ *
+ * Returns 0 if the message was transferred, with the tegra_bpmp_transfer
+ * return code in xfer_ret, or a negative error if it was not queued.
+ */
+int bpmp_host_sched_xfer(struct bpmp_host_vm *vm, struct tegra_bpmp_message *msg,
+	bool nonblock, int *xfer_ret)
+{
+	struct bpmp_host_sched_sync sync = {
+		.req = {
+			.vm = vm,
+			.msg = msg,
+			.done = bpmp_host_sched_sync_done,
+		},
+	};
+	int ret;
+
+	init_completion(&sync.done);
+
+	ret = bpmp_host_sched_submit(&sync.req, nonblock);
+	if (ret)
+		return ret;
+
+	// Once queued the request is always completed, and the BPMP transfers time out
+	wait_for_completion(&sync.done);
+	*xfer_ret = sync.req.ret;
+
+	return 0;
+}
+
+/*
+ * Sets the token bucket quota and the queue depth of a VM
+ */
+long bpmp_host_sched_set_quota(struct bpmp_host_vm_quota __user *uquota)
+{
+	struct bpmp_host_vm_quota quota;
+	struct bpmp_host_vm_sched *sched;
+	struct bpmp_host_vm *vm;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	if (copy_from_user(&quota, uquota, sizeof(quota)))
+		return -EFAULT;
+
+	vm = bpmp_host_vm_get(quota.vm_id);
+	if (!vm || (quota.rate && !quota.burst) || !quota.queue_depth ||
+	    quota.queue_depth > BPMP_HOST_MAX_QUEUE_DEPTH ||
+	    quota.flags & ~BPMP_HOST_QUOTA_COALESCE_RATES)
+		return -EINVAL;
+
+	sched = &vm->sched;
+
+	spin_lock(&bpmp_host_sched_lock);
+	sched->rate = quota.rate;
+	sched->burst = quota.burst;
+	sched->credit = (u64)quota.burst * BPMP_HOST_SCHED_COST;
+	sched->last = ktime_get();
+	sched->depth = quota.queue_depth;
+	sched->coalesce_rates = quota.flags & BPMP_HOST_QUOTA_COALESCE_RATES;
+	WRITE_ONCE(bpmp_host_sched_kicks, bpmp_host_sched_kicks + 1);
+	spin_unlock(&bpmp_host_sched_lock);
+
+	// A deeper queue can let submitters in, a new quota can let requests out
+	wake_up(&sched->space);
+	wake_up(&bpmp_host_sched_wait);
+
+	deb_info("vm %u quota: %u msg/s, burst %u, depth %u\n", vm->id,
+		quota.rate, quota.burst, quota.queue_depth);
+
+	return 0;
+}
+
+int bpmp_host_sched_init(void)
+{
+	struct bpmp_host_vm_sched *sched;
+	struct task_struct *task;
+	int i, class;
+
+	for (i = 0; i < BPMP_HOST_MAX_VMS; i++) {
+		sched = &bpmp_host_vms[i].sched;
+		for (class = 0; class < BPMP_HOST_NR_CLASSES; class++)
+			INIT_LIST_HEAD(&sched->queue[class]);
+		init_waitqueue_head(&sched->space);
+		atomic_set(&sched->clk_changes, 0);
+		sched->queued = 0;
+		sched->depth = BPMP_HOST_SCHED_DEPTH;
+		sched->rate = 0;
+	}
+
+	bpmp_host_sched_stopped = false;
+
+	// The BPMP driver can probe after the proxy
+	bpmp_host_sched_nr_workers = tegra_bpmp_host_device ?
+		clamp_t(unsigned int, tegra_bpmp_host_device->threaded.count,
+			1, BPMP_HOST_SCHED_MAX_WORKERS) :
+		BPMP_HOST_SCHED_WORKERS;
+
+	for (i = 0; i < bpmp_host_sched_nr_workers; i++) {
+		task = kthread_run(bpmp_host_sched_thread, NULL, "bpmp-host-sched/%d", i);
+		if (IS_ERR(task)) {
+			bpmp_host_sched_nr_workers = i;
+			bpmp_host_sched_exit();
+			return PTR_ERR(task);
+		}
+		bpmp_host_sched_tasks[i] = task;
+	}
+
+	return 0;
+}
+
+/*
+ * Stops the workers, failing the requests still queued
+ */
+void bpmp_host_sched_exit(void)
+{
+	struct bpmp_host_req *req, *tmp;
+	LIST_HEAD(pending);
+	int i, class;
+
+	// No new request gets queued while the workers stop
+	spin_lock(&bpmp_host_sched_lock);
+	bpmp_host_sched_stopped = true;
+	spin_unlock(&bpmp_host_sched_lock);
+
+	for (i = 0; i < BPMP_HOST_MAX_VMS; i++)
+		wake_up(&bpmp_host_vms[i].sched.space);
+
+	for (i = 0; i < bpmp_host_sched_nr_workers; i++)
+		kthread_stop(bpmp_host_sched_tasks[i]);
+	bpmp_host_sched_nr_workers = 0;
+
+	spin_lock(&bpmp_host_sched_lock);
+	for (i = 0; i < BPMP_HOST_MAX_VMS; i++) {
+		for (class = 0; class < BPMP_HOST_NR_CLASSES; class++)
+			list_splice_tail_init(&bpmp_host_vms[i].sched.queue[class], &pending);
+		bpmp_host_vms[i].sched.queued = 0;
+	}
+	spin_unlock(&bpmp_host_sched_lock);
+
+	list_for_each_entry_safe(req, tmp, &pending, node) {
+		list_del(&req->node);
+		req->ret = -ENODEV;
+		bpmp_host_sched_complete(req);
+	}
+}
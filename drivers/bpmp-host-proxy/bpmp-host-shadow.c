@@ -0,0 +1,449 @@
+/**
+ *
+ * NVIDIA BPMP Host Proxy Kernel Module
+ * Shadow state of the clocks, resets and power domains
+ *
+ * Each VM has a shadow of the clocks it enabled, the power domains it
+ * turned on and the state of the resets it drove, and each resource has
+ * the count of the VMs using it. Requests that do not change anything,
+ * like enabling a clock that the VM already enabled, or disabling a clock
+ * that another VM still uses, are answered without going to the BPMP.
+ *
+ * The host drivers use the BPMP directly. The VMs together are one user
+ * of a clock for the BPMP, which counts the enables of each clock: the
+ * first VM enable and the last VM disable are always transferred, so a
+ * clock shared with the host, like PLLP_OUT0, stays on while either side
+ * uses it. A disable from a VM that did not enable the clock, like the
+ * unused clocks disabled at boot, is ignored. Power domains are not
+ * counted by the BPMP: before the first VM turns one on its state is
+ * queried, and if it is already on, it is considered held by the host
+ * until its last VM user turns it off.
+ *
+ * When the last file of a VM is closed, or its policy no longer allows a
+ * resource, the references of the VM are released and the resources it
+ * was the last user of are turned off.
+ *
+ * The shadow state is only used by the scheduler workers, which transfer
+ * the state changes one at a time, serializing the decisions with the
+ * transfers, and by the release of a VM, serialized with them.
+ *
+*/
+#include <linux/kernel.h>
+#include <linux/bitmap.h>
+#include "bpmp-host-internal.h"
+
+
+/**
+ * Shadow state of a resource id, shared by the VMs
+ */
+struct bpmp_host_res_shadow {
+	u16 clk_users;		///< VMs that enabled the clock
+	u16 pd_users;		///< VMs that turned the power domain on
+	bool pd_host_held;	///< The power domain was on before the VMs used it
+	u8 pd_state;		///< Last state set by the VMs
+	bool rate_valid;	///< The clock rate is the one last set by the VMs
+	s64 rate_req;		///< Last rate requested
+	s64 rate;		///< Rate that the BPMP set for rate_req
+};
+
+static struct bpmp_host_res_shadow bpmp_host_res_shadow[BPMP_HOST_MAX_RES_ID];
+
+static void bpmp_host_shadow_clk_put(struct bpmp_host_vm *vm, u32 clk_id)
+{
+	if (test_and_clear_bit(clk_id, vm->shadow.clk_enabled))
+		bpmp_host_res_shadow[clk_id].clk_users--;
+}
+
+static void bpmp_host_shadow_pd_put(struct bpmp_host_vm *vm, u32 pd_id)
+{
+	struct bpmp_host_res_shadow *rs = &bpmp_host_res_shadow[pd_id];
+
+	if (!test_and_clear_bit(pd_id, vm->shadow.pd_on))
+		return;
+
+	// The next first user checks the state again
+	if (!--rs->pd_users)
+		rs->pd_host_held = false;
+}
+
+/*
+ * Queries a power domain state, returns it or a negative error
+ */
+static int bpmp_host_shadow_pd_get_state(u32 pd_id)
+{
+	struct mrq_pg_request req = {
+		.cmd = CMD_PG_GET_STATE,
+		.id = pd_id,
+	};
+	struct cmd_pg_get_state_response resp = {};
+	struct tegra_bpmp_message msg = {
+		.mrq = MRQ_PG,
+		.tx = { .data = &req, .size = offsetofend(struct mrq_pg_request, id) },
+		.rx = { .data = &resp, .size = sizeof(resp) },
+	};
+	int ret;
+
+	ret = tegra_bpmp_transfer(tegra_bpmp_host_device, &msg);
+	if (ret)
+		return ret;
+	if (msg.rx.ret)
+		return -EINVAL;
+
+	return resp.state;
+}
+
+/*
+ * Answers a message locally, as the BPMP would have done
+ */
+static bool bpmp_host_shadow_answer(struct tegra_bpmp_message *msg)
+{
+	if (msg->rx.data)
+		memset(msg->rx.data, 0, msg->rx.size);
+	msg->rx.ret = 0;
+
+	return true;
+}
+
+static bool bpmp_host_shadow_filter_clk(struct bpmp_host_vm *vm,
+	struct tegra_bpmp_message *msg)
+{
+	const struct mrq_clk_request *clock_req = msg->tx.data;
+	struct mrq_clk_response *clock_resp = msg->rx.data;
+	u32 clk_cmd = clock_req->cmd_and_id >> 24;
+	u32 clk_id = clock_req->cmd_and_id & 0x00FFFFFF;
+	struct bpmp_host_res_shadow *rs;
+
+	if (clk_id >= BPMP_HOST_MAX_RES_ID)
+		return false;
+
+	rs = &bpmp_host_res_shadow[clk_id];
+
+	switch (clk_cmd) {
+	case CMD_CLK_ENABLE:
+		if (test_bit(clk_id, vm->shadow.clk_enabled))
+			return bpmp_host_shadow_answer(msg);
+
+		// The first VM user takes the reference of the VMs in the BPMP
+		if (!rs->clk_users)
+			return false;
+
+		__set_bit(clk_id, vm->shadow.clk_enabled);
+		rs->clk_users++;
+		return bpmp_host_shadow_answer(msg);
+
+	case CMD_CLK_DISABLE:
+		// Not enabled by this VM, it has no reference to drop
+		if (!test_bit(clk_id, vm->shadow.clk_enabled))
+			return bpmp_host_shadow_answer(msg);
+
+		// The last VM user drops the reference of the VMs
+		if (rs->clk_users > 1) {
+			bpmp_host_shadow_clk_put(vm, clk_id);
+			return bpmp_host_shadow_answer(msg);
+		}
+		return false;
+
+	case CMD_CLK_SET_RATE:
+		if (msg->rx.size < sizeof(clock_resp->clk_set_rate) || !rs->rate_valid ||
+		    rs->rate_req != clock_req->clk_set_rate.rate)
+			return false;
+
+		bpmp_host_shadow_answer(msg);
+		clock_resp->clk_set_rate.rate = rs->rate;
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+static bool bpmp_host_shadow_filter_reset(struct bpmp_host_vm *vm,
+	struct tegra_bpmp_message *msg)
+{
+	const struct mrq_reset_request *reset_req = msg->tx.data;
+	u32 reset_id = reset_req->reset_id;
+	bool asserted;
+
+	if (reset_id >= BPMP_HOST_MAX_RES_ID || !test_bit(reset_id, vm->shadow.reset_known))
+		return false;
+
+	asserted = test_bit(reset_id, vm->shadow.reset_asserted);
+
+	if ((reset_req->cmd == CMD_RESET_ASSERT && asserted) ||
+	    (reset_req->cmd == CMD_RESET_DEASSERT && !asserted))
+		return bpmp_host_shadow_answer(msg);
+
+	return false;
+}
+
+static bool bpmp_host_shadow_filter_pg(struct bpmp_host_vm *vm,
+	struct tegra_bpmp_message *msg)
+{
+	const struct mrq_pg_request *pg_req = msg->tx.data;
+	u32 pd_id = pg_req->id;
+	u32 state = pg_req->set_state.state;
+	struct bpmp_host_res_shadow *rs;
+	int cur;
+
+	if (pg_req->cmd != CMD_PG_SET_STATE || pd_id >= BPMP_HOST_MAX_RES_ID)
+		return false;
+
+	rs = &bpmp_host_res_shadow[pd_id];
+
+	if (state != PG_STATE_OFF) {
+		if (rs->pd_users || rs->pd_host_held) {
+			// Already on in the requested state
+			if (rs->pd_state != state)
+				return false;
+		} else {
+			cur = bpmp_host_shadow_pd_get_state(pd_id);
+			if (cur != state)
+				return false;
+			rs->pd_host_held = true;
+			rs->pd_state = state;
+		}
+
+		if (!test_and_set_bit(pd_id, vm->shadow.pd_on))
+			rs->pd_users++;
+		return bpmp_host_shadow_answer(msg);
+	}
+
+	if (!test_bit(pd_id, vm->shadow.pd_on)) {
+		if (!rs->pd_users && !rs->pd_host_held) {
+			cur = bpmp_host_shadow_pd_get_state(pd_id);
+			if (cur > 0) {
+				rs->pd_host_held = true;
+				rs->pd_state = cur;
+			}
+		}
+		return bpmp_host_shadow_answer(msg);
+	}
+
+	if (rs->pd_users > 1 || rs->pd_host_held) {
+		bpmp_host_shadow_pd_put(vm, pd_id);
+		return bpmp_host_shadow_answer(msg);
+	}
+
+	return false;
+}
+
+/*
+ * Answers a validated message of a VM from the shadow state if it does
+ * not change anything. Returns true if answered.
+ */
+bool bpmp_host_shadow_filter(struct bpmp_host_vm *vm, struct tegra_bpmp_message *msg)
+{
+	switch (msg->mrq) {
+	case MRQ_CLK:
+		return msg->tx.size >= sizeof(u32) &&
+			bpmp_host_shadow_filter_clk(vm, msg);
+	case MRQ_RESET:
+		return msg->tx.size >= sizeof(struct mrq_reset_request) &&
+			bpmp_host_shadow_filter_reset(vm, msg);
+	case MRQ_PG:
+		return msg->tx.size >= offsetofend(struct mrq_pg_request, set_state) &&
+			bpmp_host_shadow_filter_pg(vm, msg);
+	default:
+		return false;
+	}
+}
+
+static void bpmp_host_shadow_update_clk(struct bpmp_host_vm *vm,
+	const struct tegra_bpmp_message *msg, bool ok)
+{
+	const struct mrq_clk_request *clock_req = msg->tx.data;
+	const struct mrq_clk_response *clock_resp = msg->rx.data;
+	u32 clk_cmd = clock_req->cmd_and_id >> 24;
+	u32 clk_id = clock_req->cmd_and_id & 0x00FFFFFF;
+	struct bpmp_host_res_shadow *rs;
+	u32 i;
+
+	if (clk_id >= BPMP_HOST_MAX_RES_ID)
+		return;
+
+	rs = &bpmp_host_res_shadow[clk_id];
+
+	switch (clk_cmd) {
+	case CMD_CLK_ENABLE:
+		if (ok && !test_and_set_bit(clk_id, vm->shadow.clk_enabled))
+			rs->clk_users++;
+		break;
+	case CMD_CLK_DISABLE:
+		if (ok)
+			bpmp_host_shadow_clk_put(vm, clk_id);
+		break;
+	case CMD_CLK_SET_RATE:
+	case CMD_CLK_SET_PARENT:
+		// The rates of the clocks below can have changed too
+		for (i = 0; i < BPMP_HOST_MAX_RES_ID; i++) {
+			if (bpmp_host_res_shadow[i].rate_valid && i != clk_id &&
+			    bpmp_host_clk_depends(i, clk_id))
+				bpmp_host_res_shadow[i].rate_valid = false;
+		}
+
+		rs->rate_valid = clk_cmd == CMD_CLK_SET_RATE && ok &&
+			msg->rx.size >= sizeof(clock_resp->clk_set_rate);
+		if (rs->rate_valid) {
+			rs->rate_req = clock_req->clk_set_rate.rate;
+			rs->rate = clock_resp->clk_set_rate.rate;
+		}
+		break;
+	}
+}
+
+static void bpmp_host_shadow_update_reset(struct bpmp_host_vm *vm,
+	const struct tegra_bpmp_message *msg, bool ok)
+{
+	const struct mrq_reset_request *reset_req = msg->tx.data;
+	u32 reset_id = reset_req->reset_id;
+
+	if (reset_id >= BPMP_HOST_MAX_RES_ID)
+		return;
+
+	switch (reset_req->cmd) {
+	case CMD_RESET_ASSERT:
+	case CMD_RESET_DEASSERT:
+	case CMD_RESET_MODULE:
+		break;
+	default:
+		return;
+	}
+
+	// A failed request leaves the reset in an unknown state
+	if (!ok) {
+		__clear_bit(reset_id, vm->shadow.reset_known);
+		return;
+	}
+
+	__set_bit(reset_id, vm->shadow.reset_known);
+	if (reset_req->cmd == CMD_RESET_ASSERT)
+		__set_bit(reset_id, vm->shadow.reset_asserted);
+	else
+		__clear_bit(reset_id, vm->shadow.reset_asserted);
+}
+
+static void bpmp_host_shadow_update_pg(struct bpmp_host_vm *vm,
+	const struct tegra_bpmp_message *msg, bool ok)
+{
+	const struct mrq_pg_request *pg_req = msg->tx.data;
+	u32 pd_id = pg_req->id;
+	u32 state = pg_req->set_state.state;
+	struct bpmp_host_res_shadow *rs;
+
+	if (pg_req->cmd != CMD_PG_SET_STATE || pd_id >= BPMP_HOST_MAX_RES_ID || !ok)
+		return;
+
+	rs = &bpmp_host_res_shadow[pd_id];
+	rs->pd_state = state;
+
+	if (state != PG_STATE_OFF) {
+		if (!test_and_set_bit(pd_id, vm->shadow.pd_on))
+			rs->pd_users++;
+	} else {
+		bpmp_host_shadow_pd_put(vm, pd_id);
+	}
+}
+
+/*
+ * Updates the shadow state with a message of a VM transferred to the
+ * BPMP, ret being the tegra_bpmp_transfer return code
+ */
+void bpmp_host_shadow_update(struct bpmp_host_vm *vm,
+	const struct tegra_bpmp_message *msg, int ret)
+{
+	bool ok = !ret && !msg->rx.ret;
+
+	switch (msg->mrq) {
+	case MRQ_CLK:
+		if (msg->tx.size >= sizeof(u32))
+			bpmp_host_shadow_update_clk(vm, msg, ok);
+		break;
+	case MRQ_RESET:
+		if (msg->tx.size >= sizeof(struct mrq_reset_request))
+			bpmp_host_shadow_update_reset(vm, msg, ok);
+		break;
+	case MRQ_PG:
+		if (msg->tx.size >= offsetofend(struct mrq_pg_request, set_state))
+			bpmp_host_shadow_update_pg(vm, msg, ok);
+		break;
+	}
+}
+
+/*
+ * Transfers a request of the release of a VM, like a message of the VM
+ */
+static void bpmp_host_shadow_release_xfer(struct bpmp_host_vm *vm,
+	struct tegra_bpmp_message *msg)
+{
+	int ret = 0;
+
+	if (!bpmp_host_shadow_filter(vm, msg)) {
+		ret = tegra_bpmp_transfer(tegra_bpmp_host_device, msg);
+		if (ret || msg->rx.ret)
+			deb_warn("vm %u release, mrq %u failed: %d, %d\n", vm->id,
+				msg->mrq, ret, msg->rx.ret);
+		bpmp_host_shadow_update(vm, msg, ret);
+		bpmp_host_cache_insert(msg, ret);
+	}
+
+	bpmp_host_state_update(msg, ret);
+}
+
+static void bpmp_host_shadow_release_clk(struct bpmp_host_vm *vm, u32 clk_id)
+{
+	struct mrq_clk_request req = {
+		.cmd_and_id = (CMD_CLK_DISABLE << 24) | clk_id,
+	};
+	struct tegra_bpmp_message msg = {
+		.mrq = MRQ_CLK,
+		.tx = { .data = &req, .size = sizeof(u32) },
+	};
+
+	bpmp_host_shadow_release_xfer(vm, &msg);
+
+	// Even if the BPMP refused, the VM does not use it anymore
+	bpmp_host_shadow_clk_put(vm, clk_id);
+}
+
+static void bpmp_host_shadow_release_pd(struct bpmp_host_vm *vm, u32 pd_id)
+{
+	struct mrq_pg_request req = {
+		.cmd = CMD_PG_SET_STATE,
+		.id = pd_id,
+		.set_state.state = PG_STATE_OFF,
+	};
+	struct tegra_bpmp_message msg = {
+		.mrq = MRQ_PG,
+		.tx = { .data = &req, .size = offsetofend(struct mrq_pg_request, set_state) },
+	};
+
+	bpmp_host_shadow_release_xfer(vm, &msg);
+	bpmp_host_shadow_pd_put(vm, pd_id);
+}
+
+/*
+ * Drops the references of the VM to the resources that the policy keep
+ * does not allow, or to all of them if it is NULL, turning off the clocks
+ * and power domains it was the last user of. Must be serialized with the
+ * state changes, see bpmp_host_sched_release.
+ */
+void bpmp_host_shadow_release(struct bpmp_host_vm *vm,
+	const struct bpmp_host_policy *keep)
+{
+	u32 id;
+
+	for_each_set_bit(id, vm->shadow.clk_enabled, BPMP_HOST_MAX_RES_ID)
+		if (!keep || !test_bit(id, keep->clock))
+			bpmp_host_shadow_release_clk(vm, id);
+
+	for_each_set_bit(id, vm->shadow.pd_on, BPMP_HOST_MAX_RES_ID)
+		if (!keep || !test_bit(id, keep->pd))
+			bpmp_host_shadow_release_pd(vm, id);
+
+	for_each_set_bit(id, vm->shadow.reset_known, BPMP_HOST_MAX_RES_ID) {
+		if (!keep || !test_bit(id, keep->reset)) {
+			__clear_bit(id, vm->shadow.reset_known);
+			__clear_bit(id, vm->shadow.reset_asserted);
+		}
+	}
+}
@@ -0,0 +1,467 @@
+/**
+ *
+ * NVIDIA BPMP Host Proxy Kernel Module
+ * Per VM state pages
+ *
+ * The rate, parent and enable state of the clocks, and the state of the
+ * power domains, are learnt from the answers of the messages that go
+ * through the proxy, and mirrored in a read-only page of each VM that
+ * is allowed to use them. The guest proxy answers the state queries from
+ * that page, without a message to the host.
+ *
+ * A value is only published while it is known: a rate or parent change
+ * drops the rates of the clocks below, a disable drops the enable state,
+ * since other users can keep the clock on, and a failed change drops what
+ * it changed. BPMP_HOST_IOCTL_CACHE_INVALIDATE drops all the values, and
+ * what the host drivers changed.
+ *
+ * Only the state the proxy fully owns is published. The transfer filter
+ * of the BPMP driver reports the state changes of the host drivers: from
+ * the first one, a clock or power domain is shared with the host and its
+ * values are not published anymore, nor the rates of the clocks below a
+ * clock whose rate or parent the host changes, as with a DVFS of a
+ * parent. Changes the BPMP firmware makes on its own are not seen, the
+ * clocks it scales should not be allowed to the VMs.
+ *
+ * The values are updated by the scheduler workers. The state changes are
+ * learnt in the transfers order, the answers of the queries only if no
+ * state change was transferred while they were in flight.
+ *
+*/
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/bitmap.h>
+#include "bpmp-host-internal.h"
+
+
+#define BPMP_HOST_STATE_PAGE_SIZE  PAGE_ALIGN(sizeof(struct bpmp_host_state_page))
+
+// Known state of all the resources, the VM pages are filtered copies
+static struct bpmp_host_state_clk bpmp_host_state_clks[BPMP_HOST_MAX_RES_ID];
+static struct bpmp_host_state_pd bpmp_host_state_pds[BPMP_HOST_MAX_RES_ID];
+
+// Resources changed by the host drivers, and clocks whose rate they changed
+static DECLARE_BITMAP(bpmp_host_state_host_clks, BPMP_HOST_MAX_RES_ID);
+static DECLARE_BITMAP(bpmp_host_state_host_rates, BPMP_HOST_MAX_RES_ID);
+static DECLARE_BITMAP(bpmp_host_state_host_pds, BPMP_HOST_MAX_RES_ID);
+
+// Protects the state above and the writes to the VM pages
+static DEFINE_SPINLOCK(bpmp_host_state_lock);
+
+// Serializes the allocation of the VM pages
+static DEFINE_MUTEX(bpmp_host_state_alloc_lock);
+
+static bool bpmp_host_state_allowed(struct bpmp_host_vm *vm, bool clk, u32 id)
+{
+	const struct bpmp_host_policy *policy;
+	bool allowed;
+
+	rcu_read_lock();
+	policy = rcu_dereference(vm->policy);
+	if (!policy)
+		policy = bpmp_host_default_policy;
+	allowed = BPMP_HOST_ALLOWS_ALL || test_bit(id, clk ? policy->clock : policy->pd);
+	rcu_read_unlock();
+
+	return allowed;
+}
+
+static void bpmp_host_state_write_begin(struct bpmp_host_state_page *page)
+{
+	WRITE_ONCE(page->seq, page->seq + 1);
+	smp_wmb();
+}
+
+static void bpmp_host_state_write_end(struct bpmp_host_state_page *page)
+{
+	smp_wmb();
+	WRITE_ONCE(page->seq, page->seq + 1);
+}
+
+/*
+ * Checks if the rate of a clock can be changed by the host drivers,
+ * directly or through the clocks above it
+ */
+static bool bpmp_host_state_host_rate(u32 clk_id)
+{
+	u32 i;
+
+	for_each_set_bit(i, bpmp_host_state_host_rates, BPMP_HOST_MAX_RES_ID)
+		if (i == clk_id || bpmp_host_clk_depends(clk_id, i))
+			return true;
+
+	return false;
+}
+
+/*
+ * Gets the published state of a clock, without what the host drivers
+ * can change. Called with bpmp_host_state_lock held.
+ */
+static void bpmp_host_state_get_clk(u32 clk_id, struct bpmp_host_state_clk *clk)
+{
+	*clk = bpmp_host_state_clks[clk_id];
+
+	if (test_bit(clk_id, bpmp_host_state_host_clks))
+		memset(clk, 0, sizeof(*clk));
+	else if ((clk->flags & BPMP_HOST_STATE_RATE_VALID) &&
+		 bpmp_host_state_host_rate(clk_id))
+		clk->flags &= ~BPMP_HOST_STATE_RATE_VALID;
+}
+
+static void bpmp_host_state_get_pd(u32 pd_id, struct bpmp_host_state_pd *pd)
+{
+	if (test_bit(pd_id, bpmp_host_state_host_pds))
+		memset(pd, 0, sizeof(*pd));
+	else
+		*pd = bpmp_host_state_pds[pd_id];
+}
+
+/*
+ * Copies the known state of a resource to the pages of the VMs allowed
+ * to use it. Called with bpmp_host_state_lock held.
+ */
+static void bpmp_host_state_publish(bool clk, u32 id)
+{
+	struct bpmp_host_state_page *page;
+	struct bpmp_host_state_clk clk_state;
+	struct bpmp_host_state_pd pd_state;
+	struct bpmp_host_vm *vm;
+	bool allowed;
+	int i;
+
+	if (clk)
+		bpmp_host_state_get_clk(id, &clk_state);
+	else
+		bpmp_host_state_get_pd(id, &pd_state);
+
+	for (i = 0; i < BPMP_HOST_MAX_VMS; i++) {
+		vm = &bpmp_host_vms[i];
+		page = vm->state;
+		if (!page)
+			continue;
+
+		allowed = bpmp_host_state_allowed(vm, clk, id);
+
+		bpmp_host_state_write_begin(page);
+		if (clk) {
+			if (allowed)
+				page->clks[id] = clk_state;
+			else
+				memset(&page->clks[id], 0, sizeof(page->clks[id]));
+		} else {
+			if (allowed)
+				page->pds[id] = pd_state;
+			else
+				memset(&page->pds[id], 0, sizeof(page->pds[id]));
+		}
+		bpmp_host_state_write_end(page);
+	}
+}
+
+/*
+ * Drops the rates of the clocks that a rate or parent change of a clock
+ * can modify, with the clock itself when include_self
+ */
+static void bpmp_host_state_drop_rates(u32 changed_id, bool include_self)
+{
+	u32 i;
+
+	for (i = 0; i < BPMP_HOST_MAX_RES_ID; i++) {
+		if (!(bpmp_host_state_clks[i].flags & BPMP_HOST_STATE_RATE_VALID))
+			continue;
+		if (i == changed_id ? !include_self : !bpmp_host_clk_depends(i, changed_id))
+			continue;
+
+		bpmp_host_state_clks[i].flags &= ~BPMP_HOST_STATE_RATE_VALID;
+		bpmp_host_state_publish(true, i);
+	}
+}
+
+static void bpmp_host_state_update_clk(const struct tegra_bpmp_message *msg, bool ok)
+{
+	const struct mrq_clk_request *clock_req = msg->tx.data;
+	const struct mrq_clk_response *clock_resp = msg->rx.data;
+	u32 clk_cmd = clock_req->cmd_and_id >> 24;
+	u32 clk_id = clock_req->cmd_and_id & 0x00FFFFFF;
+	struct bpmp_host_state_clk *clk;
+
+	if (clk_id >= BPMP_HOST_MAX_RES_ID)
+		return;
+
+	clk = &bpmp_host_state_clks[clk_id];
+
+	switch (clk_cmd) {
+	case CMD_CLK_GET_RATE:
+		if (!ok || msg->rx.size < sizeof(clock_resp->clk_get_rate))
+			return;
+		clk->rate = clock_resp->clk_get_rate.rate;
+		clk->flags |= BPMP_HOST_STATE_RATE_VALID;
+		break;
+	case CMD_CLK_SET_RATE:
+		bpmp_host_state_drop_rates(clk_id, true);
+		if (!ok || msg->rx.size < sizeof(clock_resp->clk_set_rate))
+			return;
+		clk->rate = clock_resp->clk_set_rate.rate;
+		clk->flags |= BPMP_HOST_STATE_RATE_VALID;
+		break;
+	case CMD_CLK_GET_PARENT:
+		if (!ok || msg->rx.size < sizeof(clock_resp->clk_get_parent))
+			return;
+		clk->parent = clock_resp->clk_get_parent.parent_id;
+		clk->flags |= BPMP_HOST_STATE_PARENT_VALID;
+		break;
+	case CMD_CLK_SET_PARENT:
+		bpmp_host_state_drop_rates(clk_id, true);
+		// Even a failed change can have moved the clock
+		clk->flags &= ~BPMP_HOST_STATE_PARENT_VALID;
+		if (ok && msg->rx.size >= sizeof(clock_resp->clk_set_parent)) {
+			clk->parent = clock_resp->clk_set_parent.parent_id;
+			clk->flags |= BPMP_HOST_STATE_PARENT_VALID;
+		}
+		break;
+	case CMD_CLK_IS_ENABLED:
+		if (!ok || msg->rx.size < sizeof(clock_resp->clk_is_enabled))
+			return;
+		clk->flags |= BPMP_HOST_STATE_ENABLED_VALID;
+		if (clock_resp->clk_is_enabled.state)
+			clk->flags |= BPMP_HOST_STATE_ENABLED;
+		else
+			clk->flags &= ~BPMP_HOST_STATE_ENABLED;
+		break;
+	case CMD_CLK_ENABLE:
+		if (ok)
+			clk->flags |= BPMP_HOST_STATE_ENABLED_VALID | BPMP_HOST_STATE_ENABLED;
+		else
+			clk->flags &= ~BPMP_HOST_STATE_ENABLED_VALID;
+		break;
+	case CMD_CLK_DISABLE:
+		// Another VM or the host can still keep it on
+		clk->flags &= ~BPMP_HOST_STATE_ENABLED_VALID;
+		break;
+	default:
+		return;
+	}
+
+	bpmp_host_state_publish(true, clk_id);
+}
+
+static void bpmp_host_state_update_pg(const struct tegra_bpmp_message *msg, bool ok)
+{
+	const struct mrq_pg_request *pg_req = msg->tx.data;
+	const struct mrq_pg_response *pg_resp = msg->rx.data;
+	struct bpmp_host_state_pd *pd;
+
+	if (msg->tx.size < offsetofend(struct mrq_pg_request, id) ||
+	    pg_req->id >= BPMP_HOST_MAX_RES_ID)
+		return;
+
+	pd = &bpmp_host_state_pds[pg_req->id];
+
+	switch (pg_req->cmd) {
+	case CMD_PG_GET_STATE:
+		if (!ok || msg->rx.size < sizeof(pg_resp->get_state))
+			return;
+		pd->state = pg_resp->get_state.state;
+		pd->flags |= BPMP_HOST_STATE_PD_VALID;
+		break;
+	case CMD_PG_SET_STATE:
+		if (ok && msg->tx.size >= offsetofend(struct mrq_pg_request, set_state)) {
+			pd->state = pg_req->set_state.state;
+			pd->flags |= BPMP_HOST_STATE_PD_VALID;
+		} else {
+			pd->flags &= ~BPMP_HOST_STATE_PD_VALID;
+		}
+		break;
+	default:
+		return;
+	}
+
+	bpmp_host_state_publish(false, pg_req->id);
+}
+
+/*
+ * Learns from a transferred or elided message, ret being its
+ * tegra_bpmp_transfer return code
+ */
+void bpmp_host_state_update(const struct tegra_bpmp_message *msg, int ret)
+{
+	bool ok = !ret && !msg->rx.ret;
+
+	switch (msg->mrq) {
+	case MRQ_CLK:
+		if (msg->tx.size < sizeof(u32))
+			return;
+		spin_lock(&bpmp_host_state_lock);
+		bpmp_host_state_update_clk(msg, ok);
+		spin_unlock(&bpmp_host_state_lock);
+		break;
+	case MRQ_PG:
+		spin_lock(&bpmp_host_state_lock);
+		bpmp_host_state_update_pg(msg, ok);
+		spin_unlock(&bpmp_host_state_lock);
+		break;
+	}
+}
+
+/*
+ * Marks the resource a state change of a host driver is about as shared
+ * with the host, before it is transferred
+ */
+void bpmp_host_state_host_xfer(const struct tegra_bpmp_message *msg)
+{
+	const struct mrq_clk_request *clock_req = msg->tx.data;
+	const struct mrq_pg_request *pg_req = msg->tx.data;
+	u32 clk_cmd, clk_id;
+
+	switch (msg->mrq) {
+	case MRQ_CLK:
+		if (msg->tx.size < sizeof(u32))
+			return;
+		clk_cmd = clock_req->cmd_and_id >> 24;
+		clk_id = clock_req->cmd_and_id & 0x00FFFFFF;
+		if (clk_id >= BPMP_HOST_MAX_RES_ID)
+			return;
+
+		spin_lock(&bpmp_host_state_lock);
+		switch (clk_cmd) {
+		case CMD_CLK_SET_RATE:
+		case CMD_CLK_SET_PARENT:
+			if (!test_and_set_bit(clk_id, bpmp_host_state_host_rates))
+				bpmp_host_state_drop_rates(clk_id, true);
+			fallthrough;
+		case CMD_CLK_ENABLE:
+		case CMD_CLK_DISABLE:
+			if (!test_and_set_bit(clk_id, bpmp_host_state_host_clks))
+				bpmp_host_state_publish(true, clk_id);
+			break;
+		}
+		spin_unlock(&bpmp_host_state_lock);
+		break;
+	case MRQ_PG:
+		if (msg->tx.size < offsetofend(struct mrq_pg_request, id) ||
+		    pg_req->cmd != CMD_PG_SET_STATE || pg_req->id >= BPMP_HOST_MAX_RES_ID)
+			return;
+
+		spin_lock(&bpmp_host_state_lock);
+		if (!test_and_set_bit(pg_req->id, bpmp_host_state_host_pds))
+			bpmp_host_state_publish(false, pg_req->id);
+		spin_unlock(&bpmp_host_state_lock);
+		break;
+	}
+}
+
+/*
+ * Rewrites the page of a VM, after its policy changed
+ */
+void bpmp_host_state_reset(struct bpmp_host_vm *vm)
+{
+	struct bpmp_host_state_page *page;
+	u32 i;
+
+	spin_lock(&bpmp_host_state_lock);
+
+	page = vm->state;
+	if (page) {
+		bpmp_host_state_write_begin(page);
+		for (i = 0; i < BPMP_HOST_MAX_RES_ID; i++) {
+			if (bpmp_host_state_allowed(vm, true, i))
+				bpmp_host_state_get_clk(i, &page->clks[i]);
+			else
+				memset(&page->clks[i], 0, sizeof(page->clks[i]));
+
+			if (bpmp_host_state_allowed(vm, false, i))
+				bpmp_host_state_get_pd(i, &page->pds[i]);
+			else
+				memset(&page->pds[i], 0, sizeof(page->pds[i]));
+		}
+		bpmp_host_state_write_end(page);
+	}
+
+	spin_unlock(&bpmp_host_state_lock);
+}
+
+/*
+ * Forgets the state of all the resources
+ */
+void bpmp_host_state_invalidate(void)
+{
+	struct bpmp_host_state_page *page;
+	int i;
+
+	spin_lock(&bpmp_host_state_lock);
+
+	memset(bpmp_host_state_clks, 0, sizeof(bpmp_host_state_clks));
+	memset(bpmp_host_state_pds, 0, sizeof(bpmp_host_state_pds));
+	bitmap_zero(bpmp_host_state_host_clks, BPMP_HOST_MAX_RES_ID);
+	bitmap_zero(bpmp_host_state_host_rates, BPMP_HOST_MAX_RES_ID);
+	bitmap_zero(bpmp_host_state_host_pds, BPMP_HOST_MAX_RES_ID);
+
+	for (i = 0; i < BPMP_HOST_MAX_VMS; i++) {
+		page = bpmp_host_vms[i].state;
+		if (!page)
+			continue;
+
+		bpmp_host_state_write_begin(page);
+		memset(page->clks, 0, sizeof(page->clks));
+		memset(page->pds, 0, sizeof(page->pds));
+		bpmp_host_state_write_end(page);
+	}
+
+	spin_unlock(&bpmp_host_state_lock);
+}
+
+/*
+ * Maps the state page of the VM, read-only, to its VMM. The page is
+ * allocated on the first mapping.
+ */
+int bpmp_host_state_mmap(struct bpmp_host_vm *vm, struct vm_area_struct *vma)
+{
+	struct bpmp_host_state_page *page;
+
+	if (vma->vm_end - vma->vm_start != BPMP_HOST_STATE_PAGE_SIZE)
+		return -EINVAL;
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+
+	vm_flags_clear(vma, VM_MAYWRITE);
+
+	mutex_lock(&bpmp_host_state_alloc_lock);
+
+	page = vm->state;
+	if (!page) {
+		page = vmalloc_user(BPMP_HOST_STATE_PAGE_SIZE);
+		if (!page) {
+			mutex_unlock(&bpmp_host_state_alloc_lock);
+			return -ENOMEM;
+		}
+
+		page->magic = BPMP_HOST_STATE_MAGIC;
+		page->max_id = BPMP_HOST_STATE_MAX_ID;
+
+		spin_lock(&bpmp_host_state_lock);
+		vm->state = page;
+		spin_unlock(&bpmp_host_state_lock);
+
+		bpmp_host_state_reset(vm);
+	}
+
+	mutex_unlock(&bpmp_host_state_alloc_lock);
+
+	return remap_vmalloc_range(vma, page, 0);
+}
+
+void bpmp_host_state_exit(void)
+{
+	int i;
+
+	BUILD_BUG_ON(BPMP_HOST_STATE_MAX_ID != BPMP_HOST_MAX_RES_ID);
+
+	for (i = 0; i < BPMP_HOST_MAX_VMS; i++) {
+		vfree(bpmp_host_vms[i].state);
+		bpmp_host_vms[i].state = NULL;
+	}
+}
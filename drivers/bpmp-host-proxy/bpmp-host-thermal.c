@@ -0,0 +1,275 @@
+/**
+ *
+ * NVIDIA BPMP Host Proxy Kernel Module
+ * Thermal sampling page
+ *
+ * The host samples the temperature of the BPMP thermal zones at a fixed
+ * period and publishes it in a page that the VMMs map read-only and can
+ * expose to their VMs, so the VMs read the temperatures without a message
+ * to the BPMP. Trip point crossings are notified through an eventfd per VM
+ * instead of making the VMs poll.
+ *
+*/
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/uaccess.h>
+#include <linux/eventfd.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/capability.h>
+#include "bpmp-host-internal.h"
+
+
+static struct bpmp_host_thermal_page *bpmp_host_thermal_page;	///< vmalloc_user() page mapped by the VMMs
+static struct delayed_work bpmp_host_thermal_work;
+
+// Protects the configuration below, the eventfds and the page writes
+static DEFINE_MUTEX(bpmp_host_thermal_lock);
+
+static u32 bpmp_host_thermal_period;
+static u32 bpmp_host_thermal_num_zones;
+static u32 bpmp_host_thermal_num_trips;
+static s32 bpmp_host_thermal_trips[BPMP_HOST_THERMAL_MAX_ZONES][BPMP_HOST_THERMAL_MAX_TRIPS];
+static struct eventfd_ctx *bpmp_host_thermal_eventfd[BPMP_HOST_MAX_VMS];
+
+static int bpmp_host_thermal_xfer(u32 type, u32 zone,
+	union mrq_thermal_bpmp_to_host_response *resp)
+{
+	struct mrq_thermal_host_to_bpmp_request req = {
+		.type = type,
+		.get_temp.zone = zone,
+	};
+	struct tegra_bpmp_message msg = {
+		.mrq = MRQ_THERMAL,
+		.tx = {
+			.data = &req,
+			.size = sizeof(req),
+		},
+		.rx = {
+			.data = resp,
+			.size = sizeof(*resp),
+		},
+	};
+	int ret;
+
+	ret = tegra_bpmp_transfer(tegra_bpmp_host_device, &msg);
+	if (ret)
+		return ret;
+
+	return msg.rx.ret ? -EIO : 0;
+}
+
+/*
+ * Returns the number of trip points of the zone at or below temp
+ */
+static u32 bpmp_host_thermal_trip(u32 zone, s32 temp)
+{
+	u32 i;
+
+	for (i = 0; i < bpmp_host_thermal_num_trips; i++)
+		if (temp < bpmp_host_thermal_trips[zone][i])
+			break;
+
+	return i;
+}
+
+static void bpmp_host_thermal_sample(struct work_struct *work)
+{
+	struct bpmp_host_thermal_page *page = bpmp_host_thermal_page;
+	union mrq_thermal_bpmp_to_host_response resp;
+	s32 temp[BPMP_HOST_THERMAL_MAX_ZONES];
+	int err[BPMP_HOST_THERMAL_MAX_ZONES];
+	u64 now[BPMP_HOST_THERMAL_MAX_ZONES];
+	bool crossed = false;
+	u32 zone, trip;
+	int i;
+
+	mutex_lock(&bpmp_host_thermal_lock);
+
+	if (!bpmp_host_thermal_period)
+		goto out;
+
+	// Sampled before taking the page, so the readers never retry for long
+	for (zone = 0; zone < bpmp_host_thermal_num_zones; zone++) {
+		err[zone] = bpmp_host_thermal_xfer(CMD_THERMAL_GET_TEMP, zone, &resp);
+		temp[zone] = resp.get_temp.temp;
+		now[zone] = ktime_get_ns();
+	}
+
+	WRITE_ONCE(page->seq, page->seq + 1);
+	smp_wmb();
+
+	for (zone = 0; zone < bpmp_host_thermal_num_zones; zone++) {
+		page->zones[zone].err = err[zone];
+		if (err[zone])
+			continue;
+
+		page->zones[zone].temp = temp[zone];
+		page->zones[zone].timestamp_ns = now[zone];
+
+		trip = bpmp_host_thermal_trip(zone, temp[zone]);
+		if (trip != page->zones[zone].trip) {
+			page->zones[zone].trip = trip;
+			crossed = true;
+		}
+	}
+	page->timestamp_ns = ktime_get_ns();
+	if (crossed)
+		page->trip_seq++;
+
+	smp_wmb();
+	WRITE_ONCE(page->seq, page->seq + 1);
+
+	if (crossed) {
+		for (i = 0; i < BPMP_HOST_MAX_VMS; i++)
+			if (bpmp_host_thermal_eventfd[i])
+				eventfd_signal(bpmp_host_thermal_eventfd[i]);
+	}
+
+	queue_delayed_work(system_power_efficient_wq, &bpmp_host_thermal_work,
+		msecs_to_jiffies(bpmp_host_thermal_period));
+out:
+	mutex_unlock(&bpmp_host_thermal_lock);
+}
+
+/*
+ * Starts, reconfigures or stops the sampling
+ */
+long bpmp_host_thermal_setup(struct bpmp_host_thermal_setup __user *usetup)
+{
+	struct bpmp_host_thermal_page *page = bpmp_host_thermal_page;
+	struct bpmp_host_thermal_setup setup;
+	union mrq_thermal_bpmp_to_host_response resp;
+	u32 zone, i;
+	int ret;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	if (copy_from_user(&setup, usetup, sizeof(setup)))
+		return -EFAULT;
+
+	if ((setup.period_ms && setup.period_ms < BPMP_HOST_THERMAL_MIN_PERIOD) ||
+	    setup.num_trips > BPMP_HOST_THERMAL_MAX_TRIPS)
+		return -EINVAL;
+
+	for (zone = 0; zone < BPMP_HOST_THERMAL_MAX_ZONES; zone++)
+		for (i = 1; i < setup.num_trips; i++)
+			if (setup.trips[zone][i] < setup.trips[zone][i - 1])
+				return -EINVAL;
+
+	if (!setup.period_ms) {
+		mutex_lock(&bpmp_host_thermal_lock);
+		bpmp_host_thermal_period = 0;
+		WRITE_ONCE(page->period_ms, 0);
+		mutex_unlock(&bpmp_host_thermal_lock);
+
+		cancel_delayed_work_sync(&bpmp_host_thermal_work);
+		return 0;
+	}
+
+	ret = bpmp_host_thermal_xfer(CMD_THERMAL_GET_NUM_ZONES, 0, &resp);
+	if (ret)
+		return ret;
+
+	mutex_lock(&bpmp_host_thermal_lock);
+
+	bpmp_host_thermal_num_zones = min_t(u32, resp.get_num_zones.num,
+		BPMP_HOST_THERMAL_MAX_ZONES);
+	bpmp_host_thermal_num_trips = setup.num_trips;
+	memcpy(bpmp_host_thermal_trips, setup.trips, sizeof(setup.trips));
+	bpmp_host_thermal_period = setup.period_ms;
+
+	WRITE_ONCE(page->seq, page->seq + 1);
+	smp_wmb();
+	page->num_zones = bpmp_host_thermal_num_zones;
+	page->period_ms = bpmp_host_thermal_period;
+	smp_wmb();
+	WRITE_ONCE(page->seq, page->seq + 1);
+
+	mutex_unlock(&bpmp_host_thermal_lock);
+
+	mod_delayed_work(system_power_efficient_wq, &bpmp_host_thermal_work, 0);
+	deb_info("thermal sampling of %u zones every %u ms\n",
+		bpmp_host_thermal_num_zones, bpmp_host_thermal_period);
+
+	return 0;
+}
+
+/*
+ * Sets the eventfd signalled on trip crossings for the VM, -1 removes it
+ */
+long bpmp_host_thermal_set_eventfd(struct bpmp_host_vm *vm, __s32 __user *ufd)
+{
+	struct eventfd_ctx *eventfd = NULL;
+	struct eventfd_ctx *old;
+	__s32 fd;
+
+	if (get_user(fd, ufd))
+		return -EFAULT;
+
+	if (fd >= 0) {
+		eventfd = eventfd_ctx_fdget(fd);
+		if (IS_ERR(eventfd))
+			return PTR_ERR(eventfd);
+	}
+
+	mutex_lock(&bpmp_host_thermal_lock);
+	old = bpmp_host_thermal_eventfd[vm->id];
+	bpmp_host_thermal_eventfd[vm->id] = eventfd;
+	mutex_unlock(&bpmp_host_thermal_lock);
+
+	if (old)
+		eventfd_ctx_put(old);
+
+	return 0;
+}
+
+/*
+ * Maps the thermal page, read-only, to the VMM
+ */
+int bpmp_host_thermal_mmap(struct vm_area_struct *vma)
+{
+	if (vma->vm_end - vma->vm_start != PAGE_SIZE)
+		return -EINVAL;
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+
+	vm_flags_clear(vma, VM_MAYWRITE);
+
+	return remap_vmalloc_range(vma, bpmp_host_thermal_page, 0);
+}
+
+int bpmp_host_thermal_init(void)
+{
+	BUILD_BUG_ON(sizeof(struct bpmp_host_thermal_page) > PAGE_SIZE);
+
+	bpmp_host_thermal_page = vmalloc_user(PAGE_SIZE);
+	if (!bpmp_host_thermal_page)
+		return -ENOMEM;
+
+	INIT_DELAYED_WORK(&bpmp_host_thermal_work, bpmp_host_thermal_sample);
+
+	return 0;
+}
+
+void bpmp_host_thermal_exit(void)
+{
+	int i;
+
+	mutex_lock(&bpmp_host_thermal_lock);
+	bpmp_host_thermal_period = 0;
+	mutex_unlock(&bpmp_host_thermal_lock);
+
+	cancel_delayed_work_sync(&bpmp_host_thermal_work);
+
+	for (i = 0; i < BPMP_HOST_MAX_VMS; i++) {
+		if (bpmp_host_thermal_eventfd[i])
+			eventfd_ctx_put(bpmp_host_thermal_eventfd[i]);
+		bpmp_host_thermal_eventfd[i] = NULL;
+	}
+
+	vfree(bpmp_host_thermal_page);
+}
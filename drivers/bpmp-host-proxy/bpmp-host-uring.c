@@ -0,0 +1,166 @@
+/**
+ *
+ * NVIDIA BPMP Host Proxy Kernel Module
+ * io_uring passthrough commands
+ *
+ * A BPMP_HOST_URING_CMD_XFER command carries the same struct
+ * tegra_bpmp_message as write(). The message is copied in and validated
+ * at submission, queued to the scheduler and copied back to the VMM from
+ * its own task when the command completes, so the VMM event loop never
+ * blocks on tegra_bpmp_transfer.
+ *
+*/
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/mempool.h>
+#include <linux/io_uring/cmd.h>
+#include "bpmp-host-internal.h"
+
+
+struct bpmp_host_uring_req {
+	struct io_uring_cmd *ioucmd;
+	struct bpmp_host_vm *vm;
+	struct tegra_bpmp_message __user *umsg;
+	struct tegra_bpmp_message msg;       ///< Copy with the data pointing to tx/rx
+	void __user *userrxbuf;
+	struct bpmp_host_req breq;           ///< Scheduler request
+	struct bpmp_host_xfer_buf buf;       ///< Same sizes as the buffers of write()
+};
+
+// Requests are taken from a pool, so that submissions do not fail under memory pressure
+static mempool_t *bpmp_host_uring_pool = NULL;
+
+// Per command data kept in the io_uring_cmd
+struct bpmp_host_uring_pdu {
+	struct bpmp_host_uring_req *req;
+};
+
+static inline struct bpmp_host_uring_pdu *bpmp_host_uring_pdu(struct io_uring_cmd *ioucmd)
+{
+	BUILD_BUG_ON(sizeof(struct bpmp_host_uring_pdu) > sizeof(ioucmd->pdu));
+	return (struct bpmp_host_uring_pdu *)ioucmd->pdu;
+}
+
+/*
+ * Copies the results back to the VMM and completes the command. Runs
+ * in the context of the task that submitted it.
+ */
+static void bpmp_host_uring_done(struct io_uring_cmd *ioucmd, unsigned issue_flags)
+{
+	struct bpmp_host_uring_req *req = bpmp_host_uring_pdu(ioucmd)->req;
+	int ret = req->breq.ret;
+
+	if (!ret) {
+		if (copy_to_user(req->userrxbuf, req->buf.rx, req->msg.rx.size) ||
+		    put_user(req->msg.rx.ret, &req->umsg->rx.ret)) {
+			deb_error("uring copy_to_user failed\n");
+			ret = -EFAULT;
+		}
+	}
+
+	io_uring_cmd_done(ioucmd, ret, 0, issue_flags);
+	mempool_free(req, bpmp_host_uring_pool);
+}
+
+/*
+ * Called by the scheduler once the message was transferred
+ */
+static void bpmp_host_uring_xfer_done(struct bpmp_host_req *breq)
+{
+	struct bpmp_host_uring_req *req = container_of(breq, struct bpmp_host_uring_req, breq);
+
+	io_uring_cmd_complete_in_task(req->ioucmd, bpmp_host_uring_done);
+}
+
+/*
+ * Copies in the message of a BPMP_HOST_URING_CMD_XFER command
+ */
+static int bpmp_host_uring_prep(struct bpmp_host_uring_req *req,
+	const struct bpmp_host_uring_cmd *cmd)
+{
+	const void __user *usertxbuf;
+
+	if (READ_ONCE(cmd->flags))
+		return -EINVAL;
+
+	req->umsg = u64_to_user_ptr(READ_ONCE(cmd->msg));
+	if (copy_from_user(&req->msg, req->umsg, sizeof(req->msg)))
+		return -EFAULT;
+
+	if (req->msg.tx.size > BUF_SIZE || req->msg.rx.size > BUF_SIZE)
+		return -EINVAL;
+
+	usertxbuf = (const void __user *)req->msg.tx.data;
+	req->userrxbuf = (void __user *)req->msg.rx.data;
+
+	if (copy_from_user(req->buf.tx, usertxbuf, req->msg.tx.size))
+		return -EFAULT;
+
+	memset(req->buf.rx, 0, req->msg.rx.size);
+	req->msg.tx.data = req->buf.tx;
+	req->msg.rx.data = req->buf.rx;
+
+	return 0;
+}
+
+/*
+ * file_operations uring_cmd hook
+ */
+int bpmp_host_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags)
+{
+	struct bpmp_host_proxy_file *pfile = ioucmd->file->private_data;
+	struct bpmp_host_uring_req *req;
+	int ret;
+
+	if (ioucmd->cmd_op != BPMP_HOST_URING_CMD_XFER)
+		return -ENOTTY;
+
+	// Without blocking, io_uring retries -EAGAIN from a worker that can sleep
+	req = mempool_alloc(bpmp_host_uring_pool,
+		issue_flags & IO_URING_F_NONBLOCK ? GFP_NOWAIT : GFP_KERNEL);
+	if (!req)
+		return -EAGAIN;
+	memset(req, 0, offsetof(struct bpmp_host_uring_req, buf));
+
+	req->vm = READ_ONCE(pfile->vm);
+
+	ret = bpmp_host_uring_prep(req, io_uring_sqe_cmd(ioucmd->sqe));
+	if (!ret)
+		ret = bpmp_host_proxy_validate(req->vm, &req->msg);
+	if (ret)
+		goto err;
+
+	req->ioucmd = ioucmd;
+	bpmp_host_uring_pdu(ioucmd)->req = req;
+	req->breq.vm = req->vm;
+	req->breq.msg = &req->msg;
+	req->breq.done = bpmp_host_uring_xfer_done;
+
+	// io_uring retries from a worker that can block if the queue is full
+	ret = bpmp_host_sched_submit(&req->breq, issue_flags & IO_URING_F_NONBLOCK);
+	if (ret)
+		goto err;
+
+	return -EIOCBQUEUED;
+
+err:
+	mempool_free(req, bpmp_host_uring_pool);
+	return ret;
+}
+
+int bpmp_host_uring_init(void)
+{
+	bpmp_host_uring_pool = mempool_create_kmalloc_pool(BPMP_HOST_POOL_MIN,
+		sizeof(struct bpmp_host_uring_req));
+	if (!bpmp_host_uring_pool)
+		return -ENOMEM;
+
+	return 0;
+}
+
+void bpmp_host_uring_exit(void)
+{
+	mempool_destroy(bpmp_host_uring_pool);
+}
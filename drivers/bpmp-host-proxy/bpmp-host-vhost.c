@@ -0,0 +1,413 @@
+/**
+ *
+ * NVIDIA BPMP Host Proxy Kernel Module
+ * In-kernel backend of the guest slots
+ *
+ * Like vhost, the VMM hands the message slots of a VM, a doorbell eventfd
+ * and a completion eventfd to the host proxy once, and the messages the
+ * guest puts in its slots are then checked, scheduled and answered here,
+ * without an exit to the VMM and a write() per message. The slots are
+ * pinned and mapped in the kernel for as long as the file is open.
+ *
+ * The guest memory can change at any time, so each message is copied
+ * before being checked, and only its answer is written back.
+ *
+*/
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/file.h>
+#include <linux/mm.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/uaccess.h>
+#include <linux/eventfd.h>
+#include <linux/wait.h>
+#include <linux/overflow.h>
+#include <linux/capability.h>
+#include "bpmp-host-internal.h"
+
+
+struct bpmp_host_vhost;
+
+/**
+ * A guest slot with a message in flight
+ */
+struct bpmp_host_vhost_slot {
+	struct bpmp_host_vhost *vh;
+	u32 index;
+	struct bpmp_host_req req;		///< Scheduler request
+	struct tegra_bpmp_message msg;		///< Copy with the data pointing to tx/rx
+	bool compound;				///< BPMP_VIRT_MSG_F_COMPOUND message
+	u8 tx[BPMP_VIRT_COMPOUND_MAX_SIZE];
+	u8 rx[BPMP_VIRT_COMPOUND_MAX_SIZE];
+};
+
+struct bpmp_host_vhost {
+	struct bpmp_host_proxy_file *pfile;
+	struct page **pages;			///< Pinned guest pages of the slots
+	unsigned long nr_pages;
+	void *map;				///< vmap() of the pages
+	void *slots;				///< Slot 0 in map
+	u32 num_slots;
+	u32 slot_size;
+	struct file *kick;			///< Doorbell eventfd
+	wait_queue_head_t *kick_wqh;
+	wait_queue_entry_t kick_wait;
+	poll_table kick_pt;
+	struct eventfd_ctx *call;		///< Completion eventfd, if any
+	struct work_struct work;
+	DECLARE_BITMAP(busy, BPMP_HOST_VHOST_MAX_SLOTS);	///< Slots with a message in flight
+	atomic_t inflight;
+	wait_queue_head_t idle;			///< Woken up when inflight drops to 0
+	bool stopped;
+	struct bpmp_host_vhost_slot slot[];
+};
+
+static inline struct bpmp_virt_slot_hdr *bpmp_host_vhost_slot_hdr(struct bpmp_host_vhost *vh,
+	u32 index)
+{
+	return vh->slots + index * vh->slot_size;
+}
+
+/*
+ * Writes the answer to the guest slot and marks it done. The busy bit is
+ * cleared last, so the slot is not submitted twice.
+ */
+static void bpmp_host_vhost_complete(struct bpmp_host_vhost_slot *slot, int err)
+{
+	struct bpmp_host_vhost *vh = slot->vh;
+	struct bpmp_virt_slot_hdr *shdr = bpmp_host_vhost_slot_hdr(vh, slot->index);
+	struct bpmp_virt_msg_hdr *hdr = (struct bpmp_virt_msg_hdr *)(shdr + 1);
+	// The step answers of a compound message are also valid when one failed
+	u32 rx_size = err && !slot->compound ? 0 : slot->msg.rx.size;
+
+	if (rx_size)
+		memcpy((void *)hdr + BPMP_VIRT_MSG_SIZE(slot->msg.tx.size, 0), slot->rx, rx_size);
+
+	WRITE_ONCE(hdr->err, err);
+	WRITE_ONCE(hdr->ret, err ? 0 : slot->msg.rx.ret);
+	WRITE_ONCE(hdr->rx_size, rx_size);
+
+	smp_wmb();
+	WRITE_ONCE(shdr->state, BPMP_VIRT_SLOT_DONE);
+
+	if (vh->call)
+		eventfd_signal(vh->call);
+
+	clear_bit_unlock(slot->index, vh->busy);
+	smp_mb__after_atomic();
+
+	// The guest can reuse the slot before the busy bit is cleared
+	rcu_read_lock();
+	if (!READ_ONCE(vh->stopped) &&
+	    READ_ONCE(shdr->state) == BPMP_VIRT_SLOT_SUBMITTED)
+		queue_work(bpmp_host_proxy_wq, &vh->work);
+
+	if (atomic_dec_and_test(&vh->inflight))
+		wake_up(&vh->idle);
+	rcu_read_unlock();
+}
+
+/*
+ * Called by the scheduler once the message was transferred
+ */
+static void bpmp_host_vhost_xfer_done(struct bpmp_host_req *req)
+{
+	struct bpmp_host_vhost_slot *slot = container_of(req, struct bpmp_host_vhost_slot, req);
+
+	bpmp_host_vhost_complete(slot, req->ret);
+}
+
+/*
+ * Copies in the message of a submitted slot
+ */
+static int bpmp_host_vhost_prep(struct bpmp_host_vhost_slot *slot)
+{
+	struct bpmp_host_vhost *vh = slot->vh;
+	struct bpmp_virt_msg_hdr *uhdr =
+		(struct bpmp_virt_msg_hdr *)(bpmp_host_vhost_slot_hdr(vh, slot->index) + 1);
+	struct bpmp_virt_msg_hdr hdr;
+	u32 max_size;
+
+	memcpy(&hdr, uhdr, sizeof(hdr));
+
+	// Nothing but the header is answered if the message is invalid
+	slot->msg.tx.size = 0;
+	slot->msg.rx.size = 0;
+	slot->compound = hdr.flags == BPMP_VIRT_MSG_F_COMPOUND;
+	max_size = slot->compound ? BPMP_VIRT_COMPOUND_MAX_SIZE : BPMP_HOST_MAX_PAYLOAD;
+
+	if (hdr.magic != BPMP_VIRT_MSG_MAGIC || hdr.hdr_size != sizeof(hdr) ||
+	    (hdr.flags & ~BPMP_VIRT_MSG_F_COMPOUND) ||
+	    hdr.tx_size > max_size || hdr.rx_size > max_size ||
+	    sizeof(struct bpmp_virt_slot_hdr) +
+	    BPMP_VIRT_MSG_SIZE(hdr.tx_size, hdr.rx_size) > vh->slot_size)
+		return -EINVAL;
+
+	memcpy(slot->tx, uhdr + 1, hdr.tx_size);
+	memset(slot->rx, 0, hdr.rx_size);
+
+	slot->msg.mrq = hdr.mrq;
+	slot->msg.tx.data = slot->tx;
+	slot->msg.tx.size = hdr.tx_size;
+	slot->msg.rx.data = slot->rx;
+	slot->msg.rx.size = hdr.rx_size;
+	slot->msg.rx.ret = 0;
+
+	return 0;
+}
+
+static void bpmp_host_vhost_submit(struct bpmp_host_vhost_slot *slot)
+{
+	struct bpmp_host_vhost *vh = slot->vh;
+	struct bpmp_host_vm *vm = READ_ONCE(vh->pfile->vm);
+	int xfer_ret = 0;
+	int ret;
+
+	atomic_inc(&vh->inflight);
+
+	ret = bpmp_host_vhost_prep(slot);
+	if (ret)
+		goto err;
+
+	// The steps are transferred one after the other, the scan waits for them
+	if (slot->compound) {
+		ret = bpmp_host_compound_xfer(vm, &slot->msg, false, &xfer_ret);
+		bpmp_host_vhost_complete(slot, ret ? ret : xfer_ret);
+		return;
+	}
+
+	ret = bpmp_host_proxy_validate(vm, &slot->msg);
+	if (ret)
+		goto err;
+
+	slot->req.vm = vm;
+	slot->req.msg = &slot->msg;
+	slot->req.done = bpmp_host_vhost_xfer_done;
+
+	// Blocks while the queue of the VM is full, like the synchronous path
+	ret = bpmp_host_sched_submit(&slot->req, false);
+	if (ret)
+		goto err;
+
+	return;
+
+err:
+	bpmp_host_vhost_complete(slot, ret);
+}
+
+/*
+ * Submits the messages of the slots the guest marked as submitted
+ */
+static void bpmp_host_vhost_work(struct work_struct *work)
+{
+	struct bpmp_host_vhost *vh = container_of(work, struct bpmp_host_vhost, work);
+	struct bpmp_virt_slot_hdr *shdr;
+	u32 index;
+
+	for (index = 0; index < vh->num_slots; index++) {
+		if (READ_ONCE(vh->stopped))
+			return;
+
+		if (test_bit(index, vh->busy))
+			continue;
+
+		shdr = bpmp_host_vhost_slot_hdr(vh, index);
+		if (READ_ONCE(shdr->state) != BPMP_VIRT_SLOT_SUBMITTED ||
+		    test_and_set_bit_lock(index, vh->busy))
+			continue;
+
+		// The message is read after its state
+		smp_rmb();
+		bpmp_host_vhost_submit(&vh->slot[index]);
+	}
+}
+
+/*
+ * Doorbell eventfd wakeup. Its counter is not read, like with vhost, each
+ * signal schedules a scan of the slots.
+ */
+static int bpmp_host_vhost_wakeup(wait_queue_entry_t *wait, unsigned int mode,
+	int sync, void *key)
+{
+	struct bpmp_host_vhost *vh = container_of(wait, struct bpmp_host_vhost, kick_wait);
+
+	if (key_to_poll(key) & EPOLLIN)
+		queue_work(bpmp_host_proxy_wq, &vh->work);
+
+	return 0;
+}
+
+static void bpmp_host_vhost_poll_queue(struct file *file, wait_queue_head_t *wqh,
+	poll_table *pt)
+{
+	struct bpmp_host_vhost *vh = container_of(pt, struct bpmp_host_vhost, kick_pt);
+
+	vh->kick_wqh = wqh;
+	add_wait_queue(wqh, &vh->kick_wait);
+}
+
+/*
+ * Pins and maps the slots of the guest
+ */
+static int bpmp_host_vhost_map(struct bpmp_host_vhost *vh, u64 uaddr)
+{
+	unsigned long start = uaddr & PAGE_MASK;
+	unsigned long end = PAGE_ALIGN(uaddr + (u64)vh->num_slots * vh->slot_size);
+	long pinned;
+	int ret;
+
+	vh->nr_pages = (end - start) >> PAGE_SHIFT;
+	vh->pages = kvcalloc(vh->nr_pages, sizeof(*vh->pages), GFP_KERNEL);
+	if (!vh->pages)
+		return -ENOMEM;
+
+	pinned = pin_user_pages_fast(start, vh->nr_pages, FOLL_WRITE | FOLL_LONGTERM,
+		vh->pages);
+	if (pinned != vh->nr_pages) {
+		ret = pinned < 0 ? pinned : -EFAULT;
+		goto err_unpin;
+	}
+
+	vh->map = vmap(vh->pages, vh->nr_pages, VM_MAP, PAGE_KERNEL);
+	if (!vh->map) {
+		ret = -ENOMEM;
+		goto err_unpin;
+	}
+
+	vh->slots = vh->map + offset_in_page(uaddr);
+
+	return 0;
+
+err_unpin:
+	if (pinned > 0)
+		unpin_user_pages(vh->pages, pinned);
+	kvfree(vh->pages);
+	return ret;
+}
+
+static void bpmp_host_vhost_unmap(struct bpmp_host_vhost *vh)
+{
+	vunmap(vh->map);
+	unpin_user_pages_dirty_lock(vh->pages, vh->nr_pages, true);
+	kvfree(vh->pages);
+}
+
+/*
+ * Starts the in-kernel backend of an open file
+ */
+long bpmp_host_vhost_setup(struct bpmp_host_proxy_file *pfile,
+	struct bpmp_host_vhost_setup __user *usetup)
+{
+	struct bpmp_host_vhost_setup setup;
+	struct bpmp_host_vhost *vh;
+	__poll_t mask;
+	long ret;
+	u32 i;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	if (copy_from_user(&setup, usetup, sizeof(setup)))
+		return -EFAULT;
+
+	if (!setup.num_slots || setup.num_slots > BPMP_HOST_VHOST_MAX_SLOTS ||
+	    setup.slot_size % sizeof(struct bpmp_virt_slot_hdr) ||
+	    setup.slot_size < sizeof(struct bpmp_virt_slot_hdr) + BPMP_VIRT_MSG_SIZE(0, 0) ||
+	    setup.slot_size > PAGE_SIZE ||
+	    setup.uaddr % sizeof(struct bpmp_virt_slot_hdr) || setup.kick_fd < 0)
+		return -EINVAL;
+
+	vh = kzalloc(struct_size(vh, slot, setup.num_slots), GFP_KERNEL);
+	if (!vh)
+		return -ENOMEM;
+
+	vh->pfile = pfile;
+	vh->num_slots = setup.num_slots;
+	vh->slot_size = setup.slot_size;
+	atomic_set(&vh->inflight, 0);
+	init_waitqueue_head(&vh->idle);
+	INIT_WORK(&vh->work, bpmp_host_vhost_work);
+	init_waitqueue_func_entry(&vh->kick_wait, bpmp_host_vhost_wakeup);
+	init_poll_funcptr(&vh->kick_pt, bpmp_host_vhost_poll_queue);
+
+	for (i = 0; i < vh->num_slots; i++) {
+		vh->slot[i].vh = vh;
+		vh->slot[i].index = i;
+	}
+
+	ret = bpmp_host_vhost_map(vh, setup.uaddr);
+	if (ret)
+		goto err_free;
+
+	vh->kick = eventfd_fget(setup.kick_fd);
+	if (IS_ERR(vh->kick)) {
+		ret = PTR_ERR(vh->kick);
+		goto err_unmap;
+	}
+
+	if (setup.call_fd >= 0) {
+		vh->call = eventfd_ctx_fdget(setup.call_fd);
+		if (IS_ERR(vh->call)) {
+			ret = PTR_ERR(vh->call);
+			goto err_kick;
+		}
+	}
+
+	// Only one backend per open file
+	if (cmpxchg(&pfile->vhost, NULL, vh)) {
+		ret = -EBUSY;
+		goto err_call;
+	}
+
+	// Doorbells rung before the setup are served right away
+	mask = vfs_poll(vh->kick, &vh->kick_pt);
+	if (mask & EPOLLIN)
+		queue_work(bpmp_host_proxy_wq, &vh->work);
+
+	deb_info("vhost backend with %u slots of %u bytes\n", vh->num_slots, vh->slot_size);
+
+	return 0;
+
+err_call:
+	if (vh->call)
+		eventfd_ctx_put(vh->call);
+err_kick:
+	fput(vh->kick);
+err_unmap:
+	bpmp_host_vhost_unmap(vh);
+err_free:
+	kfree(vh);
+	return ret;
+}
+
+/*
+ * Stops the backend when the file is closed, once the messages in flight
+ * are answered
+ */
+void bpmp_host_vhost_release(struct bpmp_host_proxy_file *pfile)
+{
+	struct bpmp_host_vhost *vh = pfile->vhost;
+
+	if (!vh)
+		return;
+
+	if (vh->kick_wqh)
+		remove_wait_queue(vh->kick_wqh, &vh->kick_wait);
+
+	WRITE_ONCE(vh->stopped, true);
+	cancel_work_sync(&vh->work);
+	wait_event(vh->idle, !atomic_read(&vh->inflight));
+
+	// A completion can have queued the work, or be waking up idle
+	cancel_work_sync(&vh->work);
+	synchronize_rcu();
+
+	if (vh->call)
+		eventfd_ctx_put(vh->call);
+	fput(vh->kick);
+	bpmp_host_vhost_unmap(vh);
+	kfree(vh);
+	pfile->vhost = NULL;
+}
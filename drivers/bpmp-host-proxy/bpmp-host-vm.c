@@ -0,0 +1,334 @@
+/**
+ *
+ * NVIDIA BPMP Host Proxy Kernel Module
+ * Per VM state and runtime policies
+ *
+ * Each VM has its own policy, buffer pool and counters, and its own
+ * /dev/bpmp-host-vmN device, so the VMs do not share any state on the
+ * transfer path.
+ *
+ * Each VM can have its own policy, loaded, replaced and dropped at runtime
+ * by the VMM. Without one, the policy from the device tree applies. The
+ * policies are RCU protected, so the transfers look them up without taking
+ * a lock and a reload never waits for the transfers in flight.
+ *
+ * The clocks and power domains that a new policy no longer allows, and
+ * all of them when the last file of the VM is closed, are released from
+ * the shadow state, so that a VM restarted by its VMM starts clean. Its
+ * bandwidth requests are dropped from the aggregates when the last file
+ * is closed or its policy dropped.
+ *
+*/
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/uaccess.h>
+#include <linux/capability.h>
+#include "bpmp-host-internal.h"
+
+
+struct bpmp_host_vm bpmp_host_vms[BPMP_HOST_MAX_VMS];
+
+// Serializes the policy updates
+static DEFINE_MUTEX(bpmp_host_vm_lock);
+
+struct bpmp_host_vm *bpmp_host_vm_get(u32 vm_id)
+{
+	if (vm_id >= BPMP_HOST_MAX_VMS)
+		return NULL;
+
+	return &bpmp_host_vms[vm_id];
+}
+
+/*
+ * Checks a message against the policy of the VM
+ */
+bool bpmp_host_vm_check(struct bpmp_host_vm *vm, const struct tegra_bpmp_message *msg)
+{
+	const struct bpmp_host_policy *policy;
+	bool allowed;
+
+	rcu_read_lock();
+	policy = rcu_dereference(vm->policy);
+	if (!policy)
+		policy = bpmp_host_default_policy;
+	allowed = bpmp_host_policy_check(policy, msg);
+	rcu_read_unlock();
+
+	return allowed;
+}
+
+/*
+ * Returns the dispatch class of a message of the VM
+ */
+int bpmp_host_vm_class(struct bpmp_host_vm *vm, const struct tegra_bpmp_message *msg)
+{
+	const struct bpmp_host_policy *policy;
+	int class;
+
+	rcu_read_lock();
+	policy = rcu_dereference(vm->policy);
+	if (!policy)
+		policy = bpmp_host_default_policy;
+	class = bpmp_host_policy_class(policy, msg);
+	rcu_read_unlock();
+
+	return class;
+}
+
+/*
+ * Replaces the policy of a VM, NULL restores the device tree policy
+ */
+static void bpmp_host_vm_set_policy(struct bpmp_host_vm *vm,
+	struct bpmp_host_policy *policy)
+{
+	struct bpmp_host_policy *old;
+
+	mutex_lock(&bpmp_host_vm_lock);
+	old = rcu_replace_pointer(vm->policy, policy,
+		lockdep_is_held(&bpmp_host_vm_lock));
+	bpmp_host_sched_release(vm, policy ? policy : bpmp_host_default_policy);
+	// A dropped policy ends the VM configuration, with its bandwidth requests
+	if (!policy)
+		bpmp_host_bwmgr_release(vm);
+	mutex_unlock(&bpmp_host_vm_lock);
+
+	// The state page only shows the resources allowed by the new policy
+	bpmp_host_state_reset(vm);
+
+	if (old)
+		kfree_rcu(old, rcu);
+}
+
+static int bpmp_host_vm_copy_ids(uint32_t *ids, __u64 uids, __u32 size, __u32 max)
+{
+	if (size > max)
+		return -EINVAL;
+
+	if (copy_from_user(ids, u64_to_user_ptr(uids), size * sizeof(*ids)))
+		return -EFAULT;
+
+	return size;
+}
+
+/*
+ * Loads a new policy for a VM, replacing the current one
+ */
+long bpmp_host_vm_load_policy(struct bpmp_host_policy_desc __user *udesc)
+{
+	struct bpmp_host_policy_desc desc;
+	struct bpmp_allowed_res *res;
+	struct bpmp_host_policy *policy;
+	struct bpmp_host_vm *vm;
+	long ret;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	if (copy_from_user(&desc, udesc, sizeof(desc)))
+		return -EFAULT;
+
+	vm = bpmp_host_vm_get(desc.vm_id);
+	if (!vm || desc.flags & ~BPMP_HOST_POLICY_CLASSES)
+		return -EINVAL;
+
+	res = kzalloc(sizeof(*res), GFP_KERNEL);
+	if (!res)
+		return -ENOMEM;
+
+	ret = bpmp_host_vm_copy_ids(res->clock, desc.clocks, desc.clocks_size,
+		BPMP_HOST_MAX_CLOCKS_SIZE);
+	if (ret < 0)
+		goto out;
+	res->clocks_size = ret;
+
+	ret = bpmp_host_vm_copy_ids(res->reset, desc.resets, desc.resets_size,
+		BPMP_HOST_MAX_RESETS_SIZE);
+	if (ret < 0)
+		goto out;
+	res->resets_size = ret;
+
+	ret = bpmp_host_vm_copy_ids(res->pd, desc.pds, desc.pd_size,
+		BPMP_HOST_MAX_POWER_DOMAINS_SIZE);
+	if (ret < 0)
+		goto out;
+	res->pd_size = ret;
+
+	policy = bpmp_host_policy_create(res);
+	if (!policy) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	if (desc.flags & BPMP_HOST_POLICY_CLASSES) {
+		bitmap_from_arr64(policy->critical_mrq, desc.critical_mrqs,
+			BPMP_HOST_MRQ_TABLE_SIZE);
+		policy->critical_clk_cmds = desc.critical_clk_cmds;
+		policy->critical_pg_cmds = desc.critical_pg_cmds;
+	}
+
+	bpmp_host_vm_set_policy(vm, policy);
+	deb_info("loaded policy for vm %u\n", vm->id);
+	ret = 0;
+
+out:
+	kfree(res);
+	return ret;
+}
+
+/*
+ * Drops the policy of a VM, going back to the device tree policy
+ */
+long bpmp_host_vm_drop_policy(__u32 __user *uvm_id)
+{
+	struct bpmp_host_vm *vm;
+	__u32 vm_id;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	if (get_user(vm_id, uvm_id))
+		return -EFAULT;
+
+	vm = bpmp_host_vm_get(vm_id);
+	if (!vm)
+		return -EINVAL;
+
+	bpmp_host_vm_set_policy(vm, NULL);
+	deb_info("dropped policy of vm %u\n", vm->id);
+
+	return 0;
+}
+
+/*
+ * Binds an open file to a VM
+ */
+long bpmp_host_vm_bind(struct bpmp_host_proxy_file *pfile, __u32 __user *uvm_id)
+{
+	struct bpmp_host_vm *vm;
+	__u32 vm_id;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	if (get_user(vm_id, uvm_id))
+		return -EFAULT;
+
+	vm = bpmp_host_vm_get(vm_id);
+	if (!vm)
+		return -EINVAL;
+
+	bpmp_host_vm_open(vm);
+	bpmp_host_vm_close(xchg(&pfile->vm, vm));
+
+	return 0;
+}
+
+/*
+ * Counts a file bound to the VM
+ */
+void bpmp_host_vm_open(struct bpmp_host_vm *vm)
+{
+	atomic_inc(&vm->opens);
+}
+
+/*
+ * Uncounts a file bound to the VM, the last one releases the resources
+ * the VM still uses
+ */
+void bpmp_host_vm_close(struct bpmp_host_vm *vm)
+{
+	if (atomic_dec_and_test(&vm->opens))
+		bpmp_host_sched_release(vm, NULL);
+}
+
+/*
+ * Accounts a message of the VM, ret being its validation or transfer result
+ */
+void bpmp_host_vm_account(struct bpmp_host_vm *vm,
+	const struct tegra_bpmp_message *msg, int ret)
+{
+	if (ret == -EPERM) {
+		atomic64_inc(&vm->rejected);
+		return;
+	}
+
+	if (ret) {
+		atomic64_inc(&vm->errors);
+		return;
+	}
+
+	atomic64_inc(&vm->xfers);
+	atomic64_add(msg->tx.size, &vm->tx_bytes);
+	atomic64_add(msg->rx.size, &vm->rx_bytes);
+}
+
+long bpmp_host_vm_stats(struct bpmp_host_vm *vm,
+	struct bpmp_host_vm_stats __user *ustats)
+{
+	struct bpmp_host_vm_stats stats = {
+		.vm_id = vm->id,
+		.xfers = atomic64_read(&vm->xfers),
+		.rejected = atomic64_read(&vm->rejected),
+		.errors = atomic64_read(&vm->errors),
+		.tx_bytes = atomic64_read(&vm->tx_bytes),
+		.rx_bytes = atomic64_read(&vm->rx_bytes),
+		.elided = atomic64_read(&vm->elided),
+		.coalesced = atomic64_read(&vm->coalesced),
+	};
+
+	bpmp_host_bwmgr_stats(vm, &stats);
+
+	if (copy_to_user(ustats, &stats, sizeof(stats)))
+		return -EFAULT;
+
+	return 0;
+}
+
+int bpmp_host_vm_init(void)
+{
+	struct bpmp_host_vm *vm;
+	int i;
+
+	for (i = 0; i < BPMP_HOST_MAX_VMS; i++) {
+		vm = &bpmp_host_vms[i];
+		vm->id = i;
+		RCU_INIT_POINTER(vm->policy, NULL);
+
+		vm->buf_pool = mempool_create_kmalloc_pool(BPMP_HOST_VM_POOL_MIN,
+			sizeof(struct bpmp_host_xfer_buf));
+		if (!vm->buf_pool)
+			goto err_pool;
+	}
+
+	return 0;
+
+err_pool:
+	while (--i >= 0)
+		mempool_destroy(bpmp_host_vms[i].buf_pool);
+	return -ENOMEM;
+}
+
+/*
+ * Drops the policies of all the VMs, releasing what they hold. Runs while
+ * the scheduler, the shadow state and the state pages are still there.
+ */
+void bpmp_host_vm_release_all(void)
+{
+	int i;
+
+	for (i = 0; i < BPMP_HOST_MAX_VMS; i++)
+		bpmp_host_vm_set_policy(&bpmp_host_vms[i], NULL);
+}
+
+void bpmp_host_vm_exit(void)
+{
+	int i;
+
+	for (i = 0; i < BPMP_HOST_MAX_VMS; i++)
+		mempool_destroy(bpmp_host_vms[i].buf_pool);
+
+	// Wait for the policies freed with kfree_rcu
+	rcu_barrier();
+}